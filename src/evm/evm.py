@@ -19,9 +19,12 @@ def run():
 @click.command()
 @click.option("-o", "--output", type=click.Path(exists=False, file_okay=False, resolve_path=True), default="bin/", help="Sets the output directory for the executable.")
 @click.option("-t", "--tests", is_flag=True, help="Whether or not the test suite should be built.")
+@click.option("-b", "--benchmarks", is_flag=True, help="Whether or not the benchmark suite should be built.")
+@click.option("-O", "--optimize", is_flag=True, help="Whether or not to build with compiler optimizations.")
 @click.option("-d", "--debug", is_flag=True, help="Whether or not to build with debug features.")
 @click.option("--debug-heap", is_flag=True, help="Whether or not to build with debugging code for heap.cpp.")
-def build(output: str, tests: bool, debug: bool, debug_heap: bool):
+@click.option("--linear-free-list", is_flag=True, help="Whether or not the heap should search its free chunks linearly instead of by size, to benchmark against.")
+def build(output: str, tests: bool, benchmarks: bool, optimize: bool, debug: bool, debug_heap: bool, linear_free_list: bool):
     pathlib.Path(output).mkdir(parents=True, exist_ok=True)
 
     resources = {}
@@ -38,9 +41,12 @@ def build(output: str, tests: bool, debug: bool, debug_heap: bool):
     if not tests:
         del resources.get("cpps")["tests.cpp"]
 
+    if not benchmarks:
+        del resources.get("cpps")["benchmarks.cpp"]
+
     # Set build flags
     with open(resources["build.h"], "w") as f:
-        flags = {"BUILD_WITH_TESTS": tests, "BUILD_DEBUG": debug, "BUILD_DEBUG_HEAP": debug_heap}
+        flags = {"BUILD_WITH_TESTS": tests, "BUILD_WITH_BENCHMARKS": benchmarks, "BUILD_DEBUG": debug, "BUILD_DEBUG_HEAP": debug_heap, "BUILD_LINEAR_FREE_LIST": linear_free_list}
 
         for flag, present in flags.items():
             if present:
@@ -55,7 +61,7 @@ def build(output: str, tests: bool, debug: bool, debug_heap: bool):
             f.write("#endif\n")
 
     # Build executable
-    build_call_args = ["g++", "-std=c++2a", "-fdiagnostics-color=always", "-g"]
+    build_call_args = ["g++", "-std=c++2a", "-fdiagnostics-color=always", "-g"] + (["-O2"] if optimize else [])
     input_files = [path for name, path in resources.get("cpps").items()]
     evm_output_path = os.path.join(output, EXECUTABLE_FILE_NAME)
     subprocess.call(build_call_args + ["-o", evm_output_path] + input_files)
@@ -0,0 +1,133 @@
+#include "arena.h"
+#include "heap.h"
+#include "vm.h"
+#include "../build.h"
+
+#pragma region Arena
+
+Arena::Arena(Heap* _heap, vm_ui64 _capacity) : heap(_heap), regions(), top(nullptr), end(nullptr), regionSize(0)
+{
+    Grow(std::max<vm_ui64>(_capacity, MIN_ARENA_REGION_SIZE));
+}
+
+Arena::~Arena()
+{
+    //A guest program may have overwritten the tags of the regions, which must not throw out of a destructor
+    try { Free(); }
+    catch (const VMError&) { }
+}
+
+void Arena::Free()
+{
+    while (!regions.empty())
+    {
+        heap->FreeRegion(regions.back());
+        regions.pop_back();
+    }
+}
+
+void Arena::Grow(vm_ui64 _minSize)
+{
+    if (_minSize > SIZE_MAX / 2)
+        throw VMError::OUT_OF_MEMORY(_minSize);
+
+    //The arena stays as it was if the heap cannot fit the region
+    vm_ui64 size = std::max<vm_ui64>(regionSize * 2, (_minSize + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1));
+    regions.push_back(heap->AllocRegion(size));
+    regionSize = size;
+
+    top = regions.back();
+    end = top + regionSize;
+}
+
+vm_byte* Arena::Alloc(vm_ui64 _amt)
+{
+    if (_amt > SIZE_MAX / 2)
+        throw VMError::OUT_OF_MEMORY(_amt);
+
+    //Keeps every allocation aligned like the ones of the heap
+    _amt = std::max<vm_ui64>((_amt + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1), HEAP_ALIGNMENT);
+    if (_amt > (vm_ui64)(end - top))
+        Grow(_amt);
+
+    vm_byte* addr = top;
+    top += _amt;
+
+    return addr;
+}
+
+void Arena::Reset()
+{
+    for (size_t i = 0; i + 1 < regions.size(); i++)
+        heap->FreeRegion(regions[i]);
+
+    regions.erase(regions.begin(), regions.end() - 1);
+
+    top = regions.back();
+    end = top + regionSize;
+}
+
+#pragma endregion
+
+#pragma region ArenaTable
+
+ArenaTable::ArenaTable(Heap* _heap) : heap(_heap), arenas(), nextID(0)
+{
+}
+
+Arena& ArenaTable::Get(vm_ui64 _id)
+{
+    auto search = arenas.find(_id);
+    if (search == arenas.end())
+        throw VMError::INVALID_ARENA_ID(_id);
+
+    return *search->second;
+}
+
+vm_ui64 ArenaTable::Create(vm_ui64 _capacity)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    arenas.emplace(nextID, std::make_unique<Arena>(heap, _capacity));
+    return nextID++;
+}
+
+vm_byte* ArenaTable::Alloc(vm_ui64 _id, vm_ui64 _amt)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    return Get(_id).Alloc(_amt);
+}
+
+void ArenaTable::Reset(vm_ui64 _id)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    Get(_id).Reset();
+}
+
+void ArenaTable::Destroy(vm_ui64 _id)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    //Frees the regions before the arena is destroyed so that a corrupted heap fails the program
+    Get(_id).Free();
+    arenas.erase(_id);
+}
+
+std::vector<vm_byte*> ArenaTable::GetRegions()
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    std::vector<vm_byte*> regions;
+    for (auto& [id, arena] : arenas)
+        regions.insert(regions.end(), arena->GetRegions().begin(), arena->GetRegions().end());
+
+    return regions;
+}
+
+void ArenaTable::Clear()
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    arenas.clear();
+}
+
+#pragma endregion
\ No newline at end of file
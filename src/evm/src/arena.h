@@ -0,0 +1,69 @@
+#pragma once
+#include "evm.h"
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define MIN_ARENA_REGION_SIZE 256ull
+
+class Heap;
+
+//Hands out memory from regions of the heap by bumping a pointer. Its allocations are never freed one by one: a reset
+//frees all of them at once and keeps only the newest region, which is the biggest one, for the allocations after it.
+//Growing doubles the size of the regions so that an arena that is reset after every request soon needs a single one.
+class Arena
+{
+private:
+    Heap *heap;
+    std::vector<vm_byte *> regions;
+    vm_byte *top, *end;
+    vm_ui64 regionSize; //The size of the newest region
+
+    void Grow(vm_ui64 _minSize);
+
+public:
+    Arena(Heap *_heap, vm_ui64 _capacity);
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    vm_byte *Alloc(vm_ui64 _amt);
+    void Reset();
+    //Frees every region. The arena cannot allocate afterwards.
+    void Free();
+
+    const std::vector<vm_byte *> &GetRegions() const { return regions; }
+    size_t GetRegionCount() const { return regions.size(); }
+};
+
+//Maps ids to the arenas of a vm. Ids are never reused, not even by later runs of the vm, so that the id of a destroyed arena stays invalid.
+class ArenaTable
+{
+private:
+    Heap *heap;
+    std::unordered_map<vm_ui64, std::unique_ptr<Arena>> arenas; //Guarded by mutex
+    vm_ui64 nextID;
+    std::mutex mutex;
+
+    //Returns the arena with the id. Throws INVALID_ARENA_ID if there is none.
+    Arena &Get(vm_ui64 _id);
+
+public:
+    explicit ArenaTable(Heap *_heap);
+
+    ArenaTable(const ArenaTable &) = delete;
+    ArenaTable &operator=(const ArenaTable &) = delete;
+
+    //Creates an arena whose first region holds at least _capacity bytes and returns its id
+    vm_ui64 Create(vm_ui64 _capacity);
+    vm_byte *Alloc(vm_ui64 _id, vm_ui64 _amt);
+    void Reset(vm_ui64 _id);
+    void Destroy(vm_ui64 _id);
+
+    //Returns the regions of every arena
+    std::vector<vm_byte *> GetRegions();
+
+    void Clear();
+};
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include "benchmarks.h"
+#include "evm.h"
+#include "instructions.h"
+#include "program.h"
+#include "vm.h"
+#include "arena.h"
+#include <iomanip>
+#include <thread>
+#include <random>
+
+INIT_BENCHMARK_SUITE();
+
+using Instructions::OpCode, Instructions::SysCallCode, Instructions::AtomicCode, Instructions::DataType;
+
+//Creates the loop from tests/evm/factorial.edeasm computing _n! (modulo 2^64). The number of instructions
+//it executes is 11 per iteration of the loop plus 8 for the setup, final check and exit.
+Program FactorialProgram(vm_ui64 _n, vm_ui64& _instrCount)
+{
+    constexpr vm_ui64 loop = Instructions::PUSH::GetSize() * 2;
+    constexpr vm_ui64 exit = loop + Instructions::SLOAD::GetSize() * 3 + Instructions::PUSH::GetSize() * 2
+        + Instructions::EQ::GetSize() + Instructions::JUMPNZ::GetSize() + Instructions::MUL::GetSize()
+        + Instructions::SUB::GetSize() + Instructions::SSTORE::GetSize() + Instructions::JUMP::GetSize();
+
+    _instrCount = 11 * (_n - 1) + 8;
+
+    return Program::FromCode(
+        OpCode::PUSH, _n,
+        OpCode::PUSH, 1ull,
+        OpCode::SLOAD, -16ll,       //@LOOP
+        OpCode::PUSH, 1ull,
+        OpCode::EQ, DataType::UI64,
+        OpCode::JUMPNZ, exit,
+        OpCode::SLOAD, -16ll,
+        OpCode::MUL, DataType::UI64,
+        OpCode::PUSH, 1ull,
+        OpCode::SLOAD, -24ll,
+        OpCode::SUB, DataType::UI64,
+        OpCode::SSTORE, -16ll,
+        OpCode::JUMP, loop,
+        OpCode::CONVERT, DataType::UI64, DataType::I64, //@EXIT
+        OpCode::SYSCALL, SysCallCode::EXIT);
+}
+
+//Creates a loop that runs _n times and updates an accumulator with acc = acc * 3 + counter, leaving the
+//accumulator as the exit code. The number of instructions it executes is 15 per iteration of the loop
+//plus 7 for the setup, final check and exit.
+Program ArithmeticProgram(vm_ui64 _n, vm_ui64& _instrCount)
+{
+    constexpr vm_ui64 loop = Instructions::PUSH::GetSize() * 2;
+    constexpr vm_ui64 exit = loop + Instructions::SLOAD::GetSize() * 4 + Instructions::PUSH::GetSize() * 3
+        + Instructions::EQ::GetSize() + Instructions::JUMPNZ::GetSize() + Instructions::MUL::GetSize()
+        + Instructions::ADD::GetSize() + Instructions::SUB::GetSize() + Instructions::SSTORE::GetSize() * 2
+        + Instructions::JUMP::GetSize();
+
+    _instrCount = 15 * _n + 7;
+
+    return Program::FromCode(
+        OpCode::PUSH, _n,           //Counter
+        OpCode::PUSH, 0ll,          //Accumulator
+        OpCode::SLOAD, -16ll,       //@LOOP
+        OpCode::PUSH, 0ll,
+        OpCode::EQ, DataType::I64,
+        OpCode::JUMPNZ, exit,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 3ll,
+        OpCode::MUL, DataType::UI64,
+        OpCode::SLOAD, -24ll,
+        OpCode::ADD, DataType::UI64,
+        OpCode::SSTORE, -8ll,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -24ll,
+        OpCode::SUB, DataType::UI64,
+        OpCode::SSTORE, -16ll,
+        OpCode::JUMP, loop,
+        OpCode::SYSCALL, SysCallCode::EXIT); //@EXIT
+}
+
+//Prints the time per instruction of running _program with the given dispatch mode
+void ReportDispatch(const std::string& _name, DispatchMode _mode, Program& _program, vm_ui64 _instrCount)
+{
+    double ns = Benchmark::Measure([&]()
+        {
+            VM vm;
+            vm.SetDispatchMode(_mode);
+            vm.Run(64, _program, {});
+        });
+
+    std::cout << "\t" << std::left << std::setw(16) << _name << std::fixed << std::setprecision(2)
+        << ns / _instrCount << " ns/instr\t(" << _instrCount << " instrs in " << ns / 1e6 << " ms)" << std::endl;
+}
+
+//Prints the time per instruction of running _program with every dispatch mode
+void ReportDispatchModes(Program& _program, vm_ui64 _instrCount)
+{
+    ReportDispatch("switch", DispatchMode::SWITCH, _program, _instrCount);
+#ifdef EVM_THREADED_DISPATCH
+    ReportDispatch("threaded", DispatchMode::THREADED, _program, _instrCount);
+#endif
+    ReportDispatch("cached", DispatchMode::CACHED, _program, _instrCount);
+    ReportDispatch("verified", DispatchMode::VERIFIED, _program, _instrCount);
+#ifdef EVM_JIT
+    ReportDispatch("jit", DispatchMode::JIT, _program, _instrCount);
+#endif
+    ReportDispatch("tiered", DispatchMode::TIERED, _program, _instrCount);
+}
+
+DEFINE_BENCHMARK(FACTORIAL_DISPATCH)
+{
+    vm_ui64 instrCount;
+    Program program = FactorialProgram(1000000, instrCount);
+    ReportDispatchModes(program, instrCount);
+}
+
+DEFINE_BENCHMARK(ARITHMETIC_DISPATCH)
+{
+    vm_ui64 instrCount;
+    Program program = ArithmeticProgram(1000000, instrCount);
+    ReportDispatchModes(program, instrCount);
+}
+
+DEFINE_BENCHMARK(FACTORIAL_FUSION)
+{
+    vm_ui64 instrCount;
+    Program fused = FactorialProgram(1000000, instrCount), unfused = FactorialProgram(1000000, instrCount);
+    unfused.Decode(); //Decoding again drops the superinstructions
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::THREADED })
+    {
+        std::string name = mode == DispatchMode::SWITCH ? "switch" : "threaded";
+        ReportDispatch(name, mode, unfused, instrCount);
+        ReportDispatch(name + "+fused", mode, fused, instrCount);
+    }
+}
+
+DEFINE_BENCHMARK(THREAD_SCALING)
+{
+    //Every thread runs the same loop on its own worker and the first one to finish it exits the program. Threads
+    //that do not wait for each other keep the rate of a single thread as long as there is a core for every worker.
+    vm_ui64 instrCount;
+    Program program = ArithmeticProgram(1000000, instrCount);
+    unsigned cores = std::thread::hardware_concurrency();
+
+    std::cout << "\t" << cores << " hardware threads" << std::endl;
+
+    for (vm_ui64 threads = 1; threads <= std::max(4u, cores); threads *= 2)
+    {
+        double ns = Benchmark::Measure([&]()
+            {
+                VM vm;
+                vm.SetThreadCount(threads);
+                vm.SetWorkerCount(threads);
+                vm.Run(64, program, {});
+            });
+
+        std::cout << "\t" << std::left << std::setw(16) << (std::to_string(threads) + " threads") << std::fixed << std::setprecision(2)
+            << instrCount / ns * 1e3 << " M instrs/s per thread\t(" << ns / 1e6 << " ms)" << std::endl;
+    }
+}
+
+DEFINE_BENCHMARK(SPAWN)
+{
+    //Every thread is spawned before the workers start and the first one to run exits the program, so the time
+    //is almost only that of spawning the threads
+    Program program = Program::FromCode(
+        OpCode::PUSH, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    for (vm_ui64 stackSize : { 64ull, 1024ull, 4096ull })
+    {
+        constexpr vm_ui64 threads = 100000;
+        double ns = Benchmark::Measure([&]()
+            {
+                VM vm;
+                vm.SetThreadCount(threads);
+                vm.Run(stackSize, program, {});
+            });
+
+        std::cout << "\t" << std::left << std::setw(16) << (std::to_string(stackSize) + " B stack") << std::fixed << std::setprecision(2)
+            << ns / threads << " ns/thread\t(" << threads << " threads in " << ns / 1e6 << " ms)" << std::endl;
+    }
+}
+
+//Creates a pipeline where a spawned thread sends _n words through a channel with the capacity and the main thread
+//receives them, leaving their sum as the exit code
+Program ChannelProgram(vm_ui64 _n, vm_ui64 _capacity)
+{
+    constexpr vm_ui64 loop = Instructions::PUSH::GetSize() * 5 + Instructions::SYSCALL::GetSize() * 2
+        + Instructions::SLOAD::GetSize() + Instructions::POP::GetSize();
+    constexpr vm_ui64 end = loop + Instructions::SLOAD::GetSize() * 4 + Instructions::JUMPZ::GetSize()
+        + Instructions::SYSCALL::GetSize() + Instructions::ADD::GetSize() + Instructions::SSTORE::GetSize() * 2
+        + Instructions::PUSH::GetSize() + Instructions::SUB::GetSize() + Instructions::JUMP::GetSize();
+    constexpr vm_ui64 produce = end + Instructions::POP::GetSize() + Instructions::SYSCALL::GetSize();
+    constexpr vm_ui64 produceLoop = produce + Instructions::PUSH::GetSize();
+    constexpr vm_ui64 produceEnd = produceLoop + Instructions::SLOAD::GetSize() * 3 + Instructions::JUMPZ::GetSize()
+        + Instructions::PLOAD::GetSize() + Instructions::SYSCALL::GetSize() + Instructions::PUSH::GetSize()
+        + Instructions::SUB::GetSize() + Instructions::SSTORE::GetSize() + Instructions::JUMP::GetSize();
+
+    return Program::FromCode(
+        OpCode::PUSH, _capacity,
+        OpCode::SYSCALL, SysCallCode::CHANNEL,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, produce,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::POP,
+        OpCode::PUSH, 0ll,                          //Sum
+        OpCode::PUSH, _n,                           //Counter
+        OpCode::SLOAD, -8ll,                        //@LOOP
+        OpCode::JUMPZ, end,
+        OpCode::SLOAD, -24ll,
+        OpCode::SYSCALL, SysCallCode::RECV,
+        OpCode::SLOAD, -24ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SSTORE, -16ll,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, loop,
+        OpCode::POP,                                //@END
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, _n,                           //@PRODUCE
+        OpCode::SLOAD, -8ll,                        //@PRODUCE_LOOP
+        OpCode::JUMPZ, produceEnd,
+        OpCode::SLOAD, -8ll,
+        OpCode::PLOAD, 0u,
+        OpCode::SYSCALL, SysCallCode::SEND,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, produceLoop,
+        OpCode::RET);                               //@PRODUCE_END
+}
+
+DEFINE_BENCHMARK(CHANNEL)
+{
+    //Small channels park one side after every few words while large ones let both run without locking
+    constexpr vm_ui64 words = 100000;
+
+    for (vm_ui64 capacity : { 1ull, 16ull, 1024ull })
+    {
+        Program program = ChannelProgram(words, capacity);
+
+        for (size_t workers : { 1, 2 })
+        {
+            double ns = Benchmark::Measure([&]()
+                {
+                    VM vm;
+                    vm.SetWorkerCount(workers);
+                    vm.Run(1024, program, {});
+                });
+
+            std::cout << "\t" << std::left << std::setw(24) << (std::to_string(capacity) + " slots, " + std::to_string(workers) + " workers")
+                << std::fixed << std::setprecision(2) << ns / words << " ns/word\t(" << ns / 1e6 << " ms)" << std::endl;
+        }
+    }
+}
+
+DEFINE_BENCHMARK(HEAP_ALLOC)
+{
+    //Frees a random live allocation for every allocation once a few thousand are live, so that the free chunks end up
+    //with many distinct sizes. The heap size over the most bytes that were live at once shows how much it fragments.
+    //Building with --linear-free-list gives the numbers of the free list that the bins replaced.
+    constexpr size_t ops = 200000, live = 4000;
+
+#ifdef BUILD_LINEAR_FREE_LIST
+    std::cout << "\tlinear free list" << std::endl;
+#endif
+
+    for (vm_ui64 maxSize : { 256ull, 65536ull })
+    {
+        size_t heapSize = 0, peakLive = 0;
+
+        double ns = Benchmark::Measure([&]()
+            {
+                std::mt19937 rng(42);
+                std::uniform_int_distribution<vm_ui64> sizes(1, maxSize);
+                std::vector<std::pair<vm_byte*, vm_ui64>> allocs;
+                size_t liveBytes = 0;
+                Heap heap(nullptr);
+
+                peakLive = 0;
+                for (size_t i = 0; i < ops; i++)
+                {
+                    if (allocs.size() >= live)
+                    {
+                        std::swap(allocs[rng() % allocs.size()], allocs.back());
+                        heap.Free(allocs.back().first);
+                        liveBytes -= allocs.back().second;
+                        allocs.pop_back();
+                    }
+
+                    vm_ui64 size = sizes(rng);
+                    allocs.emplace_back(heap.Alloc(size), size);
+                    liveBytes += size;
+                    peakLive = std::max(peakLive, liveBytes);
+                }
+
+                heapSize = heap.GetSize();
+            }, 3);
+
+        std::cout << "\t" << std::left << std::setw(24) << ("sizes 1 to " + std::to_string(maxSize)) << std::fixed << std::setprecision(2)
+            << ns / ops << " ns/alloc\t(heap " << heapSize / 1024 << " KiB for " << peakLive / 1024 << " KiB live)" << std::endl;
+    }
+}
+
+DEFINE_BENCHMARK(ARENA_RESET)
+{
+    //Every request allocates objects and throws all of them away, either by freeing them one by one or with a single reset
+    constexpr size_t requests = 2000, objects = 1000;
+    Heap heap(nullptr);
+    std::vector<vm_byte*> allocs(objects);
+
+    double heapNs = Benchmark::Measure([&]()
+        {
+            for (size_t request = 0; request < requests; request++)
+            {
+                for (size_t i = 0; i < objects; i++)
+                    allocs[i] = heap.Alloc(32);
+
+                for (vm_byte* alloc : allocs)
+                    heap.Free(alloc);
+            }
+        }, 3);
+
+    double arenaNs = Benchmark::Measure([&]()
+        {
+            Arena arena(&heap, 0);
+            for (size_t request = 0; request < requests; request++)
+            {
+                for (size_t i = 0; i < objects; i++)
+                    allocs[i] = arena.Alloc(32);
+
+                arena.Reset();
+            }
+        }, 3);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "\theap alloc and free   " << heapNs / (requests * objects) << " ns/object" << std::endl;
+    std::cout << "\tarena alloc and reset " << arenaNs / (requests * objects) << " ns/object" << std::endl;
+}
\ No newline at end of file
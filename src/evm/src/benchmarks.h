@@ -0,0 +1,113 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+
+class Benchmark
+{
+private:
+    static std::vector<Benchmark *> INSTANCES;
+
+    virtual void Run() = 0;
+    virtual const char *GetName() = 0;
+
+protected:
+    Benchmark()
+    {
+        INSTANCES.push_back(this);
+    }
+
+public:
+    //Returns the fastest time in nanoseconds that it took to execute _func over _repetitions runs
+    static double Measure(const std::function<void()> &_func, size_t _repetitions = 5)
+    {
+        double best = 0;
+
+        for (size_t i = 0; i < _repetitions; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            _func();
+            auto end = std::chrono::steady_clock::now();
+
+            double elapsed = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            best = i == 0 ? elapsed : std::min(best, elapsed);
+        }
+
+        return best;
+    }
+
+    static void RunInstances()
+    {
+        std::cout << "Running " << INSTANCES.size() << " benchmarks..." << std::endl;
+
+        for (size_t i = 0; i < INSTANCES.size(); i++)
+        {
+            auto benchmark = INSTANCES[i];
+
+            try
+            {
+                std::cout << "(" << i + 1 << ") " << benchmark->GetName() << std::endl;
+                benchmark->Run();
+            }
+            catch (const std::exception &e)
+            {
+                std::cout << "FAILED    " << benchmark->GetName() << "\t" << e.what() << std::endl;
+            }
+        }
+    }
+
+    static void RunInstance(std::string _name)
+    {
+        for (size_t i = 0; i < INSTANCES.size(); i++)
+        {
+            auto benchmark = INSTANCES[i];
+            if (benchmark->GetName() == _name)
+            {
+                try
+                {
+                    std::cout << benchmark->GetName() << std::endl;
+                    benchmark->Run();
+                }
+                catch (const std::exception &e)
+                {
+                    std::cout << "FAILED    " << benchmark->GetName() << "\t" << e.what() << std::endl;
+                }
+
+                return;
+            }
+        }
+
+        std::cout << "No benchmark found with name: " << _name << std::endl;
+    }
+};
+
+#define DEFINE_BENCHMARK(BENCHMARK_NAME)                                          \
+    class BENCHMARK_NAME : public Benchmark                                       \
+    {                                                                             \
+        BENCHMARK_NAME() {}                                                       \
+        void Run() override;                                                      \
+                                                                                  \
+    public:                                                                       \
+        BENCHMARK_NAME(BENCHMARK_NAME const &) = delete;                          \
+        void operator=(BENCHMARK_NAME const &) = delete;                          \
+                                                                                  \
+        const char *GetName() override { return #BENCHMARK_NAME; }                \
+                                                                                  \
+        static BENCHMARK_NAME *GetInstance()                                      \
+        {                                                                         \
+            static BENCHMARK_NAME instance;                                       \
+            return &instance;                                                     \
+        }                                                                         \
+                                                                                  \
+    private:                                                                      \
+        static BENCHMARK_NAME *instance;                                          \
+    };                                                                            \
+                                                                                  \
+    BENCHMARK_NAME *BENCHMARK_NAME::instance = BENCHMARK_NAME::GetInstance();     \
+    void BENCHMARK_NAME::Run()
+
+#define INIT_BENCHMARK_SUITE() std::vector<Benchmark *> Benchmark::INSTANCES = std::vector<Benchmark *>()
+#define RUN_BENCHMARK_SUITE() Benchmark::RunInstances()
+#define RUN_BENCHMARK(NAME) Benchmark::RunInstance(NAME)
\ No newline at end of file
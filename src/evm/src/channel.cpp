@@ -0,0 +1,209 @@
+#include "channel.h"
+#include <bit>
+#include "thread.h"
+#include "vm.h"
+#include "../build.h"
+
+#pragma region Channel
+
+Channel::Channel(vm_ui64 _capacity)
+    : slots(std::make_unique<Slot[]>(_capacity)), capacity(_capacity), head(0), tail(0), waiting(0), senders(), receivers()
+{
+    assert(_capacity > 0 && _capacity <= MAX_CHANNEL_CAPACITY);
+
+    for (vm_ui64 i = 0; i < capacity; i++)
+        slots[i].sequence.store(i * 2, std::memory_order_relaxed);
+}
+
+bool Channel::TrySend(Word _value)
+{
+    vm_ui64 pos = tail.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        Slot& slot = slots[pos % capacity];
+        auto diff = (vm_i64)(slot.sequence.load(std::memory_order_acquire) - pos * 2);
+
+        //The slot is free on this lap once the receive of the last lap released it
+        if (diff == 0)
+        {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                slot.value = _value;
+                slot.sequence.store(pos * 2 + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false; //Full
+        else
+            pos = tail.load(std::memory_order_relaxed);
+    }
+}
+
+bool Channel::TryRecv(Word& _value)
+{
+    vm_ui64 pos = head.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+        Slot& slot = slots[pos % capacity];
+        auto diff = (vm_i64)(slot.sequence.load(std::memory_order_acquire) - (pos * 2 + 1));
+
+        if (diff == 0)
+        {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                _value = slot.value;
+                slot.sequence.store((pos + capacity) * 2, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false; //Empty
+        else
+            pos = head.load(std::memory_order_relaxed);
+    }
+}
+
+//Parked threads count themselves before they try again, and threads that sent or received check the count after
+//they did. With a full fence on both sides either the parking thread sees the word or the other one sees it waiting.
+bool Channel::Send(Thread* _thread, Word _value)
+{
+    if (TrySend(_value))
+    {
+        Notify(_thread, receivers);
+        return true;
+    }
+
+    std::scoped_lock<std::mutex> lock(_thread->GetVM()->mutex);
+    waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (TrySend(_value))
+    {
+        waiting.fetch_sub(1);
+        WakeOne(receivers);
+        return true;
+    }
+
+    senders.push_back(_thread);
+    _thread->Block();
+    return false;
+}
+
+bool Channel::Recv(Thread* _thread, Word& _value)
+{
+    if (TryRecv(_value))
+    {
+        Notify(_thread, senders);
+        return true;
+    }
+
+    std::scoped_lock<std::mutex> lock(_thread->GetVM()->mutex);
+    waiting.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (TryRecv(_value))
+    {
+        waiting.fetch_sub(1);
+        WakeOne(senders);
+        return true;
+    }
+
+    receivers.push_back(_thread);
+    _thread->Block();
+    return false;
+}
+
+void Channel::Notify(Thread* _thread, std::list<Thread*>& _queue)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load() == 0)
+        return;
+
+    std::scoped_lock<std::mutex> lock(_thread->GetVM()->mutex);
+    WakeOne(_queue);
+}
+
+void Channel::WakeOne(std::list<Thread*>& _queue)
+{
+    if (_queue.empty())
+        return;
+
+    Thread* thread = _queue.front();
+    _queue.pop_front();
+    waiting.fetch_sub(1);
+    thread->Wake();
+}
+
+void Channel::ForEachWord(const std::function<void(Word)>& _visit) const
+{
+    //Full slots have an odd sequence number
+    for (vm_ui64 i = 0; i < capacity; i++)
+    {
+        if (slots[i].sequence.load(std::memory_order_acquire) % 2 == 1)
+            _visit(slots[i].value);
+    }
+}
+
+#pragma endregion
+
+#pragma region ChannelTable
+
+ChannelTable::ChannelTable() : segments(), size(0), channels(), allocated()
+{
+}
+
+vm_ui64 ChannelTable::Create(vm_ui64 _capacity)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    //Segment k holds the ids from 2^k - 1 to 2^(k + 1) - 2
+    vm_ui64 id = size.load(std::memory_order_relaxed);
+    size_t segment = std::bit_width(id + 1) - 1;
+
+    if (!segments[segment].load(std::memory_order_relaxed))
+    {
+        allocated.push_back(std::make_unique<std::atomic<Channel*>[]>(1ull << segment));
+        segments[segment].store(allocated.back().get(), std::memory_order_relaxed);
+    }
+
+    channels.push_back(std::make_unique<Channel>(_capacity));
+    segments[segment].load(std::memory_order_relaxed)[id + 1 - (1ull << segment)].store(channels.back().get(), std::memory_order_relaxed);
+
+    //Publishes the channel and its segment to threads that see the new size
+    size.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+Channel* ChannelTable::Get(vm_ui64 _id) const
+{
+    if (_id >= size.load(std::memory_order_acquire))
+        return nullptr;
+
+    size_t segment = std::bit_width(_id + 1) - 1;
+    return segments[segment].load(std::memory_order_relaxed)[_id + 1 - (1ull << segment)].load(std::memory_order_relaxed);
+}
+
+void ChannelTable::ForEachWord(const std::function<void(Word)>& _visit)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    for (auto& channel : channels)
+        channel->ForEachWord(_visit);
+}
+
+void ChannelTable::Clear()
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    size = 0;
+    for (auto& segment : segments)
+        segment = nullptr;
+
+    channels.clear();
+    allocated.clear();
+}
+
+#pragma endregion
\ No newline at end of file
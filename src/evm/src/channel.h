@@ -0,0 +1,88 @@
+#pragma once
+#include "evm.h"
+#include <array>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define MAX_CHANNEL_CAPACITY (1ull << 20) //Keeps guest programs from making the vm allocate rings that cannot fit in memory
+
+class Thread;
+
+//A bounded queue of words that threads send to and receive from. Sends and receives claim a slot of a ring
+//buffer with a compare and swap and only lock once they have to park the thread because the channel is full
+//or empty. Every slot has a sequence number that tells whether it is free or holds a word for the position a
+//send or receive is at, so any number of threads can send and receive at the same time. Position p is free at
+//2p and full at 2p + 1, which keeps the two apart even when the ring has a single slot.
+class Channel
+{
+private:
+    struct Slot
+    {
+        std::atomic<vm_ui64> sequence;
+        Word value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    vm_ui64 capacity;
+    alignas(64) std::atomic<vm_ui64> head;    //The position of the next receive
+    alignas(64) std::atomic<vm_ui64> tail;    //The position of the next send
+    alignas(64) std::atomic<vm_ui64> waiting; //The number of parked threads, so that sends and receives only lock when there are some
+    std::list<Thread*> senders, receivers;    //Guarded by the vm's mutex
+
+    void WakeOne(std::list<Thread*>& _queue);
+    void Notify(Thread* _thread, std::list<Thread*>& _queue);
+
+public:
+    explicit Channel(vm_ui64 _capacity);
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    bool TrySend(Word _value);
+    bool TryRecv(Word& _value);
+
+    //Sends or receives a word, or parks the thread until the channel has room or a word for it. Returns false once
+    //the thread parks, in which case it has to send or receive again after it wakes.
+    bool Send(Thread* _thread, Word _value);
+    bool Recv(Thread* _thread, Word& _value);
+
+    //Calls the function with every word the channel holds. Only safe while no thread sends or receives.
+    void ForEachWord(const std::function<void(Word)>& _visit) const;
+
+    vm_ui64 GetCapacity() const { return capacity; }
+};
+
+//Maps ids to the channels of a vm. Looking a channel up does not lock since every send and receive does it.
+//Ids index into segments that double in size and never move once they are allocated.
+class ChannelTable
+{
+private:
+    static constexpr size_t SEGMENT_COUNT = 64;
+
+    std::array<std::atomic<std::atomic<Channel*>*>, SEGMENT_COUNT> segments;
+    std::atomic<vm_ui64> size;
+    std::vector<std::unique_ptr<Channel>> channels;                 //Guarded by mutex
+    std::vector<std::unique_ptr<std::atomic<Channel*>[]>> allocated; //Guarded by mutex
+    std::mutex mutex;
+
+public:
+    ChannelTable();
+
+    ChannelTable(const ChannelTable&) = delete;
+    ChannelTable& operator=(const ChannelTable&) = delete;
+
+    //Creates a channel and returns its id
+    vm_ui64 Create(vm_ui64 _capacity);
+
+    //Returns the channel with the id or null if there is none
+    Channel* Get(vm_ui64 _id) const;
+
+    //Calls the function with every word that any channel holds. Only safe while no thread sends or receives.
+    void ForEachWord(const std::function<void(Word)>& _visit);
+
+    void Clear();
+};
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <assert.h>
 #include <sstream>
 #include <iomanip>
@@ -30,6 +31,14 @@ typedef std::vector<vm_byte> Memory;
 #define VM_PTR_SIZE sizeof(vm_byte *)
 #define WORD_SIZE 8ull
 
+#if defined(__GNUC__) || defined(__clang__)
+#define EVM_THREADED_DISPATCH //Labels as values are available so the interpreter can jump directly from handler to handler
+#endif
+
+#if defined(__x86_64__) && defined(__linux__)
+#define EVM_JIT //Decoded instructions can be compiled to x86-64 machine code and mapped as executable memory
+#endif
+
 union Word
 {
     vm_byte as_byte;
@@ -76,6 +85,15 @@ union Word
     bool operator!=(Word _w) { return as_ui64 != _w.as_ui64; }
 
     bool AsBool() { return as_ui64 != 0ull; }
+
+    //Reads the low bytes of the word as a T
+    template <typename T>
+    T As() const
+    {
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
 };
 
 static_assert(sizeof(Word) == WORD_SIZE, "Word is not the right size!");
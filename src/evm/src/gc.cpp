@@ -0,0 +1,71 @@
+#include "gc.h"
+#include <iomanip>
+#include "vm.h"
+#include "thread.h"
+#include "../build.h"
+
+Collector::Collector(VM* _vm) : vm(_vm), stats(), reached() { }
+
+void Collector::Visit(Word _word)
+{
+    Heap& heap = vm->GetHeap();
+
+    auto object = heap.FindObject(_word.as_ptr);
+    if (object && heap.Mark(object->start))
+    {
+        reached.push_back(*object);
+        stats.liveBytes += object->size;
+    }
+}
+
+void Collector::Collect()
+{
+    auto start = std::chrono::steady_clock::now();
+    Heap& heap = vm->GetHeap();
+    stats.heapBefore = heap.GetSize();
+    stats.liveBytes = 0;
+
+    //Mark
+    for (auto& [id, thread] : vm->threads)
+    {
+        for (vm_ui64 pos = 0; pos + WORD_SIZE <= thread.GetSP(); pos += WORD_SIZE)
+            Visit(*(Word*)&thread.GetStack()[pos]);
+    }
+
+    for (auto& [id, value] : vm->exitValues)
+        Visit(value);
+
+    vm->GetChannels().ForEachWord([this](Word _word) { Visit(_word); });
+
+    for (vm_byte* region : vm->GetArenas().GetRegions())
+        Visit(region);
+
+    while (!reached.empty())
+    {
+        HeapObject object = reached.back();
+        reached.pop_back();
+
+        for (vm_ui64 pos = 0; pos + WORD_SIZE <= object.size; pos += WORD_SIZE)
+            Visit(*(Word*)(object.start + pos));
+    }
+
+    //Sweep
+    stats.freedObjects += heap.Sweep();
+    stats.heapAfter = heap.GetSize();
+
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    stats.collections++;
+    stats.totalPause += pause;
+    stats.maxPause = std::max(stats.maxPause, pause);
+}
+
+void Collector::Print(std::ostream& _stream)
+{
+    auto ms = [](std::chrono::nanoseconds _ns) { return _ns.count() / 1e6; };
+
+    _stream << std::fixed << std::setprecision(3);
+    _stream << "Collections: " << stats.collections << ", freed " << stats.freedObjects << " allocations" << std::endl;
+    _stream << "Pauses: " << ms(stats.totalPause) << " ms in total, " << ms(stats.maxPause) << " ms at most" << std::endl;
+    _stream << "Heap: " << stats.heapBefore / 1024 << " KiB before the last collection, " << stats.heapAfter / 1024 << " KiB after it, "
+        << stats.liveBytes / 1024 << " KiB of it alive" << std::endl;
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+#include "evm.h"
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include "heap.h"
+
+class VM;
+
+//What the collections of a vm did so far
+struct CollectionStats
+{
+    vm_ui64 collections = 0;
+    vm_ui64 freedObjects = 0;
+    std::chrono::nanoseconds totalPause{ 0 }, maxPause{ 0 };
+    size_t heapBefore = 0, heapAfter = 0; //The size of the heap before and after the last collection
+    size_t liveBytes = 0;                 //The size of the allocations that the last collection kept
+};
+
+//A mark-sweep collector of the heap of a vm, which collects while none of the vm's threads run. Roots are found
+//conservatively: every word on the stack of a thread below its stack pointer, in a channel or in the exit value of
+//a thread that was not joined yet that points into an allocation keeps it alive, as does every arena region. Every
+//word of an allocation that is alive is then treated the same way.
+class Collector
+{
+private:
+    VM *vm;
+    CollectionStats stats;
+    std::vector<HeapObject> reached; //The allocations that were marked but whose words were not visited yet
+
+    void Visit(Word _word);
+
+public:
+    explicit Collector(VM *_vm);
+
+    //Frees every allocation that the roots do not reach. Only safe while no thread runs.
+    void Collect();
+
+    void Print(std::ostream &_stream);
+    const CollectionStats &GetStats() const { return stats; }
+};
\ No newline at end of file
@@ -2,75 +2,174 @@
 #include "../build.h"
 #include "vm.h"
 #include <algorithm>
-#include <unordered_set>
+#include <bit>
+
+//Returns the slab that holds the address or null if there is none
+static Slab* FindSlab(const std::map<vm_byte*, Slab*>& _slabs, vm_byte* _addr)
+{
+    auto search = _slabs.upper_bound(_addr);
+    if (search == _slabs.begin())
+        return nullptr;
+
+    Slab* slab = std::prev(search)->second;
+    return slab->HasAddress(_addr) ? slab : nullptr;
+}
 
 #pragma region FreeChunksList
 
-void FreeChunksList::Insert(Chunk* _chunk, Block* _block)
+FreeChunksList::FreeChunksList(Heap* _heap) : heap(_heap), count(0) { }
+
+size_t FreeChunksList::GetBin(vm_ui64 _size)
 {
-    map[_chunk->GetSize()][_chunk] = _block;
+    if (_size <= MAX_EXACT_BIN_SIZE)
+        return (std::max<vm_ui64>(_size, 1) - 1) / HEAP_ALIGNMENT;
+
+    //The highest bits below the top one of the size pick the bin within its power of two
+    size_t width = std::bit_width(_size - 1);
+    size_t subBin = ((_size - 1) >> (width - std::bit_width(SUB_BIN_COUNT))) & (SUB_BIN_COUNT - 1);
+    return EXACT_BIN_COUNT + (width - std::bit_width(MAX_EXACT_BIN_SIZE)) * SUB_BIN_COUNT + subBin;
 }
 
-void FreeChunksList::Delete(Chunk* _chunk)
+Chunk FreeChunksList::Follow(vm_byte* _link)
 {
-    auto& sizeBucket = map.at(_chunk->GetSize());
-    sizeBucket.erase(_chunk);
+    if (!heap->IsFreeChunk(_link))
+        throw VMError::HEAP_CORRUPTED(_link);
 
-    if (sizeBucket.empty())
-        map.erase(_chunk->GetSize());
+    return Chunk(_link);
 }
 
-bool FreeChunksList::Contains(Chunk* _chunk, Block* _block) const
+void FreeChunksList::Insert(Chunk _chunk)
 {
-    auto sizeBucketSearch = map.find(_chunk->GetSize());
-    if (sizeBucketSearch == map.end())
-        return false;
+    size_t bin = GetBin(_chunk.GetSize());
 
-    auto sizeBucketChunkSearch = sizeBucketSearch->second.find(_chunk);
-    return sizeBucketChunkSearch != sizeBucketSearch->second.end() && sizeBucketChunkSearch->second == _block;
+    if (bins[bin])
+        Follow(bins[bin]).Prev() = _chunk.GetStart();
+
+    _chunk.Prev() = nullptr;
+    _chunk.Next() = bins[bin];
+    bins[bin] = _chunk.GetStart();
+    nonEmptyBins[bin / 64] |= 1ull << (bin % 64);
+    count++;
 }
 
-std::optional<std::pair<Chunk*, Block*>> FreeChunksList::Find(vm_ui64 _minSize)
+void FreeChunksList::Delete(Chunk _chunk)
 {
-    std::optional<std::pair<Chunk*, Block*>> result;
-    auto search = std::find_if(map.begin(), map.end(), [_minSize](type::reference _kvPair)
-        { return _kvPair.first >= _minSize; });
+    size_t bin = GetBin(_chunk.GetSize());
+    vm_byte* prev = _chunk.Prev(), * next = _chunk.Next();
 
-    if (search == map.end())
-        return std::nullopt;
+    //Both neighbours have to link back to the chunk before either is changed
+    std::optional<Chunk> prevChunk = prev ? std::optional(Follow(prev)) : std::nullopt;
+    std::optional<Chunk> nextChunk = next ? std::optional(Follow(next)) : std::nullopt;
 
-    return *search->second.begin();
+    if ((prevChunk ? prevChunk->Next() : bins[bin]) != _chunk.GetStart() || (nextChunk && nextChunk->Prev() != _chunk.GetStart()))
+        throw VMError::HEAP_CORRUPTED(_chunk.GetStart());
+
+    (prevChunk ? prevChunk->Next() : bins[bin]) = next;
+    if (nextChunk)
+        nextChunk->Prev() = prev;
+
+    if (!bins[bin])
+        nonEmptyBins[bin / 64] &= ~(1ull << (bin % 64));
+
+    count--;
 }
 
-void FreeChunksList::AssertHeuristics()
+bool FreeChunksList::Contains(Chunk _chunk)
 {
-    assert(map.find(0) == map.end() && "Free chunks list contains a size bucket for 0!");
+    for (vm_byte* link = bins[GetBin(_chunk.GetSize())]; link; link = Follow(link).Next())
+    {
+        if (link == _chunk.GetStart())
+            return true;
+    }
+
+    return false;
+}
+
+std::optional<Chunk> FreeChunksList::Find(vm_ui64 _minSize)
+{
+#ifdef BUILD_LINEAR_FREE_LIST
+    //Walks the free chunks one by one until one fits, as the heap did before it binned them, to benchmark against
+    for (size_t bin = 0; bin < BIN_COUNT; bin++)
+    {
+        for (vm_byte* link = bins[bin]; link; link = Follow(link).Next())
+        {
+            if (Follow(link).GetSize() >= _minSize)
+                return Follow(link);
+        }
+    }
+#else
+    size_t bin = GetBin(_minSize);
+
+    //The bin of the size may also hold chunks that are too small for it, and the smallest one that fits is the best fit
+    std::optional<Chunk> best;
+    vm_byte* link = bins[bin];
+    for (size_t checked = 0; link && checked < count; checked++)
+    {
+        Chunk chunk = Follow(link);
+        if (chunk.GetSize() >= _minSize && (!best || chunk.GetSize() < best->GetSize()))
+        {
+            best = chunk;
+            if (chunk.GetSize() == _minSize)
+                break;
+        }
+
+        link = chunk.Next();
+    }
+
+    if (best)
+        return best;
+
+    //Every chunk of a bigger bin fits
+    for (size_t word = (bin + 1) / 64; word < nonEmptyBins.size(); word++)
+    {
+        vm_ui64 bits = nonEmptyBins[word];
+        if (word == (bin + 1) / 64)
+            bits &= ~0ull << ((bin + 1) % 64);
 
-    std::unordered_set<Chunk*> foundChunks;
-    for (auto& [chunkSize, chunks] : map)
+        if (bits)
+            return Follow(bins[word * 64 + std::countr_zero(bits)]);
+    }
+#endif
+
+    return std::nullopt;
+}
+
+void FreeChunksList::AssertHeuristics()
+{
+    size_t found = 0;
+    for (size_t bin = 0; bin < BIN_COUNT; bin++)
     {
-        for (auto& [chunk, block] : chunks)
+        assert(!bins[bin] != (bool)(nonEmptyBins[bin / 64] & (1ull << (bin % 64))) && "Free chunks list bitmap does not match its bins!");
+
+        vm_byte* prev = nullptr;
+        for (vm_byte* link = bins[bin]; link && found <= count; link = Chunk(link).Next())
         {
-            assert(!chunk->IsAllocated() && "Free chunks list contains an allocated chunk!");
-            assert(chunk->GetSize() == chunkSize && "Free chunks list size bucket contains a chunk with the incorrect size!");
-            assert(foundChunks.find(chunk) == foundChunks.end() && "Free chunks list contains duplicate entries!");
+            assert(heap->IsFreeChunk(link) && "Free chunks list links to something that is not a free chunk!");
+            assert(Chunk(link).Prev() == prev && "Free chunks list has a chunk that does not link back to the one before it!");
+            assert(GetBin(Chunk(link).GetSize()) == bin && "Free chunks list contains a chunk in the wrong bin!");
 
-            foundChunks.insert(chunk);
+            prev = link;
+            found++;
         }
     }
+
+    assert(found == count && "Free chunks list contains a different amount of chunks than were inserted!");
 }
 
 void FreeChunksList::Print()
 {
-    for (auto& [s, cb] : map)
+    for (size_t bin = 0; bin < BIN_COUNT; bin++)
     {
-        std::cout << "Size Bucket: " << s << std::endl;
+        if (!bins[bin])
+            continue;
+
+        std::cout << "Size Bin: " << bin << std::endl;
 
-        for (auto& [c, b] : cb)
+        for (vm_byte* link = bins[bin]; link; link = Chunk(link).Next())
         {
             std::cout << "\t";
-            c->Print(false);
-            std::cout << " in block " << (void*)b << std::endl;
+            Chunk(link).Print(false);
+            std::cout << std::endl;
         }
     }
 }
@@ -79,31 +178,24 @@ void FreeChunksList::Print()
 
 #pragma region Chunk
 
-Chunk::Chunk(vm_byte* _start, vm_ui64 _size, Chunk* _prev, Chunk* _next)
-    : start(_start), size(_size), prev(_prev), next(_next), allocated(false)
-{
-}
-
-void Chunk::AssertHeuristics()
-{
-    assert((!next || (next->start == start + size)) && "Chunk's next chunk starts at a different place than after this chunk's end!");
-    assert((!next || (next->prev == this)) && "Chunk's next should have it's previous be this chunk!");
-    assert((!prev || (prev->next == this)) && "Chunk's previous should have it's next be this chunk!");
-}
-
 void Chunk::Print(bool _showData)
 {
-    std::cout << "Chunk at " << (void*)this << " { ";
+    std::cout << "Chunk { ";
     std::cout << "start: " << (void*)start << ", ";
-    std::cout << "size: " << size << ", ";
-    std::cout << "allocated: " << allocated << ", ";
-    std::cout << "prev: " << (void*)prev << ", ";
-    std::cout << "next: " << (void*)next;
+    std::cout << "size: " << GetSize() << ", ";
+    std::cout << "allocated: " << IsAllocated();
+
+    if (!IsAllocated())
+    {
+        std::cout << ", prev: " << (void*)Prev() << ", ";
+        std::cout << "next: " << (void*)Next();
+    }
+
     std::cout << " }";
 
     if (_showData)
     {
-        for (vm_ui64 pos = 0; pos < size; pos++)
+        for (vm_ui64 pos = HEAP_TAG_SIZE; pos < GetSize() - HEAP_TAG_SIZE; pos++)
         {
             auto byte = start[pos];
             std::cout << (pos % 8 == 0 ? "\n\t\t" : "\t\t") << Hex(byte, false) << " | " << (std::isprint(byte) ? std::string(1, byte) : "~~");
@@ -117,135 +209,189 @@ void Chunk::Print(bool _showData)
 
 Block::Block(size_t _size, FreeChunksList& _freeChunks)
 {
-    assert(_size > 0 && "Block must be initialized with positive size!");
+    assert(_size >= MIN_CHUNK_SIZE && _size % HEAP_ALIGNMENT == 0 && "Block must be initialized with room for an aligned chunk!");
     storage = Memory(_size);
+    allocated = std::vector<vm_ui64>((_size / HEAP_ALIGNMENT + 63) / 64);
+    marked = std::vector<vm_ui64>(allocated.size());
 
-    Chunk* initial = new Chunk(&storage.front(), storage.size(), nullptr, nullptr);
-    _freeChunks.Insert(initial, this);
-    chunks.emplace(initial->start, initial);
+    Chunk initial = GetFirstChunk();
+    initial.SetTags(_size, false);
+    _freeChunks.Insert(initial);
 }
 
-Block::Block(Block&& _b) noexcept { this->operator=(std::move(_b)); }
+void Block::SetAllocated(vm_byte* _payload, bool _allocated)
+{
+    vm_ui64 index = (_payload - GetStart()) / HEAP_ALIGNMENT;
+    if (_allocated)
+        allocated[index / 64] |= 1ull << (index % 64);
+    else
+        allocated[index / 64] &= ~(1ull << (index % 64));
+}
 
-Block::~Block()
+bool Block::HasChunk(vm_byte* _start, bool _allocated)
 {
-    for (auto& [_, chunk] : chunks)
-        delete chunk;
+    if (_start < GetStart() || _start > GetEnd() - MIN_CHUNK_SIZE || (_start - GetStart()) % HEAP_ALIGNMENT != 0)
+        return false;
 
-    chunks.clear();
-}
+    Chunk chunk(_start);
+    vm_ui64 size = chunk.GetSize();
 
-bool Block::HasAddress(vm_byte* _addr) { return _addr >= &storage.front() && _addr <= &storage.back(); }
+    return chunk.IsAllocated() == _allocated && size >= MIN_CHUNK_SIZE && size % HEAP_ALIGNMENT == 0 && size <= (vm_ui64)(GetEnd() - _start)
+        && chunk.Footer() == chunk.Header() && IsAllocatedBit(chunk.GetPayload()) == _allocated;
+}
 
-bool Block::IsEmpty() { return chunks.size() == 1 && !chunks.begin()->second->allocated; }
+bool Block::IsEmpty()
+{
+    Chunk first = GetFirstChunk();
+    return !first.IsAllocated() && first.GetSize() == GetSize();
+}
 
 bool Block::IsAllocated(vm_byte* _addr)
 {
-    auto search = chunks.find(_addr);
-    return search != chunks.end() && search->second->allocated;
+    return HasAddress(_addr) && (_addr - GetStart()) % HEAP_ALIGNMENT == 0 && IsAllocatedBit(_addr);
 }
 
-void Block::Alloc(vm_byte* _chunkPtr, vm_ui64 _amt, FreeChunksList& _freeChunks)
+std::optional<HeapObject> Block::FindObject(vm_byte* _addr)
 {
-    Chunk* chunk = chunks.at(_chunkPtr);
-    assert(_amt <= chunk->size && ("Cannot alloc " + std::to_string(_amt) + " bytes for an unallocated chunk of size " + std::to_string(chunk->size)).c_str());
+    //The payload that holds the address can only be the closest one that starts at or before it
+    vm_ui64 index = (_addr - GetStart()) / HEAP_ALIGNMENT;
+    size_t word = index / 64;
+    vm_ui64 bits = allocated[word] & (~0ull >> (63 - index % 64));
 
-    //Possibly fragment chunk
-    if (_amt < chunk->size)
+    while (!bits)
     {
-        vm_byte* nextChunkStart = _chunkPtr + _amt;
-        Chunk* next = new Chunk(nextChunkStart, chunk->size - _amt, chunk, chunk->next);
+        if (word == 0)
+            return std::nullopt;
 
-        if (next->next)
-            next->next->prev = next;
+        bits = allocated[--word];
+    }
+
+    vm_byte* payload = GetStart() + (word * 64 + 63 - std::countl_zero(bits)) * HEAP_ALIGNMENT;
+    Chunk chunk(payload - HEAP_TAG_SIZE);
 
-        chunk->next = next;
+    if (!HasChunk(chunk.GetStart(), true) || _addr >= chunk.GetEnd() - HEAP_TAG_SIZE)
+        return std::nullopt;
 
-        chunks.emplace(nextChunkStart, next);
-        _freeChunks.Insert(next, this);
+    return HeapObject{ payload, chunk.GetSize() - HEAP_TAG_SIZE * 2 };
+}
+
+bool Block::Mark(vm_byte* _payload)
+{
+    vm_ui64 index = (_payload - GetStart()) / HEAP_ALIGNMENT, bit = 1ull << (index % 64);
+    if (marked[index / 64] & bit)
+        return false;
+
+    marked[index / 64] |= bit;
+    return true;
+}
+
+void Block::Sweep(std::vector<vm_byte*>& _unmarked)
+{
+    for (size_t word = 0; word < allocated.size(); word++)
+    {
+        for (vm_ui64 bits = allocated[word] & ~marked[word]; bits; bits &= bits - 1)
+            _unmarked.push_back(GetStart() + (word * 64 + std::countr_zero(bits)) * HEAP_ALIGNMENT);
+
+        marked[word] = 0;
     }
+}
+
+vm_byte* Block::Alloc(Chunk _chunk, vm_ui64 _size, FreeChunksList& _freeChunks)
+{
+    assert(HasChunk(_chunk.GetStart(), false) && _size <= _chunk.GetSize() && ("Cannot alloc " + std::to_string(_size) + " bytes for an unallocated chunk of size " + std::to_string(_chunk.GetSize())).c_str());
+
+    _freeChunks.Delete(_chunk);
 
-    //Remove from free chunks list
-    _freeChunks.Delete(chunk);
+    //Split off the rest of the chunk if it can hold a chunk of its own
+    vm_ui64 size = _chunk.GetSize();
+    if (size - _size >= MIN_CHUNK_SIZE)
+    {
+        Chunk rest(_chunk.GetStart() + _size);
+        rest.SetTags(size - _size, false);
+        _freeChunks.Insert(rest);
+        size = _size;
+    }
 
-    //Set chunk
-    chunk->allocated = true;
-    chunk->size = _amt;
+    _chunk.SetTags(size, true);
+    SetAllocated(_chunk.GetPayload(), true);
 
 #ifdef BUILD_DEBUG_HEAP
     AssertHeuristics(_freeChunks);
 #endif
+
+    return _chunk.GetPayload();
 }
 
-void Block::Free(vm_byte* _chunkPtr, FreeChunksList& _freeChunks)
+void Block::Free(vm_byte* _payload, FreeChunksList& _freeChunks)
 {
-    Chunk* freedChunk = chunks.at(_chunkPtr), * current = freedChunk;
-    freedChunk->allocated = false;
+    Chunk chunk(_payload - HEAP_TAG_SIZE);
+    if (!HasChunk(chunk.GetStart(), true))
+        throw VMError::HEAP_CORRUPTED(chunk.GetStart());
 
-    //Start merge at previous chunk if it is unallocated
-    if (freedChunk->prev && !freedChunk->prev->allocated)
-    {
-        _freeChunks.Insert(freedChunk, this);
-        current = freedChunk->prev;
-        _freeChunks.Delete(current); //Remove current chunk fron free list since its size is about to change
-    }
+    vm_byte* start = chunk.GetStart(), * end = chunk.GetEnd();
 
-    // Merge chunks
-    while (current->next && !current->next->allocated)
+    //The footer of the chunk before and the header of the chunk after tell whether they are free to merge with
+    if (start != GetStart())
     {
-        auto chunkToDelete = current->next;
-        _freeChunks.Delete(chunkToDelete); //Remove next chunk fron free list since it is being deleted
+        vm_ui64 tag = *(vm_ui64*)(start - HEAP_TAG_SIZE);
+        if (!(tag & Chunk::ALLOCATED))
+        {
+            if (tag > (vm_ui64)(start - GetStart()) || !HasChunk(start - tag, false))
+                throw VMError::HEAP_CORRUPTED(start - HEAP_TAG_SIZE);
 
-        //Merge chunks
-        current->size += chunkToDelete->size;
-        current->next = chunkToDelete->next;
+            _freeChunks.Delete(Chunk(start - tag));
+            start -= tag;
+        }
+    }
 
-        if (current->next)
-            current->next->prev = current;
+    if (end != GetEnd() && !Chunk(end).IsAllocated())
+    {
+        if (!HasChunk(end, false))
+            throw VMError::HEAP_CORRUPTED(end);
 
-        //Delete chunk that was just merged with the current
-        chunks.erase(chunkToDelete->start);
-        delete chunkToDelete;
+        _freeChunks.Delete(Chunk(end));
+        end = Chunk(end).GetEnd();
     }
 
-    _freeChunks.Insert(current, this); //Put current chunk in free list
+    SetAllocated(_payload, false);
+
+    Chunk merged(start);
+    merged.SetTags(end - start, false);
+    _freeChunks.Insert(merged);
 
 #ifdef BUILD_DEBUG_HEAP
     AssertHeuristics(_freeChunks);
 #endif
 }
 
-void Block::AssertHeuristics(const FreeChunksList& _freeChunks)
+void Block::AssertHeuristics(FreeChunksList& _freeChunks)
 {
     assert(GetStart() == &storage.front() && "Block's start is not the start of it's storage!");
-    assert(GetFirstChunk()->GetStart() == GetStart() && "Block's first chunk does not start at the block's start!");
+    assert(allocated.size() * 64 >= GetSize() / HEAP_ALIGNMENT && "Block's bitmap does not cover it's storage!");
 
-    Chunk* currentChunk = GetFirstChunk();
-    size_t summedSize = 0, count = 0;
+    size_t allocatedCount = 0;
+    bool prevFree = false;
 
-    while (currentChunk)
+    for (vm_byte* at = GetStart(); at != GetEnd(); at = Chunk(at).GetEnd())
     {
-        currentChunk->AssertHeuristics(); //Chunk::AssertHeuristics handles gaps inbetween chunks
+        Chunk chunk(at);
+        assert(HasChunk(at, chunk.IsAllocated()) && "Block has a chunk with invalid tags or that the bitmap disagrees with!");
 
-        assert(chunks.find(currentChunk->start) != chunks.end() && "Block's chunks list does not contain a chunk that it should!");
-
-        if (!currentChunk->allocated)
+        if (!chunk.IsAllocated())
         {
-            assert((!currentChunk->next || currentChunk->next->allocated) && "Block has successive unallocated chunks!");
-            assert(_freeChunks.Contains(currentChunk, this) && "Block has an unallocated chunk that is not in the free list!");
+            assert(!prevFree && "Block has successive unallocated chunks!");
+            assert(_freeChunks.Contains(chunk) && "Block has an unallocated chunk that is not in the free list!");
         }
 
-        summedSize += currentChunk->GetSize();
-        currentChunk = currentChunk->next;
-        count++;
+        prevFree = !chunk.IsAllocated();
+        allocatedCount += chunk.IsAllocated();
     }
 
-    assert(count == chunks.size() && "Chunks list contains a different amount of chunks than the chunk network!");
-
-    for (auto& [start, chunk] : chunks)
-        assert(start == chunk->start && "Block's chunk list has invalid key/value pair!");
+    size_t markedCount = 0;
+    for (vm_ui64 bits : allocated)
+        markedCount += std::popcount(bits);
 
-    assert(summedSize == GetSize() && "The sum of the sizes of the block's chunks does not equal the size of the block!");
+    assert(markedCount == allocatedCount && "Block's bitmap marks an address that is not the payload of an allocated chunk!");
 }
 
 void Block::Print()
@@ -255,10 +401,10 @@ void Block::Print()
     std::cout << "Start: " << (void*)GetStart() << std::endl;
     std::cout << "Size: " << GetSize() << std::endl;
 
-    for (auto& [chunkStart, chunk] : chunks)
+    for (vm_byte* at = GetStart(); at != GetEnd() && HasChunk(at, Chunk(at).IsAllocated()); at = Chunk(at).GetEnd())
     {
         std::cout << '\t';
-        chunk->Print(true);
+        Chunk(at).Print(true);
         std::cout << std::endl;
     }
 
@@ -267,12 +413,81 @@ void Block::Print()
 
 #pragma endregion
 
+#pragma region Slab
+
+Slab::Slab(vm_byte* _start, vm_ui64 _objectSize, ThreadCache* _owner)
+    : start(_start), objectSize(_objectSize), owner(_owner), allocated(), marked()
+{
+}
+
+void Slab::Acquire(vm_byte* _addr)
+{
+    vm_ui64 index = (_addr - start) / objectSize;
+    allocated[index / 64].fetch_or(1ull << (index % 64));
+}
+
+bool Slab::Release(vm_byte* _addr)
+{
+    vm_ui64 offset = _addr - start, index = offset / objectSize;
+    if (offset % objectSize != 0 || index >= GetCapacity())
+        return false;
+
+    vm_ui64 bit = 1ull << (index % 64);
+    return allocated[index / 64].fetch_and(~bit) & bit;
+}
+
+bool Slab::IsAllocated(vm_byte* _addr)
+{
+    vm_ui64 offset = _addr - start, index = offset / objectSize;
+    return offset % objectSize == 0 && index < GetCapacity() && (allocated[index / 64] & (1ull << (index % 64)));
+}
+
+bool Slab::IsEmpty()
+{
+    return std::all_of(allocated.begin(), allocated.end(), [](const std::atomic<vm_ui64>& _bits) { return _bits == 0; });
+}
+
+std::optional<HeapObject> Slab::FindObject(vm_byte* _addr)
+{
+    vm_ui64 index = (_addr - start) / objectSize;
+    if (index >= GetCapacity() || !(allocated[index / 64] & (1ull << (index % 64))))
+        return std::nullopt;
+
+    return HeapObject{ start + index * objectSize, objectSize };
+}
+
+bool Slab::Mark(vm_byte* _addr)
+{
+    vm_ui64 index = (_addr - start) / objectSize, bit = 1ull << (index % 64);
+    if (marked[index / 64] & bit)
+        return false;
+
+    marked[index / 64] |= bit;
+    return true;
+}
+
+void Slab::Sweep(std::vector<vm_byte*>& _unmarked)
+{
+    for (size_t word = 0; word < allocated.size(); word++)
+    {
+        for (vm_ui64 bits = allocated[word] & ~marked[word]; bits; bits &= bits - 1)
+            _unmarked.push_back(start + (word * 64 + std::countr_zero(bits)) * objectSize);
+
+        marked[word] = 0;
+    }
+}
+
+#pragma endregion
+
 #pragma region Heap
 
-Heap::Heap(VM* _vm) : vm(_vm), blocks(), freeChunks(), size(0) { }
+Heap::Heap(VM* _vm) : vm(_vm), blocks(), freeChunks(this), size(0), slabs(), regions(), cacheHits(0), cacheMisses(0) { }
 
 Heap::~Heap()
 {
+    for (auto& [start, slab] : slabs)
+        delete slab;
+
     for (auto& block : blocks)
         delete block;
 
@@ -281,106 +496,217 @@ Heap::~Heap()
 
 vm_byte* Heap::Alloc(vm_ui64 _amt)
 {
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    //Leaves room to add the tags and to double the chunk into a new block without overflowing
+    if (_amt > SIZE_MAX / 4)
+        throw VMError::OUT_OF_MEMORY(_amt);
+
+    //Keeps every chunk aligned and big enough to hold the links of the free chunks list once it is freed
+    vm_ui64 chunkSize = std::max<vm_ui64>(((_amt + HEAP_ALIGNMENT - 1) & ~(HEAP_ALIGNMENT - 1)) + HEAP_TAG_SIZE * 2, MIN_CHUNK_SIZE);
+
     Block* block = nullptr;
-    vm_byte* chunkStart = nullptr;
+    std::optional<Chunk> chunk = freeChunks.Find(chunkSize);
 
-    if (auto chunkAndBlock = freeChunks.Find(_amt)) //There is a block with a big enough chunk
-    {
-        chunkStart = chunkAndBlock->first->GetStart();
-        block = chunkAndBlock->second;
-    }
+    if (chunk) //There is a block with a big enough chunk
+        block = *FindBlock(chunk->GetStart());
     else
     {
-        size_t newBlockSize = std::max({ size * 2, (size_t)MIN_HEAP_BLOCK_SIZE, (size_t)_amt * 2 });
-        block = new Block(newBlockSize, freeChunks);
+        size_t newBlockSize = std::max({ size * 2, (size_t)MIN_HEAP_BLOCK_SIZE, (size_t)chunkSize * 2 });
+        try { block = new Block(newBlockSize, freeChunks); }
+        catch (const std::bad_alloc&) { throw VMError::OUT_OF_MEMORY(_amt); }
+        catch (const std::length_error&) { throw VMError::OUT_OF_MEMORY(_amt); }
 
-        blocks.push_back(block);
-        chunkStart = block->GetStart();
+        blocks.insert(std::upper_bound(blocks.begin(), blocks.end(), block->GetStart(), [](vm_byte* _start, Block* _block) { return _start < _block->GetStart(); }), block);
+        chunk = block->GetFirstChunk();
         size += block->GetSize();
     }
 
-    block->Alloc(chunkStart, _amt, freeChunks);
+    vm_byte* payload = block->Alloc(*chunk, chunkSize, freeChunks);
 
 #ifdef BUILD_DEBUG_HEAP
-    assert(IsAllocated(chunkStart) && "Allocation did not occur!");
+    assert(IsAllocated(payload) && "Allocation did not occur!");
     AssertHeuristics();
 #endif
 
-    return chunkStart;
+    return payload;
 }
 
 void Heap::Free(vm_byte* _addr)
 {
-    for (auto itBlock = blocks.begin(); itBlock != blocks.end(); itBlock++)
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    if (regions.count(_addr))
+        throw VMError::CANNOT_FREE_UNALLOCATED_PTR(_addr);
+
+    //An object that a thread cache allocated, which goes back to the thread's cache
+    if (Slab* slab = FindSlab(slabs, _addr))
+    {
+        if (!slab->Release(_addr))
+            throw VMError::CANNOT_FREE_UNALLOCATED_PTR(_addr);
+
+        if (slab->owner)
+            slab->owner->remoteFrees.emplace_back(_addr, slab);
+        else if (slab->IsEmpty())
+            ReleaseSlab(slab);
+
+        return;
+    }
+
+    auto itBlock = FindBlock(_addr);
+    if (itBlock != blocks.end() && (*itBlock)->IsAllocated(_addr))
     {
         auto block = *itBlock;
+        block->Free(_addr, freeChunks);
 
-        if (block->HasAddress(_addr) && block->IsAllocated(_addr))
+        //There is only one chunk in the block and it is unallocated so there
+        //is no need to have the block existing and since the chunk in the block
+        //is unallocated and thus in the free chunks list, we should remove it
+        if (block->IsEmpty())
         {
-            block->Free(_addr, freeChunks);
+            size -= block->GetSize();
 
-            //There is only one chunk in the block and it is unallocated so there
-            //is no need to have the block existing and since the chunk in the block
-            //is unallocated and thus in the free chunks list, we should remove it
-            if (block->IsEmpty())
-            {
-                size -= block->GetSize();
+            freeChunks.Delete(block->GetFirstChunk());
+            blocks.erase(itBlock);
 
-                freeChunks.Delete(block->GetFirstChunk());
-                blocks.erase(itBlock);
-
-                delete block;
-            }
+            delete block;
+        }
 
 #ifdef BUILD_DEBUG_HEAP
-            AssertHeuristics();
-            assert(!IsAllocated(_addr) && "Deallocation did not occur!");
+        AssertHeuristics();
+        assert(!IsAllocated(_addr) && "Deallocation did not occur!");
 #endif
 
-            return;
-        }
+        return;
     }
 
     throw VMError::CANNOT_FREE_UNALLOCATED_PTR(_addr);
 }
 
-bool Heap::IsAddress(vm_byte* _addr)
+vm_byte* Heap::AllocRegion(vm_ui64 _amt)
 {
-    for (auto& block : blocks)
-    {
-        if (block->HasAddress(_addr))
-            return true;
-    }
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
 
-    return false;
+    vm_byte* region = Alloc(_amt);
+    regions.insert(region);
+
+    return region;
+}
+
+void Heap::FreeRegion(vm_byte* _addr)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    assert(regions.count(_addr) && "Freed a region that no arena owns!");
+    regions.erase(_addr);
+    Free(_addr);
+}
+
+std::vector<Block*>::iterator Heap::FindBlock(vm_byte* _addr)
+{
+    auto search = std::upper_bound(blocks.begin(), blocks.end(), _addr, [](vm_byte* _addr, Block* _block) { return _addr < _block->GetStart(); });
+    if (search == blocks.begin() || !(*std::prev(search))->HasStorage(_addr))
+        return blocks.end();
+
+    return std::prev(search);
+}
+
+bool Heap::IsFreeChunk(vm_byte* _start)
+{
+    auto block = FindBlock(_start);
+    return block != blocks.end() && (*block)->HasChunk(_start, false);
+}
+
+bool Heap::IsAddress(vm_byte* _addr)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+    auto block = FindBlock(_addr);
+    return block != blocks.end() && (*block)->HasAddress(_addr);
 }
 
 bool Heap::IsAddressRange(vm_byte* _start, vm_byte* _end)
 {
-    for (auto& block : blocks)
-    {
-        if (block->HasAddress(_start))
-            return block->HasAddress(_end);
-    }
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
 
-    return false;
+    auto block = FindBlock(_start);
+    return block != blocks.end() && (*block)->HasAddress(_start) && (*block)->HasAddress(_end);
 }
 
 bool Heap::IsAllocated(vm_byte* _addr)
 {
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    if (Slab* slab = FindSlab(slabs, _addr))
+        return slab->IsAllocated(_addr);
+
+    auto block = FindBlock(_addr);
+    return block != blocks.end() && (*block)->IsAllocated(_addr);
+}
+
+std::optional<HeapObject> Heap::FindObject(vm_byte* _addr)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    if (Slab* slab = FindSlab(slabs, _addr))
+        return slab->FindObject(_addr);
+
+    auto block = FindBlock(_addr);
+    if (block == blocks.end() || !(*block)->HasAddress(_addr))
+        return std::nullopt;
+
+    //The chunk of a slab is not an allocation of its own
+    auto object = (*block)->FindObject(_addr);
+    if (object && slabs.count(object->start))
+        return std::nullopt;
+
+    return object;
+}
+
+bool Heap::Mark(vm_byte* _start)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    if (Slab* slab = FindSlab(slabs, _start))
+        return slab->Mark(_start);
+
+    auto block = FindBlock(_start);
+    assert(block != blocks.end() && (*block)->IsAllocated(_start) && "Marked an address that is not an allocation!");
+    return (*block)->Mark(_start);
+}
+
+vm_ui64 Heap::Sweep()
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    std::vector<vm_byte*> unmarked;
     for (auto& block : blocks)
-    {
-        if (block->HasAddress(_addr) && block->IsAllocated(_addr))
-            return true;
-    }
+        block->Sweep(unmarked);
 
-    return false;
+    //The chunks of slabs stay until their thread caches are done with them
+    unmarked.erase(std::remove_if(unmarked.begin(), unmarked.end(), [this](vm_byte* _addr) { return slabs.count(_addr) != 0; }), unmarked.end());
+
+    for (auto& [start, slab] : slabs)
+        slab->Sweep(unmarked);
+
+    for (vm_byte* addr : unmarked)
+        Free(addr);
+
+#ifdef BUILD_DEBUG_HEAP
+    AssertHeuristics();
+#endif
+
+    return unmarked.size();
 }
 
 void Heap::AssertHeuristics()
 {
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
     freeChunks.AssertHeuristics();
 
+    assert(std::adjacent_find(blocks.begin(), blocks.end(), [](Block* _block, Block* _next) { return _block->GetEnd() > _next->GetStart(); }) == blocks.end()
+        && "Heap's blocks are not sorted by their start or overlap!");
+
     size_t expectedSize = 0;
     for (auto& block : blocks)
     {
@@ -390,11 +716,52 @@ void Heap::AssertHeuristics()
         expectedSize += block->GetSize();
     }
 
+    for (auto& [start, slab] : slabs)
+    {
+        assert(start == slab->GetStart() && "Heap's slab list has invalid key/value pair!");
+        assert(FindBlock(start) != blocks.end() && (*FindBlock(start))->IsAllocated(start) && "Heap contains a slab that is not allocated!");
+    }
+
     assert(size == expectedSize && ("Expected size of heap to be " + std::to_string(expectedSize) + " but found Heap::size = " + std::to_string(size)).c_str());
 }
 
+vm_ui64 Heap::GetCacheHits()
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+    return cacheHits;
+}
+
+vm_ui64 Heap::GetCacheMisses()
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+    return cacheMisses;
+}
+
+Slab* Heap::AllocSlab(vm_ui64 _objectSize, ThreadCache* _owner)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    Slab* slab = new Slab(Alloc(HEAP_SLAB_SIZE), _objectSize, _owner);
+    slabs.emplace(slab->start, slab);
+
+    return slab;
+}
+
+void Heap::ReleaseSlab(Slab* _slab)
+{
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
+    vm_byte* start = _slab->start;
+    slabs.erase(start);
+    delete _slab;
+
+    Free(start);
+}
+
 void Heap::Print()
 {
+    std::scoped_lock<std::recursive_mutex> lock(mutex);
+
     std::cout << "Heap Size: " << size << std::endl;
 
     std::cout << "========================Blocks========================" << std::endl;
@@ -407,4 +774,91 @@ void Heap::Print()
     std::cout << "===========================================================" << std::endl;
 }
 
+#pragma endregion
+
+#pragma region ThreadCache
+
+ThreadCache::ThreadCache(Heap* _heap) : heap(_heap), freeObjects(), slabs(), remoteFrees(), hits(0), misses(0) { }
+
+ThreadCache::~ThreadCache()
+{
+    std::scoped_lock<std::recursive_mutex> lock(heap->mutex);
+
+    //Slabs that still hold objects stay until every one of them is freed
+    for (auto& [start, slab] : slabs)
+    {
+        if (slab->IsEmpty())
+            heap->ReleaseSlab(slab);
+        else
+            slab->owner = nullptr;
+    }
+
+    heap->cacheHits += hits;
+    heap->cacheMisses += misses;
+}
+
+size_t ThreadCache::GetSizeClass(vm_ui64 _amt)
+{
+    return std::bit_width(std::max<vm_ui64>(_amt, MIN_CACHED_ALLOC_SIZE) - 1) - std::bit_width<vm_ui64>(MIN_CACHED_ALLOC_SIZE - 1);
+}
+
+void ThreadCache::Refill(size_t _sizeClass)
+{
+    std::scoped_lock<std::recursive_mutex> lock(heap->mutex);
+
+    for (auto& [addr, slab] : remoteFrees)
+        freeObjects[GetSizeClass(slab->objectSize)].emplace_back(addr, slab);
+
+    remoteFrees.clear();
+
+    auto& objects = freeObjects[_sizeClass];
+    if (!objects.empty())
+        return;
+
+    Slab* slab = heap->AllocSlab(MIN_CACHED_ALLOC_SIZE << _sizeClass, this);
+    slabs.emplace(slab->start, slab);
+
+    //Hand out the objects in the order of their addresses
+    for (vm_ui64 index = slab->GetCapacity(); index-- > 0;)
+        objects.emplace_back(slab->start + index * slab->objectSize, slab);
+}
+
+vm_byte* ThreadCache::Alloc(vm_ui64 _amt)
+{
+    if (_amt == 0 || _amt > MAX_CACHED_ALLOC_SIZE)
+        return heap->Alloc(_amt);
+
+    size_t sizeClass = GetSizeClass(_amt);
+    auto& objects = freeObjects[sizeClass];
+
+    if (objects.empty())
+    {
+        misses++;
+        Refill(sizeClass);
+    }
+    else
+        hits++;
+
+    auto [addr, slab] = objects.back();
+    objects.pop_back();
+    slab->Acquire(addr);
+
+    return addr;
+}
+
+void ThreadCache::Free(vm_byte* _addr)
+{
+    Slab* slab = FindSlab(slabs, _addr);
+    if (!slab)
+    {
+        heap->Free(_addr);
+        return;
+    }
+
+    if (!slab->Release(_addr))
+        throw VMError::CANNOT_FREE_UNALLOCATED_PTR(_addr);
+
+    freeObjects[GetSizeClass(slab->objectSize)].emplace_back(_addr, slab);
+}
+
 #pragma endregion
\ No newline at end of file
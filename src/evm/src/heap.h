@@ -1,97 +1,205 @@
 #pragma once
 #include "evm.h"
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <optional>
 #include <thread>
+#include <mutex>
+#include <map>
+#include <array>
+#include <atomic>
+#include <vector>
 
 #define MIN_HEAP_BLOCK_SIZE 1024ull
+#define HEAP_ALIGNMENT 8ull         //Allocations are rounded up to a multiple of it
+#define HEAP_TAG_SIZE 8ull          //The size of the header and of the footer of every chunk
+#define MIN_CHUNK_SIZE 32ull        //Room for the tags and for the links of a free chunk
+#define MAX_EXACT_BIN_SIZE 1024ull
+#define HEAP_SLAB_SIZE 4096ull
+#define MIN_CACHED_ALLOC_SIZE 8ull
+#define MAX_CACHED_ALLOC_SIZE 256ull
 
 class VM;
-struct Chunk;
+class Heap;
 class Block;
+class ThreadCache;
 
-class FreeChunksList
+//An allocation of the heap, which a collection finds from any address that points into it
+struct HeapObject
+{
+    vm_byte *start;
+    vm_ui64 size;
+};
+
+//A view of a chunk in the storage of a block. Its header and footer tags both hold its size, which includes the tags,
+//with the lowest bit set while it is allocated. A free chunk keeps the links of its bin in the first two words after its header.
+class Chunk
 {
+    vm_byte *start;
+
 public:
-    typedef std::unordered_map<vm_ui64, std::unordered_map<Chunk *, Block *>> type;
+    static constexpr vm_ui64 ALLOCATED = 1;
 
-    void Insert(Chunk *_chunk, Block *_block);
-    void Delete(Chunk *_chunk);
-    bool Contains(Chunk *_chunk, Block *_block) const;
-    std::optional<std::pair<Chunk *, Block *>> Find(vm_ui64 _minSize);
+    explicit Chunk(vm_byte *_start) : start(_start) { }
 
-    const type &GetList() { return map; }
+    vm_ui64 &Header() const { return *(vm_ui64 *)start; }
+    vm_ui64 &Footer() const { return *(vm_ui64 *)(start + GetSize() - HEAP_TAG_SIZE); }
+    vm_byte *&Next() const { return *(vm_byte **)(start + HEAP_TAG_SIZE); }
+    vm_byte *&Prev() const { return *(vm_byte **)(start + HEAP_TAG_SIZE * 2); }
 
-    void AssertHeuristics();
-    void Print();
+    void SetTags(vm_ui64 _size, bool _allocated)
+    {
+        Header() = _size | (_allocated ? ALLOCATED : 0);
+        Footer() = Header();
+    }
 
-private:
-    type map;
+    void Print(bool _showData);
+
+    vm_byte *GetStart() const { return start; }
+    vm_byte *GetEnd() const { return start + GetSize(); }
+    vm_byte *GetPayload() const { return start + HEAP_TAG_SIZE; }
+    vm_ui64 GetSize() const { return Header() & ~ALLOCATED; }
+    bool IsAllocated() const { return Header() & ALLOCATED; }
 };
 
-class Chunk
+//The free chunks of every block binned by size, each bin a list that is linked through the chunks themselves. Sizes up to
+//MAX_EXACT_BIN_SIZE get a bin for every HEAP_ALIGNMENT bytes and bigger ones share a bin for every eighth of a power of
+//two. A bitmap of the bins that are not empty finds the first bin that fits a size with a few bit operations. The links
+//live in memory that guest programs can write to, so every link is checked against the heap's blocks before it is followed.
+//Finding a chunk is a best fit whenever the bin of the size has one that fits. Otherwise it comes from the next bin that
+//is not empty, which is not sorted since sorting the bins on every insert made big allocations about twice as slow.
+class FreeChunksList
 {
-    friend Block;
+public:
+    explicit FreeChunksList(Heap *_heap);
 
-    vm_byte *start;
-    vm_ui64 size;
-    Chunk *prev, *next;
-    bool allocated;
+    void Insert(Chunk _chunk);
+    void Delete(Chunk _chunk);
+    bool Contains(Chunk _chunk);
 
-    Chunk(vm_byte *_start, vm_ui64 _size, Chunk *_prev, Chunk *_next);
+    //Returns a chunk of at least _minSize bytes: the smallest that fits out of the bin of the size, or else the first chunk
+    //of the next bin that is not empty, which fits but is not necessarily the smallest one that does
+    std::optional<Chunk> Find(vm_ui64 _minSize);
 
-public:
     void AssertHeuristics();
-    void Print(bool _showData);
+    void Print();
 
-    vm_byte *GetStart() { return start; }
-    vm_ui64 GetSize() { return size; }
-    bool IsAllocated() { return allocated; }
+private:
+    static constexpr size_t EXACT_BIN_COUNT = MAX_EXACT_BIN_SIZE / HEAP_ALIGNMENT;
+    static constexpr size_t SUB_BIN_COUNT = 8; //The bins that split every power of two above MAX_EXACT_BIN_SIZE
+    static constexpr size_t BIN_COUNT = EXACT_BIN_COUNT + 64 * SUB_BIN_COUNT;
+
+    Heap *heap;
+    std::array<vm_byte *, BIN_COUNT> bins = {}; //The first chunk of every bin
+    std::array<vm_ui64, (BIN_COUNT + 63) / 64> nonEmptyBins = {};
+    size_t count;
+
+    static size_t GetBin(vm_ui64 _size);
+
+    //Returns the free chunk a link points at. Throws HEAP_CORRUPTED if it does not point at one.
+    Chunk Follow(vm_byte *_link);
 };
 
+//A region of the heap that is split into chunks which follow each other without gaps. The header of its first chunk and
+//the footer of its last one are not addresses of the heap. A bitmap out of band marks the payload of every allocated
+//chunk so that frees are told apart from frees of other addresses whatever a guest program wrote over the tags.
 class Block
 {
     Memory storage;
-    std::unordered_map<vm_byte *, Chunk *> chunks;
+    std::vector<vm_ui64> allocated; //A bit for every HEAP_ALIGNMENT bytes of the storage
+    std::vector<vm_ui64> marked;    //The allocated chunks that a collection reached, with the same bits as allocated
+
+    bool IsAllocatedBit(vm_byte *_payload) { vm_ui64 index = (_payload - GetStart()) / HEAP_ALIGNMENT; return allocated[index / 64] & (1ull << (index % 64)); }
+    void SetAllocated(vm_byte *_payload, bool _allocated);
 
 public:
     Block(size_t _size, FreeChunksList &_freeChunks);
-    Block(Block &&_b) noexcept;
-    ~Block();
 
-    void Alloc(vm_byte *_chunkPtr, vm_ui64 _amt, FreeChunksList &_freeChunks);
-    void Free(vm_byte *_chunkPtr, FreeChunksList &_freeChunks);
+    //Allocates _size bytes of the free chunk, tags included, and returns its payload
+    vm_byte *Alloc(Chunk _chunk, vm_ui64 _size, FreeChunksList &_freeChunks);
+    //Frees the chunk of the allocated payload and merges it with the chunks on either side of it if they are free
+    void Free(vm_byte *_payload, FreeChunksList &_freeChunks);
 
+    //Whether an allocated or a free chunk starts at the address with tags that keep it inside the block
+    bool HasChunk(vm_byte *_start, bool _allocated);
     bool IsAllocated(vm_byte *_addr);
-    bool HasAddress(vm_byte *_addr);
+
+    //Returns the allocated chunk whose payload holds the address, which is found from the closest payload before it
+    std::optional<HeapObject> FindObject(vm_byte *_addr);
+    //Marks the payload of an allocated chunk. Returns false if it already was.
+    bool Mark(vm_byte *_payload);
+    //Adds the payloads of the allocated chunks that are not marked to the list and unmarks the others
+    void Sweep(std::vector<vm_byte *> &_unmarked);
+
+    bool HasAddress(vm_byte *_addr) { return _addr >= GetStart() + HEAP_TAG_SIZE && _addr < GetEnd() - HEAP_TAG_SIZE; }
+    bool HasStorage(vm_byte *_addr) { return _addr >= GetStart() && _addr < GetEnd(); }
     bool IsEmpty();
 
-    void AssertHeuristics(const FreeChunksList &_freeChunks);
+    void AssertHeuristics(FreeChunksList &_freeChunks);
     void Print();
 
     size_t GetSize() { return storage.size(); }
     vm_byte *GetStart() { return &storage.front(); }
-    Chunk *GetFirstChunk() { return chunks.at(&storage.front()); }
+    vm_byte *GetEnd() { return GetStart() + storage.size(); }
+    Chunk GetFirstChunk() { return Chunk(GetStart()); }
+};
 
-    Block &operator=(Block &&_b) noexcept
-    {
-        if (this == &_b)
-            return *this;
+//A chunk of the heap that a thread cache splits into objects of a single size
+class Slab
+{
+    friend class Heap;
+    friend class ThreadCache;
 
-        storage = std::move(_b.storage);
-        chunks = std::move(_b.chunks);
-        return *this;
-    }
+    static constexpr vm_ui64 MAX_OBJECTS = HEAP_SLAB_SIZE / MIN_CACHED_ALLOC_SIZE;
+
+    vm_byte *start;
+    vm_ui64 objectSize;
+    ThreadCache *owner; //Guarded by the heap's mutex. Null once the thread that allocated it has finished.
+    std::array<std::atomic<vm_ui64>, MAX_OBJECTS / 64> allocated; //A bit for every object, which other threads clear when they free it
+    std::array<vm_ui64, MAX_OBJECTS / 64> marked;                 //The objects that a collection reached
+
+    Slab(vm_byte *_start, vm_ui64 _objectSize, ThreadCache *_owner);
+
+    //Marks the object at the address as allocated or free. Release returns false when it is not an allocated object.
+    void Acquire(vm_byte *_addr);
+    bool Release(vm_byte *_addr);
+
+public:
+    bool HasAddress(vm_byte *_addr) { return _addr >= start && _addr < start + HEAP_SLAB_SIZE; }
+    bool IsAllocated(vm_byte *_addr);
+    bool IsEmpty();
+
+    std::optional<HeapObject> FindObject(vm_byte *_addr);
+    bool Mark(vm_byte *_addr);
+    void Sweep(std::vector<vm_byte *> &_unmarked);
+
+    vm_byte *GetStart() { return start; }
+    vm_ui64 GetObjectSize() { return objectSize; }
+    vm_ui64 GetCapacity() { return HEAP_SLAB_SIZE / objectSize; }
 };
 
 class Heap
 {
+    friend class FreeChunksList;
+    friend class ThreadCache;
+
     VM *vm;
 
-    std::vector<Block *> blocks;
+    std::vector<Block *> blocks; //Sorted by their start so that finding the block of an address is a binary search
     FreeChunksList freeChunks;
-    size_t size;
+    std::atomic<size_t> size; //Read without the lock to tell when the heap grew enough to collect it
+    std::map<vm_byte *, Slab *> slabs; //The slabs of every thread cache by their start
+    std::unordered_set<vm_byte *> regions; //The allocations that arenas own, which only their arena frees
+    vm_ui64 cacheHits, cacheMisses;    //The sums of the counters of the thread caches that were destroyed
+    std::recursive_mutex mutex; //Every thread allocates from and accesses the same heap
+
+    //Returns the block whose storage holds the address or the end of the blocks if there is none
+    std::vector<Block *>::iterator FindBlock(vm_byte *_addr);
+    bool IsFreeChunk(vm_byte *_start);
+
+    Slab *AllocSlab(vm_ui64 _objectSize, ThreadCache *_owner);
+    void ReleaseSlab(Slab *_slab);
 
 public:
     Heap(VM *_vm);
@@ -99,12 +207,57 @@ public:
 
     vm_byte *Alloc(vm_ui64 _amt);
     void Free(vm_byte *_addr);
+    //Allocates and frees the regions of arenas. Free refuses to free a region so that guest programs cannot free one behind its arena's back.
+    vm_byte *AllocRegion(vm_ui64 _amt);
+    void FreeRegion(vm_byte *_addr);
     bool IsAddress(vm_byte *_addr);
     bool IsAddressRange(vm_byte *_start, vm_byte *_end);
     bool IsAllocated(vm_byte *_addr);
 
+    //Returns the allocation that holds the address, which may point anywhere into it, or nothing if there is none
+    std::optional<HeapObject> FindObject(vm_byte *_addr);
+    //Marks the allocation that starts at the address as reachable. Returns false if it already was.
+    bool Mark(vm_byte *_start);
+    //Frees every allocation that was not marked since the last sweep and unmarks the others. Returns how many it freed.
+    vm_ui64 Sweep();
+
     void AssertHeuristics();
     void Print();
 
     size_t GetSize() { return size; }
+    vm_ui64 GetCacheHits();
+    vm_ui64 GetCacheMisses();
+};
+
+//Serves the small allocations of a thread from slabs that only it allocates from, so that they do not lock the heap.
+//Objects that the thread frees go straight back to its free lists. Objects that other threads free are handed back
+//through the heap and only taken back once the thread runs out of objects of their size.
+class ThreadCache
+{
+    friend class Heap;
+
+    static constexpr size_t SIZE_CLASS_COUNT = 6; //Powers of two from MIN_CACHED_ALLOC_SIZE to MAX_CACHED_ALLOC_SIZE
+
+    Heap *heap;
+    std::array<std::vector<std::pair<vm_byte *, Slab *>>, SIZE_CLASS_COUNT> freeObjects;
+    std::map<vm_byte *, Slab *> slabs;                     //The slabs the thread allocated by their start
+    std::vector<std::pair<vm_byte *, Slab *>> remoteFrees; //Guarded by the heap's mutex
+    vm_ui64 hits, misses;
+
+    static size_t GetSizeClass(vm_ui64 _amt);
+    void Refill(size_t _sizeClass);
+
+public:
+    explicit ThreadCache(Heap *_heap);
+    ~ThreadCache();
+
+    ThreadCache(const ThreadCache &) = delete;
+    ThreadCache &operator=(const ThreadCache &) = delete;
+
+    vm_byte *Alloc(vm_ui64 _amt);
+    void Free(vm_byte *_addr);
+
+    //The number of small allocations served from the free lists and the number that had to lock the heap to refill them
+    vm_ui64 GetHits() { return hits; }
+    vm_ui64 GetMisses() { return misses; }
 };
\ No newline at end of file
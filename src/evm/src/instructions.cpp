@@ -1,7 +1,12 @@
 #include "instructions.h"
 #include <iostream>
+#include <atomic>
+#include <array>
+#include <utility>
+#include <vector>
 #include "thread.h"
 #include "vm.h"
+#include "../build.h"
 
 namespace Instructions
 {
@@ -10,470 +15,1010 @@ namespace Instructions
         std::runtime_error CompilationNotImplemented(const vm_byte* _instr) { return std::runtime_error("Instruction compilation not implemented: " + ToString(_instr)); }
     }
 
-    void Execute(const NOOP* _instr, Thread* _thread) { return; }
+    template <OpCode OPCODE>
+    const Decoded* Execute(const Decoded* _instr, Thread* _thread);
 
-    void Execute(const CONVERT* _instr, Thread* _thread)
+    //Defines the handler for an op code. Handlers return the next instruction to execute.
+#define EXECUTE(OPCODE) template <> const Decoded* Execute<OpCode::OPCODE>(const Decoded* _instr, [[maybe_unused]] Thread* _thread)
+
+    EXECUTE(NOOP) { return _instr + 1; }
+
+    template <DataType FROM, DataType TO>
+    Word Convert(Word _value) { return Word(typename HostType<TO>::type(_value.As<typename HostType<FROM>::type>())); }
+
+    template <size_t... PAIRS>
+    constexpr std::array<Converter, sizeof...(PAIRS)> CreateConverters(std::index_sequence<PAIRS...>)
     {
-        auto value = _thread->PopStack();
+        return { &Convert<DataType(PAIRS / DATA_TYPE_COUNT), DataType(PAIRS % DATA_TYPE_COUNT)>... };
+    }
+
+    //The conversion kernel for every pair of data types indexed by from * DATA_TYPE_COUNT + to
+    constexpr auto CONVERTERS = CreateConverters(std::make_index_sequence<DATA_TYPE_COUNT * DATA_TYPE_COUNT>());
+
+    //Whether converting between the data types leaves the bytes of the value unchanged
+    constexpr bool IsNoOpConversion(DataType _from, DataType _to)
+    {
+        //Data types are declared in pairs of the same width that only differ in signedness
+        return _from == _to || (_from < DataType::F32 && _to < DataType::F32 && (vm_byte)_from / 2 == (vm_byte)_to / 2);
+    }
+
+    static_assert(IsNoOpConversion(DataType::I32, DataType::UI32) && !IsNoOpConversion(DataType::UI32, DataType::I64) && !IsNoOpConversion(DataType::F32, DataType::F64));
+
+    EXECUTE(CONVERT)
+    {
+        Word& value = _thread->PeekStack();
+        value = _instr->converter(value);
+        return _instr + 1;
+    }
+
+    //Returns the address of a heap word that is accessed atomically or waited on
+    static vm_byte* GetAtomicAddress(Thread* _thread, vm_byte* _addr)
+    {
+        if (!_thread->GetVM()->GetHeap().IsAddressRange(_addr, _addr + WORD_SIZE - 1))
+            throw VMError::INVALID_MEM_ACCESS(_addr, _addr + WORD_SIZE - 1);
+
+        if ((uintptr_t)_addr % std::atomic_ref<vm_ui64>::required_alignment != 0)
+            throw VMError::UNALIGNED_MEM_ACCESS(_addr);
+
+        return _addr;
+    }
 
-        switch (_instr->from)
+    static Channel* GetChannel(Thread* _thread, vm_ui64 _id)
+    {
+        Channel* channel = _thread->GetVM()->GetChannels().Get(_id);
+        if (!channel)
+            throw VMError::INVALID_CHANNEL_ID(_id);
+
+        return channel;
+    }
+
+    EXECUTE(SYSCALL)
+    {
+        if ((vm_byte)_instr->code >= (vm_byte)SysCallCode::_COUNT)
+            throw VMError::UNKNOWN_SYSCALL_CODE((vm_byte)_instr->code);
+
+        switch (_instr->code)
         {
-        case DataType::I8: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_i8)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_i8)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_i8)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_i8)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_i8)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_i8)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_i8)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_i8)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_i8)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_i8)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::EXIT: { _thread->GetVM()->Quit(_thread->PopStack().as_i64); } break;
+        case SysCallCode::PRINTC:
+        {
+            vm_byte c = _thread->PopStack().as_byte;
+            std::scoped_lock<std::mutex> lock(_thread->GetVM()->mutex);
+            _thread->GetVM()->GetStdOut() << c;
         } break;
-        case DataType::UI8: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_ui8)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_ui8)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_ui8)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_ui8)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_ui8)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_ui8)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_ui8)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_ui8)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_ui8)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_ui8)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::MALLOC:
+        {
+            vm_ui64 amt = _thread->PopStack().as_ui64;
+            _thread->PushStack(_thread->GetHeapCache().Alloc(amt));
+            if (_thread->GetVM()->CountAllocation(amt))
+                _thread->Yield();
         } break;
-        case DataType::I16: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_i16)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_i16)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_i16)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_i16)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_i16)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_i16)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_i16)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_i16)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_i16)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_i16)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::FREE: { _thread->GetHeapCache().Free(_thread->PopStack().as_ptr); } break;
+        case SysCallCode::SPAWN:
+        {
+            vm_ui64 argCount = _thread->PopStack().as_ui64;
+            auto entry = _thread->GetVM()->GetInstruction(_thread->PopStack().as_ui64);
+            if (argCount > _thread->GetSP() / WORD_SIZE)
+                throw VMError::STACK_UNDERFLOW();
+
+            //The first arg is the deepest one like for CALL
+            std::vector<Word> args(argCount);
+            for (vm_ui64 i = argCount; i > 0; i--)
+                args[i - 1] = _thread->PopStack();
+
+            _thread->PushStack(_thread->GetVM()->SpawnThread(_thread->GetStack().size(), entry, args, true));
         } break;
-        case DataType::UI16: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_ui16)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_ui16)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_ui16)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_ui16)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_ui16)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_ui16)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_ui16)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_ui16)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_ui16)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_ui16)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::JOIN:
+        {
+            Word& id = _thread->PeekStack();
+            auto value = _thread->Join(id.as_ui64);
+            if (!value)
+                return _instr; //Joins again once the thread finishes
+
+            id = *value;
         } break;
-        case DataType::I32: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_i32)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_i32)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_i32)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_i32)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_i32)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_i32)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_i32)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_i32)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_i32)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_i32)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::YIELD: { _thread->Yield(); } break;
+        case SysCallCode::PARALLEL_FOR:
+        {
+            //The operands stay on the stack until every chunk is done since the thread runs the loop again once it wakes
+            if (_thread->GetSP() < WORD_SIZE * 4)
+                throw VMError::STACK_UNDERFLOW();
+
+            vm_ui64 grain = _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE).as_ui64;
+            vm_i64 end = _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 2).as_i64;
+            vm_i64 begin = _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 3).as_i64;
+            auto body = _thread->GetVM()->GetInstruction(_thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 4).as_ui64);
+
+            if (!_thread->ParallelFor(body, begin, end, grain))
+                return _instr;
+
+            _thread->OffsetSP(-(vm_i64)WORD_SIZE * 4);
         } break;
-        case DataType::UI32: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_ui32)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_ui32)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_ui32)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_ui32)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_ui32)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_ui32)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_ui32)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_ui32)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_ui32)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_ui32)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::WAIT:
+        {
+            //The operands stay on the stack while the thread is blocked since it executes the wait again once it wakes
+            if (_thread->GetSP() < WORD_SIZE * 3)
+                throw VMError::STACK_UNDERFLOW();
+
+            vm_i64 timeout = _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE).as_i64;
+            vm_ui64 expected = _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 2).as_ui64;
+            vm_byte* addr = GetAtomicAddress(_thread, _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 3).as_ptr);
+
+            auto result = _thread->Wait(addr, expected, timeout);
+            if (!result)
+                return _instr;
+
+            _thread->OffsetSP(-(vm_i64)WORD_SIZE * 2);
+            _thread->PeekStack() = (vm_i64)*result;
         } break;
-        case DataType::I64: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_i64)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_i64)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_i64)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_i64)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_i64)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_i64)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_i64)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_i64)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_i64)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_i64)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::CHANNEL:
+        {
+            vm_ui64 capacity = _thread->PopStack().as_ui64;
+            if (capacity == 0 || capacity > MAX_CHANNEL_CAPACITY)
+                throw VMError::INVALID_CHANNEL_CAPACITY();
+
+            _thread->PushStack(_thread->GetVM()->GetChannels().Create(capacity));
         } break;
-        case DataType::UI64: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_ui64)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_ui64)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_ui64)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_ui64)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_ui64)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_ui64)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_ui64)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_ui64)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_ui64)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_ui64)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::SEND:
+        {
+            //Blocked sends and receives keep their operands on the stack and execute again once the thread wakes
+            if (_thread->GetSP() < WORD_SIZE * 2)
+                throw VMError::STACK_UNDERFLOW();
+
+            Channel* channel = GetChannel(_thread, _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE).as_ui64);
+            if (!channel->Send(_thread, _thread->ReadStack<Word>(_thread->GetSP() - WORD_SIZE * 2)))
+                return _instr;
+
+            _thread->OffsetSP(-(vm_i64)WORD_SIZE * 2);
         } break;
-        case DataType::F32: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_f32)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_f32)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_f32)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_f32)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_f32)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_f32)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_f32)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_f32)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_f32)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_f32)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::RECV:
+        {
+            Word& top = _thread->PeekStack();
+            if (!GetChannel(_thread, top.as_ui64)->Recv(_thread, top))
+                return _instr;
         } break;
-        case DataType::F64: {
-            switch (_instr->to)
-            {
-            case DataType::I8: _thread->PushStack(vm_i8(value.as_f64)); break;
-            case DataType::UI8: _thread->PushStack(vm_ui8(value.as_f64)); break;
-            case DataType::I16: _thread->PushStack(vm_i16(value.as_f64)); break;
-            case DataType::UI16: _thread->PushStack(vm_ui16(value.as_f64)); break;
-            case DataType::I32: _thread->PushStack(vm_i32(value.as_f64)); break;
-            case DataType::UI32: _thread->PushStack(vm_ui32(value.as_f64)); break;
-            case DataType::I64: _thread->PushStack(vm_i64(value.as_f64)); break;
-            case DataType::UI64: _thread->PushStack(vm_ui64(value.as_f64)); break;
-            case DataType::F32: _thread->PushStack(vm_f32(value.as_f64)); break;
-            case DataType::F64: _thread->PushStack(vm_f64(value.as_f64)); break;
-            default: assert(false && "Case not handled");
-            }
+        case SysCallCode::TRY_RECV:
+        {
+            Word& top = _thread->PeekStack();
+            Channel* channel = GetChannel(_thread, top.as_ui64);
+
+            bool received = channel->TryRecv(top);
+            if (!received)
+                top = (vm_ui64)0;
+
+            _thread->PushStack((vm_ui64)received);
+        } break;
+        case SysCallCode::ARENA: { _thread->PushStack(_thread->GetVM()->GetArenas().Create(_thread->PopStack().as_ui64)); } break;
+        case SysCallCode::ARENA_ALLOC:
+        {
+            vm_ui64 amt = _thread->PopStack().as_ui64;
+            Word& id = _thread->PeekStack();
+            id = _thread->GetVM()->GetArenas().Alloc(id.as_ui64, amt);
+        } break;
+        case SysCallCode::ARENA_RESET: { _thread->GetVM()->GetArenas().Reset(_thread->PopStack().as_ui64); } break;
+        case SysCallCode::ARENA_DESTROY: { _thread->GetVM()->GetArenas().Destroy(_thread->PopStack().as_ui64); } break;
+        case SysCallCode::NOTIFY:
+        {
+            vm_ui64 count = _thread->PopStack().as_ui64;
+            vm_byte* addr = GetAtomicAddress(_thread, _thread->PopStack().as_ptr);
+            _thread->PushStack(_thread->GetVM()->Notify(addr, count));
         } break;
         default: assert(false && "Case not handled");
         }
+
+        return _instr + 1;
     }
 
-    void Execute(const SYSCALL* _instr, Thread* _thread)
+    //Returns the result of OPCODE applied to the left and right operands as TYPE
+    template <OpCode OPCODE, DataType TYPE>
+    Word ApplyBinop(Word _left, Word _right)
     {
-        if ((vm_byte)_instr->code >= (vm_byte)SysCallCode::_COUNT)
-            throw VMError::UNKNOWN_SYSCALL_CODE((vm_byte)_instr->code);
+        typedef typename HostType<TYPE>::type T;
+        T left = _left.As<T>(), right = _right.As<T>();
 
-        switch (_instr->code)
+        if constexpr (OPCODE == OpCode::ADD) { return Word(T(left + right)); }
+        else if constexpr (OPCODE == OpCode::SUB) { return Word(T(left - right)); }
+        else if constexpr (OPCODE == OpCode::MUL) { return Word(T(left * right)); }
+        else if constexpr (OPCODE == OpCode::DIV)
         {
-        case SysCallCode::EXIT: { _thread->GetVM()->Quit(_thread->PopStack().as_i64); } break;
-        case SysCallCode::PRINTC: { _thread->GetVM()->GetStdOut() << _thread->PopStack().as_byte; } break;
-        case SysCallCode::MALLOC: { _thread->PushStack(_thread->GetVM()->GetHeap().Alloc(_thread->PopStack().as_ui64)); } break;
-        case SysCallCode::FREE: { _thread->GetVM()->GetHeap().Free(_thread->PopStack().as_ptr); } break;        
-        default: assert(false && "Case not handled");
+            if (right == T(0))
+                throw VMError::DIV_BY_ZERO();
+
+            return Word(T(left / right));
         }
+        else if constexpr (OPCODE == OpCode::EQ) { return Word(left == right); }
+        else if constexpr (OPCODE == OpCode::NEQ) { return Word(left != right); }
+        else { static_assert(OPCODE != OPCODE, "Not a typed binop!"); }
     }
 
-    void Execute(const ADD* _instr, Thread* _thread)
+    //Pops the left and right operands and pushes the result of OPCODE applied to them as TYPE
+    template <OpCode OPCODE, DataType TYPE>
+    const Decoded* ExecuteBinop(const Decoded* _instr, Thread* _thread)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
+        Word left = _thread->PopStack(), right = _thread->PopStack();
+        _thread->PushStack(ApplyBinop<OPCODE, TYPE>(left, right));
+        return _instr + 1;
+    }
 
-        switch (_instr->type)
-        {
-        case DataType::I8: _thread->PushStack(Word(vm_i8(left.as_i8 + right.as_i8))); break;
-        case DataType::UI8: _thread->PushStack(Word(vm_ui8(left.as_ui8 + right.as_ui8))); break;
-        case DataType::I16: _thread->PushStack(Word(vm_i16(left.as_i16 + right.as_i16))); break;
-        case DataType::UI16: _thread->PushStack(Word(vm_ui16(left.as_ui16 + right.as_ui16))); break;
-        case DataType::I32: _thread->PushStack(Word(left.as_i32 + right.as_i32)); break;
-        case DataType::UI32: _thread->PushStack(Word(left.as_ui32 + right.as_ui32)); break;
-        case DataType::I64: _thread->PushStack(Word(left.as_i64 + right.as_i64)); break;
-        case DataType::UI64: _thread->PushStack(Word(left.as_ui64 + right.as_ui64)); break;
-        case DataType::F32: _thread->PushStack(Word(left.as_f32 + right.as_f32)); break;
-        case DataType::F64: _thread->PushStack(Word(left.as_f64 + right.as_f64)); break;
-        default: assert(false && "Case not handled");
-        }
+#define TYPED_BINOP_EXECUTE(OPCODE, TYPE) EXECUTE(OPCODE##_##TYPE) { return ExecuteBinop<OpCode::OPCODE, DataType::TYPE>(_instr, _thread); }
+    FOR_EACH_TYPED_BINOP(TYPED_BINOP_EXECUTE)
+#undef TYPED_BINOP_EXECUTE
+
+    //Program::Decode specializes every typed binop, so these only run for instructions that were decoded by hand
+#define TYPED_BINOP_CASE(OPCODE, TYPE) case DataType::TYPE: return ExecuteBinop<OpCode::OPCODE, DataType::TYPE>(_instr, _thread);
+#define TYPED_BINOP_EXECUTE(OPCODE)                                                                              \
+    EXECUTE(OPCODE)                                                                                              \
+    {                                                                                                            \
+        switch (_instr->type)                                                                                    \
+        {                                                                                                        \
+            FOR_EACH_DATA_TYPE(TYPED_BINOP_CASE, OPCODE)                                                         \
+        default: assert(false && "Case not handled");                                                            \
+        }                                                                                                        \
+                                                                                                                 \
+        return nullptr;                                                                                          \
     }
 
-    void Execute(const SUB* _instr, Thread* _thread)
+    TYPED_BINOP_EXECUTE(ADD)
+    TYPED_BINOP_EXECUTE(SUB)
+    TYPED_BINOP_EXECUTE(MUL)
+    TYPED_BINOP_EXECUTE(DIV)
+    TYPED_BINOP_EXECUTE(EQ)
+    TYPED_BINOP_EXECUTE(NEQ)
+#undef TYPED_BINOP_EXECUTE
+#undef TYPED_BINOP_CASE
+
+    //Backward branches burn the fuel of the thread by the length of the loop they close, which keeps the check
+    //out of straight-line code
+    static const Decoded* Branch(const Decoded* _instr, Thread* _thread)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
+        const Decoded* target = _thread->GetCode() + _instr->target;
+        if (target <= _instr)
+            _thread->BurnFuel(_instr - target + 1);
 
-        switch (_instr->type)
-        {
-        case DataType::I8: _thread->PushStack(Word(vm_i8(left.as_i8 - right.as_i8))); break;
-        case DataType::UI8: _thread->PushStack(Word(vm_ui8(left.as_ui8 - right.as_ui8))); break;
-        case DataType::I16: _thread->PushStack(Word(vm_i16(left.as_i16 - right.as_i16))); break;
-        case DataType::UI16: _thread->PushStack(Word(vm_ui16(left.as_ui16 - right.as_ui16))); break;
-        case DataType::I32: _thread->PushStack(Word(left.as_i32 - right.as_i32)); break;
-        case DataType::UI32: _thread->PushStack(Word(left.as_ui32 - right.as_ui32)); break;
-        case DataType::I64: _thread->PushStack(Word(left.as_i64 - right.as_i64)); break;
-        case DataType::UI64: _thread->PushStack(Word(left.as_ui64 - right.as_ui64)); break;
-        case DataType::F32: _thread->PushStack(Word(left.as_f32 - right.as_f32)); break;
-        case DataType::F64: _thread->PushStack(Word(left.as_f64 - right.as_f64)); break;
-        default: assert(false && "Case not handled");
-        }
+        return target;
+    }
+
+    EXECUTE(JUMP) { return Branch(_instr, _thread); }
+    EXECUTE(JUMPNZ) { return _thread->PopStack().AsBool() ? Branch(_instr, _thread) : _instr + 1; }
+    EXECUTE(JUMPZ) { return _thread->PopStack().AsBool() ? _instr + 1 : Branch(_instr, _thread); }
+
+    //Calls push the index of the instruction after them rather than its address, so that a return address the guest
+    //program overwrote can only ever point at an instruction. Index zero cannot follow a call and finishes the thread.
+    static const Decoded* ReturnTarget(vm_ui64 _idx, Thread* _thread)
+    {
+        if (_idx >= _thread->GetCodeSize())
+            throw VMError::INVALID_CODE_ADDRESS(_idx);
+
+        return _thread->GetCode() + _idx;
+    }
+
+    EXECUTE(CALL)
+    {
+        _thread->BurnFuel(1);                                           //Recursion has no backward branches
+        _thread->PushStack((vm_ui64)(_instr + 1 - _thread->GetCode())); //Push return value
+        _thread->PushFrame();                                           //Push current frame pointer and set the frame pointer for new frame
+        _thread->OffsetSP(_instr->storage);                             //Allocate space of stack for function local storage
+        return _thread->GetCode() + _instr->target;                     //Jump to target
     }
 
-    void Execute(const MUL* _instr, Thread* _thread)
+    EXECUTE(RET)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
+        _thread->PopFrame();                                                   //Clear current frame and restore previous frame pointer
+        vm_ui64 returnIdx = _thread->PopStack().as_ui64;                       //Pop off the instruction after most recent call
 
-        switch (_instr->type)
+        //Spawned threads finish by returning from the function they started in, unless they help with a parallel loop
+        //that has chunks left
+        if (!returnIdx)
         {
-        case DataType::I8: _thread->PushStack(Word(vm_i8(left.as_i8 * right.as_i8))); break;
-        case DataType::UI8: _thread->PushStack(Word(vm_ui8(left.as_ui8 * right.as_ui8))); break;
-        case DataType::I16: _thread->PushStack(Word(vm_i16(left.as_i16 * right.as_i16))); break;
-        case DataType::UI16: _thread->PushStack(Word(vm_ui16(left.as_ui16 * right.as_ui16))); break;
-        case DataType::I32: _thread->PushStack(Word(left.as_i32 * right.as_i32)); break;
-        case DataType::UI32: _thread->PushStack(Word(left.as_ui32 * right.as_ui32)); break;
-        case DataType::I64: _thread->PushStack(Word(left.as_i64 * right.as_i64)); break;
-        case DataType::UI64: _thread->PushStack(Word(left.as_ui64 * right.as_ui64)); break;
-        case DataType::F32: _thread->PushStack(Word(left.as_f32 * right.as_f32)); break;
-        case DataType::F64: _thread->PushStack(Word(left.as_f64 * right.as_f64)); break;
-        default: assert(false && "Case not handled");
+            if (auto next = _thread->NextChunk())
+                return next;
+
+            _thread->Exit(0);
+            return _instr;
         }
+
+        return ReturnTarget(returnIdx, _thread);                               //Jump to instruction after most recent call
     }
 
-    void Execute(const DIV* _instr, Thread* _thread)
+    EXECUTE(RETV)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
+        Word retValue = _thread->PopStack();                                   //Pop off return value
+        _thread->PopFrame();                                                   //Clear current frame and restore previous frame pointer
+        vm_ui64 returnIdx = _thread->PopStack().as_ui64;                       //Pop off the instruction after most recent call
+        _thread->PushStack(retValue);                                          //Push return value
 
-        switch (_instr->type)
+        if (!returnIdx)
         {
-        case DataType::I8: {
-            if (right.as_i8 == vm_i8(0))
-                throw VMError::DIV_BY_ZERO();
+            if (auto next = _thread->NextChunk())
+                return next;
 
-            _thread->PushStack(Word(vm_i8(left.as_i8 / right.as_i8)));
-        } break;
-        case DataType::UI8: {
-            if (right.as_ui8 == vm_ui8(0))
-                throw VMError::DIV_BY_ZERO();
+            _thread->Exit(retValue.as_i64);
+            return _instr;
+        }
 
-            _thread->PushStack(Word(vm_ui8(left.as_ui8 / right.as_ui8)));
-        } break;
-        case DataType::I16: {
-            if (right.as_i16 == vm_i16(0))
-                throw VMError::DIV_BY_ZERO();
+        return ReturnTarget(returnIdx, _thread);                               //Jump to instruction after most recent call
+    }
 
-            _thread->PushStack(Word(vm_i16(left.as_i16 / right.as_i16)));
-        } break;
-        case DataType::UI16: {
-            if (right.as_ui16 == vm_ui16(0))
-                throw VMError::DIV_BY_ZERO();
+    EXECUTE(PUSH) { _thread->PushStack(_instr->value); return _instr + 1; }
+    EXECUTE(POP) { _thread->PopStack(); return _instr + 1; }
+    EXECUTE(LLOAD) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetFP() + _instr->offset)); return _instr + 1; }
+    EXECUTE(LSTORE) { _thread->WriteStack(_thread->GetFP() + _instr->offset, _thread->PopStack()); return _instr + 1; }
+    EXECUTE(PLOAD) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetFP() + _instr->offset)); return _instr + 1; }
+    EXECUTE(PSTORE) { _thread->WriteStack(_thread->GetFP() + _instr->offset, _thread->PopStack()); return _instr + 1; }
 
-            _thread->PushStack(Word(vm_ui16(left.as_ui16 / right.as_ui16)));
-        } break;
-        case DataType::I32: {
-            if (right.as_i32 == vm_i32(0))
-                throw VMError::DIV_BY_ZERO();
+    EXECUTE(SLOAD) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetSP() + _instr->offset)); return _instr + 1; }
 
-            _thread->PushStack(Word(left.as_i32 / right.as_i32));
-        } break;
-        case DataType::UI32: {
-            if (right.as_ui32 == vm_ui32(0))
-                throw VMError::DIV_BY_ZERO();
+    EXECUTE(SSTORE)
+    {
+        auto value = _thread->PopStack();
+        _thread->WriteStack(_thread->GetSP() + _instr->offset, value);
+        return _instr + 1;
+    }
 
-            _thread->PushStack(Word(left.as_ui32 / right.as_ui32));
-        } break;
-        case DataType::I64: {
-            if (right.as_i64 == vm_i64(0))
-                throw VMError::DIV_BY_ZERO();
+    EXECUTE(MLOAD)
+    {
+        vm_byte* addr = _thread->PopStack().as_ptr + _instr->offset;
 
-            _thread->PushStack(Word(left.as_i64 / right.as_i64));
-        } break;
-        case DataType::UI64: {
-            if (right.as_ui64 == vm_ui64(0))
-                throw VMError::DIV_BY_ZERO();
+        if (!_thread->GetVM()->GetHeap().IsAddressRange(addr, addr + WORD_SIZE - 1))
+            throw VMError::INVALID_MEM_ACCESS(addr, addr + WORD_SIZE - 1);
 
-            _thread->PushStack(Word(left.as_ui64 / right.as_ui64));
-        } break;
-        case DataType::F32: {
-            if (right.as_f32 == vm_f32(0))
-                throw VMError::DIV_BY_ZERO();
+        _thread->PushStack(*(Word*)addr);
+        return _instr + 1;
+    }
 
-            _thread->PushStack(Word(left.as_f32 / right.as_f32));
-        } break;
-        case DataType::F64: {
-            if (right.as_f64 == vm_f64(0))
-                throw VMError::DIV_BY_ZERO();
+    EXECUTE(MSTORE)
+    {
+        vm_byte* addr = _thread->PopStack().as_ptr + _instr->offset;
+        Word value = _thread->PopStack();
 
-            _thread->PushStack(Word(left.as_f64 / right.as_f64));
+        if (!_thread->GetVM()->GetHeap().IsAddressRange(addr, addr + WORD_SIZE - 1))
+            throw VMError::INVALID_MEM_ACCESS(addr, addr + WORD_SIZE - 1);
+
+        *(Word*)addr = value;
+        return _instr + 1;
+    }
+
+    EXECUTE(ATOMIC)
+    {
+        vm_byte* addr = GetAtomicAddress(_thread, _thread->PopStack().as_ptr + _instr->offset);
+        std::atomic_ref<vm_ui64> word(*(vm_ui64*)addr);
+
+        switch (_instr->atomic)
+        {
+        case AtomicCode::LOAD: _thread->PushStack(word.load(std::memory_order_acquire)); break;
+        case AtomicCode::STORE: word.store(_thread->PopStack().as_ui64, std::memory_order_release); break;
+        case AtomicCode::CAS:
+        {
+            vm_ui64 expected = _thread->PopStack().as_ui64;
+            vm_ui64 desired = _thread->PopStack().as_ui64;
+            word.compare_exchange_strong(expected, desired, std::memory_order_acq_rel, std::memory_order_acquire);
+            _thread->PushStack(expected); //Only updated to the word found when that is not the expected one
         } break;
+        case AtomicCode::FETCH_ADD: _thread->PushStack(word.fetch_add(_thread->PopStack().as_ui64, std::memory_order_acq_rel)); break;
+        case AtomicCode::FETCH_AND: _thread->PushStack(word.fetch_and(_thread->PopStack().as_ui64, std::memory_order_acq_rel)); break;
+        case AtomicCode::FETCH_OR: _thread->PushStack(word.fetch_or(_thread->PopStack().as_ui64, std::memory_order_acq_rel)); break;
+        case AtomicCode::EXCHANGE: _thread->PushStack(word.exchange(_thread->PopStack().as_ui64, std::memory_order_acq_rel)); break;
         default: assert(false && "Case not handled");
         }
+
+        return _instr + 1;
     }
 
-    void Execute(const EQ* _instr, Thread* _thread)
+    EXECUTE(INVALID) { throw VMError::UNKNOWN_OP_CODE(_instr->value.as_byte); }
+
+    //Runs the handlers of a sequence back to back. Every handler but the last one continues with the next
+    //instruction, so each of them executes its own decoded instruction.
+    template <OpCode FIRST, OpCode... REST>
+    const Decoded* ExecuteSequence(const Decoded* _instr, Thread* _thread)
+    {
+        if constexpr (sizeof...(REST) == 0)
+            return Execute<FIRST>(_instr, _thread);
+        else
+            return ExecuteSequence<REST...>(Execute<FIRST>(_instr, _thread), _thread);
+    }
+
+#define SUPERINSTRUCTION_EXECUTE(NAME, ...) EXECUTE(NAME) { return ExecuteSequence<__VA_ARGS__>(_instr, _thread); }
+    FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_EXECUTE)
+#undef SUPERINSTRUCTION_EXECUTE
+
+#undef EXECUTE
+
+    //The sequence of every op code indexed by op code. Op codes other than superinstructions are a sequence of one.
+    static const auto SEQUENCES = []()
+    {
+        std::array<std::vector<OpCode>, (size_t)OpCode::_DECODED_COUNT> sequences;
+
+        for (size_t i = 0; i < sequences.size(); i++)
+            sequences[i] = { OpCode(i) };
+
+#define SUPERINSTRUCTION_SEQUENCE(NAME, ...) sequences[(size_t)OpCode::NAME] = { __VA_ARGS__ };
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_SEQUENCE)
+#undef SUPERINSTRUCTION_SEQUENCE
+
+        return sequences;
+    }();
+
+    std::span<const OpCode> GetSequence(OpCode _opcode) { return SEQUENCES[(size_t)_opcode]; }
+
+    OpCode Fuse(const Decoded* _instrs, vm_ui64 _count)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
+        OpCode fused = _instrs->opcode;
+        size_t fusedLength = 1;
 
-        switch (_instr->type)
+        for (auto& sequence : SEQUENCES)
         {
-        case DataType::I8: _thread->PushStack(Word(left.as_i8 == right.as_i8)); break;
-        case DataType::UI8: _thread->PushStack(Word(left.as_ui8 == right.as_ui8)); break;
-        case DataType::I16: _thread->PushStack(Word(left.as_i16 == right.as_i16)); break;
-        case DataType::UI16: _thread->PushStack(Word(left.as_ui16 == right.as_ui16)); break;
-        case DataType::I32: _thread->PushStack(Word(left.as_i32 == right.as_i32)); break;
-        case DataType::UI32: _thread->PushStack(Word(left.as_ui32 == right.as_ui32)); break;
-        case DataType::I64: _thread->PushStack(Word(left.as_i64 == right.as_i64)); break;
-        case DataType::UI64: _thread->PushStack(Word(left.as_ui64 == right.as_ui64)); break;
-        case DataType::F32: _thread->PushStack(Word(left.as_f32 == right.as_f32)); break;
-        case DataType::F64: _thread->PushStack(Word(left.as_f64 == right.as_f64)); break;
-        default: assert(false && "Case not handled");
+            if (sequence.size() <= fusedLength || sequence.size() > _count)
+                continue;
+
+            bool matches = true;
+            for (size_t i = 0; i < sequence.size() && matches; i++)
+                matches = _instrs[i].opcode == sequence[i];
+
+            if (matches)
+            {
+                fused = OpCode(&sequence - SEQUENCES.data());
+                fusedLength = sequence.size();
+            }
         }
+
+        return fused;
     }
 
-    void Execute(const NEQ* _instr, Thread* _thread)
+    const Decoded* Execute(const Decoded* _instr, Thread* _thread)
     {
-        auto left = _thread->PopStack(), right = _thread->PopStack();
-
-        switch (_instr->type)
+        switch (LoadOpCode(_instr))
         {
-        case DataType::I8: _thread->PushStack(Word(left.as_i8 != right.as_i8)); break;
-        case DataType::UI8: _thread->PushStack(Word(left.as_ui8 != right.as_ui8)); break;
-        case DataType::I16: _thread->PushStack(Word(left.as_i16 != right.as_i16)); break;
-        case DataType::UI16: _thread->PushStack(Word(left.as_ui16 != right.as_ui16)); break;
-        case DataType::I32: _thread->PushStack(Word(left.as_i32 != right.as_i32)); break;
-        case DataType::UI32: _thread->PushStack(Word(left.as_ui32 != right.as_ui32)); break;
-        case DataType::I64: _thread->PushStack(Word(left.as_i64 != right.as_i64)); break;
-        case DataType::UI64: _thread->PushStack(Word(left.as_ui64 != right.as_ui64)); break;
-        case DataType::F32: _thread->PushStack(Word(left.as_f32 != right.as_f32)); break;
-        case DataType::F64: _thread->PushStack(Word(left.as_f64 != right.as_f64)); break;
+        case OpCode::NOOP: return Execute<OpCode::NOOP>(_instr, _thread);
+        case OpCode::PUSH: return Execute<OpCode::PUSH>(_instr, _thread);
+        case OpCode::POP: return Execute<OpCode::POP>(_instr, _thread);
+        case OpCode::ADD: return Execute<OpCode::ADD>(_instr, _thread);
+        case OpCode::SUB: return Execute<OpCode::SUB>(_instr, _thread);
+        case OpCode::MUL: return Execute<OpCode::MUL>(_instr, _thread);
+        case OpCode::DIV: return Execute<OpCode::DIV>(_instr, _thread);
+        case OpCode::EQ: return Execute<OpCode::EQ>(_instr, _thread);
+        case OpCode::NEQ: return Execute<OpCode::NEQ>(_instr, _thread);
+        case OpCode::JUMP: return Execute<OpCode::JUMP>(_instr, _thread);
+        case OpCode::JUMPZ: return Execute<OpCode::JUMPZ>(_instr, _thread);
+        case OpCode::JUMPNZ: return Execute<OpCode::JUMPNZ>(_instr, _thread);
+        case OpCode::SYSCALL: return Execute<OpCode::SYSCALL>(_instr, _thread);
+        case OpCode::SLOAD: return Execute<OpCode::SLOAD>(_instr, _thread);
+        case OpCode::SSTORE: return Execute<OpCode::SSTORE>(_instr, _thread);
+        case OpCode::LLOAD: return Execute<OpCode::LLOAD>(_instr, _thread);
+        case OpCode::LSTORE: return Execute<OpCode::LSTORE>(_instr, _thread);
+        case OpCode::PLOAD: return Execute<OpCode::PLOAD>(_instr, _thread);
+        case OpCode::PSTORE: return Execute<OpCode::PSTORE>(_instr, _thread);
+        case OpCode::MLOAD: return Execute<OpCode::MLOAD>(_instr, _thread);
+        case OpCode::MSTORE: return Execute<OpCode::MSTORE>(_instr, _thread);
+        case OpCode::CONVERT: return Execute<OpCode::CONVERT>(_instr, _thread);
+        case OpCode::CALL: return Execute<OpCode::CALL>(_instr, _thread);
+        case OpCode::RET: return Execute<OpCode::RET>(_instr, _thread);
+        case OpCode::RETV: return Execute<OpCode::RETV>(_instr, _thread);
+        case OpCode::ATOMIC: return Execute<OpCode::ATOMIC>(_instr, _thread);
+        case OpCode::INVALID: return Execute<OpCode::INVALID>(_instr, _thread);
+#define TYPED_BINOP_CASE(OPCODE, TYPE) case OpCode::OPCODE##_##TYPE: return Execute<OpCode::OPCODE##_##TYPE>(_instr, _thread);
+        FOR_EACH_TYPED_BINOP(TYPED_BINOP_CASE)
+#undef TYPED_BINOP_CASE
+#define SUPERINSTRUCTION_CASE(NAME, ...) case OpCode::NAME: return Execute<OpCode::NAME>(_instr, _thread);
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_CASE)
+#undef SUPERINSTRUCTION_CASE
         default: assert(false && "Case not handled");
         }
+
+        return nullptr;
     }
 
-    void Execute(const JUMP* _instr, Thread* _thread) { _thread->instrPtr = _instr->target - _instr->GetSize(); }
+#ifdef EVM_THREADED_DISPATCH
+    static const void* const* THREADED_HANDLERS = nullptr; //Published by ExecuteThreaded(nullptr) since labels cannot be referenced outside of their function
 
-    void Execute(const JUMPNZ* _instr, Thread* _thread)
+    //Runs the thread's instructions until it dies or the vm stops. Instead of returning to a central
+    //switch after every instruction, each handler jumps straight to the handler stored in the next
+    //decoded instruction. Passing a null thread only publishes the handler addresses.
+    void ExecuteThreaded(Thread* _thread)
     {
-        if (!_thread->PopStack().AsBool())
+        static const void* const handlers[] = {
+            &&NOOP_HANDLER, &&SYSCALL_HANDLER, &&CONVERT_HANDLER,
+            &&PUSH_HANDLER, &&POP_HANDLER, &&SLOAD_HANDLER, &&SSTORE_HANDLER, &&LLOAD_HANDLER, &&LSTORE_HANDLER,
+            &&PLOAD_HANDLER, &&PSTORE_HANDLER, &&MLOAD_HANDLER, &&MSTORE_HANDLER,
+            &&ADD_HANDLER, &&SUB_HANDLER, &&MUL_HANDLER, &&DIV_HANDLER, &&EQ_HANDLER, &&NEQ_HANDLER,
+            &&JUMP_HANDLER, &&JUMPZ_HANDLER, &&JUMPNZ_HANDLER, &&CALL_HANDLER, &&RET_HANDLER, &&RETV_HANDLER,
+            &&ATOMIC_HANDLER, &&INVALID_HANDLER,
+#define TYPED_BINOP_HANDLER_ADDRESS(OPCODE, TYPE) &&OPCODE##_##TYPE##_HANDLER,
+            FOR_EACH_TYPED_BINOP(TYPED_BINOP_HANDLER_ADDRESS)
+#undef TYPED_BINOP_HANDLER_ADDRESS
+#define SUPERINSTRUCTION_HANDLER_ADDRESS(NAME, ...) &&NAME##_HANDLER,
+            FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_HANDLER_ADDRESS)
+#undef SUPERINSTRUCTION_HANDLER_ADDRESS
+        };
+        static_assert(sizeof(handlers) / sizeof(void*) == (size_t)OpCode::_DECODED_COUNT, "Every op code must have a handler!");
+
+        if (!_thread)
+        {
+            THREADED_HANDLERS = handlers;
             return;
+        }
 
-        _thread->instrPtr = _instr->target - _instr->GetSize();
+        const Decoded*& ip = _thread->instrPtr;
+
+#ifdef BUILD_DEBUG
+#define DEBUG_BEFORE_EXECUTION()                                                                                 \
+        if (PRINT_INSTR_BEFORE_EXECUTION)                                                                        \
+            std::cout << ToString(ip) << "\t(Thread ID: " << _thread->GetID() << ")" << std::endl;
+#define DEBUG_AFTER_EXECUTION()                                                                                  \
+        if (PRINT_STACK_AFTER_INSTR_EXECUTION)                                                                   \
+            _thread->PrintStack();
+#else
+#define DEBUG_BEFORE_EXECUTION()
+#define DEBUG_AFTER_EXECUTION()
+#endif
+
+#define DISPATCH()                                                                                               \
+        do                                                                                                       \
+        {                                                                                                        \
+            if (!_thread->IsRunning())                                                                           \
+                return;                                                                                          \
+                                                                                                                 \
+            DEBUG_BEFORE_EXECUTION()                                                                             \
+            goto *ip->handler;                                                                                   \
+        } while (false)
+
+#define HANDLER(OPCODE)                                                                                          \
+    OPCODE##_HANDLER:                                                                                            \
+        ip = Execute<OpCode::OPCODE>(ip, _thread);                                                               \
+        DEBUG_AFTER_EXECUTION()                                                                                  \
+        DISPATCH();
+
+        DISPATCH();
+
+        HANDLER(NOOP)
+        HANDLER(SYSCALL)
+        HANDLER(CONVERT)
+        HANDLER(PUSH)
+        HANDLER(POP)
+        HANDLER(SLOAD)
+        HANDLER(SSTORE)
+        HANDLER(LLOAD)
+        HANDLER(LSTORE)
+        HANDLER(PLOAD)
+        HANDLER(PSTORE)
+        HANDLER(MLOAD)
+        HANDLER(MSTORE)
+        HANDLER(ADD)
+        HANDLER(SUB)
+        HANDLER(MUL)
+        HANDLER(DIV)
+        HANDLER(EQ)
+        HANDLER(NEQ)
+        HANDLER(JUMP)
+        HANDLER(JUMPZ)
+        HANDLER(JUMPNZ)
+        HANDLER(CALL)
+        HANDLER(RET)
+        HANDLER(RETV)
+        HANDLER(ATOMIC)
+        HANDLER(INVALID)
+#define TYPED_BINOP_HANDLER(OPCODE, TYPE) HANDLER(OPCODE##_##TYPE)
+        FOR_EACH_TYPED_BINOP(TYPED_BINOP_HANDLER)
+#undef TYPED_BINOP_HANDLER
+#define SUPERINSTRUCTION_HANDLER(NAME, ...) HANDLER(NAME)
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_HANDLER)
+#undef SUPERINSTRUCTION_HANDLER
+
+#undef HANDLER
+#undef DISPATCH
+#undef DEBUG_AFTER_EXECUTION
+#undef DEBUG_BEFORE_EXECUTION
     }
 
-    void Execute(const JUMPZ* _instr, Thread* _thread)
+    const void* GetThreadedHandler(OpCode _opcode)
     {
-        if (_thread->PopStack().AsBool())
-            return;
+        if (!THREADED_HANDLERS)
+            ExecuteThreaded(nullptr);
 
-        _thread->instrPtr = _instr->target - _instr->GetSize();
+        return THREADED_HANDLERS[(size_t)_opcode];
     }
+#endif
 
-    void Execute(const CALL* _instr, Thread* _thread)
+    //The stack of a thread while ExecuteCached runs. The stack pointer and the word on the top of the stack
+    //are kept out of the thread so that they can live in registers across instructions. Without CHECKED the
+    //bounds of the stack are never checked, which is only safe for programs that passed Program::Verify.
+    template <bool CHECKED>
+    struct StackCache
     {
-        _thread->PushStack((vm_byte*)(_thread->instrPtr + _instr->GetSize())); //Push return value
-        _thread->PushFrame();                                          //Push current frame pointer and set the frame pointer for new frame
-        _thread->OffsetSP(_instr->storage);                            //Allocate space of stack for function local storage
-        _thread->instrPtr = _instr->target - _instr->GetSize();    //Jump to target
+        vm_byte* stack;
+        vm_ui64 size;
+        vm_ui64 sp;
+        Word tos; //The word on the top of the stack when sp is not 0. Its slot in the stack is out of date.
+
+        //Loads the cache from the thread
+        void Fill(Thread* _thread)
+        {
+            stack = _thread->stack.data();
+            size = _thread->stack.size();
+            sp = _thread->stackPtr;
+            tos = sp >= WORD_SIZE ? *(Word*)&stack[sp - WORD_SIZE] : Word();
+        }
+
+        //Writes the cache back to the thread. The cache stays valid.
+        void Spill(Thread* _thread)
+        {
+            if (sp >= WORD_SIZE)
+                *(Word*)&stack[sp - WORD_SIZE] = tos;
+
+            _thread->stackPtr = sp;
+        }
+
+        //Throws unless the stack holds at least _bytes
+        void Require(vm_ui64 _bytes)
+        {
+            if constexpr (CHECKED)
+            {
+                if (sp < _bytes)
+                    throw VMError::STACK_UNDERFLOW();
+            }
+        }
+
+        void Push(Word _value)
+        {
+            if constexpr (CHECKED)
+            {
+                if (sp + WORD_SIZE > size)
+                    throw VMError::STACK_OVERFLOW();
+            }
+
+            if (sp >= WORD_SIZE)
+                *(Word*)&stack[sp - WORD_SIZE] = tos;
+
+            tos = _value;
+            sp += WORD_SIZE;
+        }
+
+        Word Pop()
+        {
+            Require(WORD_SIZE);
+
+            Word value = tos;
+            sp -= WORD_SIZE;
+
+            if (sp >= WORD_SIZE)
+                tos = *(Word*)&stack[sp - WORD_SIZE];
+
+            return value;
+        }
+
+        //Reads any position of the stack like Thread::ReadStack
+        Word Read(vm_i64 _pos)
+        {
+            if constexpr (CHECKED)
+            {
+                if (_pos < 0)
+                    throw VMError::STACK_UNDERFLOW();
+                else if (_pos + WORD_SIZE > size)
+                    throw VMError::STACK_OVERFLOW();
+            }
+
+            if (sp >= WORD_SIZE)
+                *(Word*)&stack[sp - WORD_SIZE] = tos; //The position may overlap the top of the stack
+
+            return *(Word*)&stack[_pos];
+        }
+
+        //Writes any position of the stack like Thread::WriteStack
+        void Write(vm_i64 _pos, Word _value)
+        {
+            if constexpr (CHECKED)
+            {
+                if (_pos < 0)
+                    throw VMError::STACK_UNDERFLOW();
+                else if (_pos + WORD_SIZE > size)
+                    throw VMError::STACK_OVERFLOW();
+            }
+
+            if (sp >= WORD_SIZE)
+                *(Word*)&stack[sp - WORD_SIZE] = tos;
+
+            *(Word*)&stack[_pos] = _value;
+
+            if (sp >= WORD_SIZE)
+                tos = *(Word*)&stack[sp - WORD_SIZE]; //The position may overlap the top of the stack
+        }
+    };
+
+    template <OpCode OPCODE> struct Op {}; //Selects the cached handler of an op code
+
+    //Executes an instruction on a cached stack. Instructions without a cached handler spill the cache,
+    //run their regular handler and fill the cache again.
+    template <OpCode OPCODE, bool CHECKED>
+    const Decoded* ExecuteCached(Op<OPCODE>, const Decoded* _instr, Thread* _thread, StackCache<CHECKED>& _cache)
+    {
+        _cache.Spill(_thread);
+
+        try { _instr = Execute<OPCODE>(_instr, _thread); }
+        catch (...)
+        {
+            _cache.Fill(_thread);
+            throw;
+        }
+
+        _cache.Fill(_thread);
+        return _instr;
     }
 
-    void Execute(const RET* _instr, Thread* _thread)
+#define EXECUTE_CACHED(OPCODE) template <bool CHECKED> const Decoded* ExecuteCached(Op<OpCode::OPCODE>, const Decoded* _instr, [[maybe_unused]] Thread* _thread, [[maybe_unused]] StackCache<CHECKED>& _cache)
+
+    EXECUTE_CACHED(NOOP) { return _instr + 1; }
+
+    EXECUTE_CACHED(CONVERT)
     {
-        _thread->PopFrame();                                                   //Clear current frame and restore previous frame pointer
-        _thread->instrPtr = _thread->PopStack().as_ptr - _instr->GetSize(); //Jump to instruction after most recent call
+        _cache.Require(WORD_SIZE);
+        _cache.tos = _instr->converter(_cache.tos);
+        return _instr + 1;
     }
 
-    void Execute(const RETV* _instr, Thread* _thread)
+    EXECUTE_CACHED(PUSH) { _cache.Push(_instr->value); return _instr + 1; }
+    EXECUTE_CACHED(POP) { _cache.Pop(); return _instr + 1; }
+    EXECUTE_CACHED(SLOAD) { _cache.Push(_cache.Read(_cache.sp + _instr->offset)); return _instr + 1; }
+    EXECUTE_CACHED(LLOAD) { _cache.Push(_cache.Read(_thread->GetFP() + _instr->offset)); return _instr + 1; }
+    EXECUTE_CACHED(PLOAD) { _cache.Push(_cache.Read(_thread->GetFP() + _instr->offset)); return _instr + 1; }
+    EXECUTE_CACHED(LSTORE) { _cache.Write(_thread->GetFP() + _instr->offset, _cache.Pop()); return _instr + 1; }
+    EXECUTE_CACHED(PSTORE) { _cache.Write(_thread->GetFP() + _instr->offset, _cache.Pop()); return _instr + 1; }
+
+    EXECUTE_CACHED(SSTORE)
     {
-        Word retValue = _thread->PopStack();                                   //Pop off return value
-        _thread->PopFrame();                                                   //Clear current frame and restore previous frame pointer
-        _thread->instrPtr = _thread->PopStack().as_ptr - _instr->GetSize(); //Jump to instruction after most recent call
-        _thread->PushStack(retValue);                                          //Push return value
+        Word value = _cache.Pop();
+        _cache.Write(_cache.sp + _instr->offset, value);
+        return _instr + 1;
     }
 
-    void Execute(const PUSH* _instr, Thread* _thread) { _thread->PushStack(_instr->value); }
-    void Execute(const POP* _instr, Thread* _thread) { _thread->PopStack(); }
-    void Execute(const LLOAD* _instr, Thread* _thread) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetFP() + _instr->idx * WORD_SIZE)); }
-    void Execute(const LSTORE* _instr, Thread* _thread) { _thread->WriteStack(_thread->GetFP() + _instr->idx * WORD_SIZE, _thread->PopStack()); }
-    void Execute(const PLOAD* _instr, Thread* _thread) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetFP() - WORD_SIZE * 2 - (_instr->idx + 1) * WORD_SIZE)); }
-    void Execute(const PSTORE* _instr, Thread* _thread) { _thread->WriteStack(_thread->GetFP() - WORD_SIZE * 2 - (_instr->idx + 1) * WORD_SIZE, _thread->PopStack()); }
+    EXECUTE_CACHED(JUMP) { return Branch(_instr, _thread); }
+    EXECUTE_CACHED(JUMPNZ) { return _cache.Pop().AsBool() ? Branch(_instr, _thread) : _instr + 1; }
+    EXECUTE_CACHED(JUMPZ) { return _cache.Pop().AsBool() ? _instr + 1 : Branch(_instr, _thread); }
+
+    //The result replaces the right operand in place, so a binop only touches the stack to read that operand
+#define TYPED_BINOP_EXECUTE_CACHED(OPCODE, TYPE)                                                                 \
+    EXECUTE_CACHED(OPCODE##_##TYPE)                                                                              \
+    {                                                                                                            \
+        _cache.Require(WORD_SIZE * 2);                                                                           \
+                                                                                                                 \
+        Word right = *(Word*)&_cache.stack[_cache.sp - WORD_SIZE * 2];                                           \
+        _cache.tos = ApplyBinop<OpCode::OPCODE, DataType::TYPE>(_cache.tos, right);                              \
+        _cache.sp -= WORD_SIZE;                                                                                  \
+        return _instr + 1;                                                                                       \
+    }
 
-    void Execute(const SLOAD* _instr, Thread* _thread) { _thread->PushStack(_thread->ReadStack<Word>(_thread->GetSP() + _instr->offset)); }
+    FOR_EACH_TYPED_BINOP(TYPED_BINOP_EXECUTE_CACHED)
+#undef TYPED_BINOP_EXECUTE_CACHED
 
-    void Execute(const SSTORE* _instr, Thread* _thread)
+    template <bool CHECKED, OpCode FIRST, OpCode... REST>
+    const Decoded* ExecuteSequenceCached(const Decoded* _instr, Thread* _thread, StackCache<CHECKED>& _cache)
     {
-        auto value = _thread->PopStack();
-        _thread->WriteStack(_thread->GetSP() + _instr->offset, value);
+        if constexpr (sizeof...(REST) == 0)
+            return ExecuteCached(Op<FIRST>(), _instr, _thread, _cache);
+        else
+            return ExecuteSequenceCached<CHECKED, REST...>(ExecuteCached(Op<FIRST>(), _instr, _thread, _cache), _thread, _cache);
     }
 
-    void Execute(const MLOAD* _instr, Thread* _thread)
+#define SUPERINSTRUCTION_EXECUTE_CACHED(NAME, ...) EXECUTE_CACHED(NAME) { return ExecuteSequenceCached<CHECKED, __VA_ARGS__>(_instr, _thread, _cache); }
+    FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_EXECUTE_CACHED)
+#undef SUPERINSTRUCTION_EXECUTE_CACHED
+
+#undef EXECUTE_CACHED
+
+    template <bool CHECKED>
+    const Decoded* ExecuteCached(const Decoded* _instr, Thread* _thread, StackCache<CHECKED>& _cache)
     {
-        vm_byte* addr = _thread->PopStack().as_ptr + _instr->offset;
+        switch (_instr->opcode)
+        {
+        case OpCode::NOOP: return ExecuteCached(Op<OpCode::NOOP>(), _instr, _thread, _cache);
+        case OpCode::PUSH: return ExecuteCached(Op<OpCode::PUSH>(), _instr, _thread, _cache);
+        case OpCode::POP: return ExecuteCached(Op<OpCode::POP>(), _instr, _thread, _cache);
+        case OpCode::ADD: return ExecuteCached(Op<OpCode::ADD>(), _instr, _thread, _cache);
+        case OpCode::SUB: return ExecuteCached(Op<OpCode::SUB>(), _instr, _thread, _cache);
+        case OpCode::MUL: return ExecuteCached(Op<OpCode::MUL>(), _instr, _thread, _cache);
+        case OpCode::DIV: return ExecuteCached(Op<OpCode::DIV>(), _instr, _thread, _cache);
+        case OpCode::EQ: return ExecuteCached(Op<OpCode::EQ>(), _instr, _thread, _cache);
+        case OpCode::NEQ: return ExecuteCached(Op<OpCode::NEQ>(), _instr, _thread, _cache);
+        case OpCode::JUMP: return ExecuteCached(Op<OpCode::JUMP>(), _instr, _thread, _cache);
+        case OpCode::JUMPZ: return ExecuteCached(Op<OpCode::JUMPZ>(), _instr, _thread, _cache);
+        case OpCode::JUMPNZ: return ExecuteCached(Op<OpCode::JUMPNZ>(), _instr, _thread, _cache);
+        case OpCode::SYSCALL: return ExecuteCached(Op<OpCode::SYSCALL>(), _instr, _thread, _cache);
+        case OpCode::SLOAD: return ExecuteCached(Op<OpCode::SLOAD>(), _instr, _thread, _cache);
+        case OpCode::SSTORE: return ExecuteCached(Op<OpCode::SSTORE>(), _instr, _thread, _cache);
+        case OpCode::LLOAD: return ExecuteCached(Op<OpCode::LLOAD>(), _instr, _thread, _cache);
+        case OpCode::LSTORE: return ExecuteCached(Op<OpCode::LSTORE>(), _instr, _thread, _cache);
+        case OpCode::PLOAD: return ExecuteCached(Op<OpCode::PLOAD>(), _instr, _thread, _cache);
+        case OpCode::PSTORE: return ExecuteCached(Op<OpCode::PSTORE>(), _instr, _thread, _cache);
+        case OpCode::MLOAD: return ExecuteCached(Op<OpCode::MLOAD>(), _instr, _thread, _cache);
+        case OpCode::MSTORE: return ExecuteCached(Op<OpCode::MSTORE>(), _instr, _thread, _cache);
+        case OpCode::CONVERT: return ExecuteCached(Op<OpCode::CONVERT>(), _instr, _thread, _cache);
+        case OpCode::CALL: return ExecuteCached(Op<OpCode::CALL>(), _instr, _thread, _cache);
+        case OpCode::RET: return ExecuteCached(Op<OpCode::RET>(), _instr, _thread, _cache);
+        case OpCode::RETV: return ExecuteCached(Op<OpCode::RETV>(), _instr, _thread, _cache);
+        case OpCode::ATOMIC: return ExecuteCached(Op<OpCode::ATOMIC>(), _instr, _thread, _cache);
+        case OpCode::INVALID: return ExecuteCached(Op<OpCode::INVALID>(), _instr, _thread, _cache);
+#define TYPED_BINOP_CASE(OPCODE, TYPE) case OpCode::OPCODE##_##TYPE: return ExecuteCached(Op<OpCode::OPCODE##_##TYPE>(), _instr, _thread, _cache);
+        FOR_EACH_TYPED_BINOP(TYPED_BINOP_CASE)
+#undef TYPED_BINOP_CASE
+#define SUPERINSTRUCTION_CASE(NAME, ...) case OpCode::NAME: return ExecuteCached(Op<OpCode::NAME>(), _instr, _thread, _cache);
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_CASE)
+#undef SUPERINSTRUCTION_CASE
+        default: assert(false && "Case not handled");
+        }
 
-        if (!_thread->GetVM()->GetHeap().IsAddressRange(addr, addr + WORD_SIZE - 1))
-            throw VMError::INVALID_MEM_ACCESS(addr, addr + WORD_SIZE - 1);
+        return nullptr;
+    }
 
-        _thread->PushStack(*(Word*)addr);
+    //Runs the thread's instructions until it dies or the vm stops while caching the top of its stack. The
+    //cache is spilled back into the thread whenever something outside of the loop may look at the stack.
+    template <bool CHECKED>
+    void ExecuteCached(Thread* _thread)
+    {
+        const Decoded*& ip = _thread->instrPtr;
+        StackCache<CHECKED> cache;
+        cache.Fill(_thread);
+
+        try
+        {
+            while (_thread->IsRunning())
+            {
+#ifdef BUILD_DEBUG
+                if (PRINT_INSTR_BEFORE_EXECUTION)
+                    std::cout << ToString(ip) << "\t(Thread ID: " << _thread->GetID() << ")" << std::endl;
+#endif
+
+                ip = ExecuteCached(ip, _thread, cache);
+
+#ifdef BUILD_DEBUG
+                if (PRINT_STACK_AFTER_INSTR_EXECUTION)
+                {
+                    cache.Spill(_thread);
+                    _thread->PrintStack();
+                }
+#endif
+            }
+        }
+        catch (...)
+        {
+            cache.Spill(_thread);
+            throw;
+        }
+
+        cache.Spill(_thread);
     }
 
-    void Execute(const MSTORE* _instr, Thread* _thread)
+    void ExecuteCached(Thread* _thread) { ExecuteCached<true>(_thread); }
+    void ExecuteVerified(Thread* _thread) { ExecuteCached<false>(_thread); }
+
+    Decoded Decode(const vm_byte* _instr)
     {
-        vm_byte* addr = _thread->PopStack().as_ptr + _instr->offset;
-        Word value = _thread->PopStack();
+        Decoded decoded;
+        decoded.opcode = (OpCode)*_instr;
+        decoded.source = _instr;
 
-        if (!_thread->GetVM()->GetHeap().IsAddressRange(addr, addr + WORD_SIZE - 1))
-            throw VMError::INVALID_MEM_ACCESS(addr, addr + WORD_SIZE - 1);
+        switch (decoded.opcode)
+        {
+        case OpCode::NOOP: break;
+        case OpCode::POP: break;
+        case OpCode::RET: break;
+        case OpCode::RETV: break;
+        case OpCode::SYSCALL: decoded.code = SYSCALL::From(_instr)->code; break;
+        case OpCode::CONVERT: {
+            decoded.type = CONVERT::From(_instr)->from;
+            decoded.to = CONVERT::From(_instr)->to;
 
-        *(Word*)addr = value;
+            if (decoded.type > DataType::F64 || decoded.to > DataType::F64)
+            {
+                decoded.value = *_instr;
+                decoded.opcode = OpCode::INVALID;
+            }
+            else if (IsNoOpConversion(decoded.type, decoded.to))
+                decoded.opcode = OpCode::NOOP;
+            else
+                decoded.converter = CONVERTERS[(vm_byte)decoded.type * DATA_TYPE_COUNT + (vm_byte)decoded.to];
+        } break;
+        case OpCode::ADD: decoded.type = ADD::From(_instr)->type; break;
+        case OpCode::SUB: decoded.type = SUB::From(_instr)->type; break;
+        case OpCode::MUL: decoded.type = MUL::From(_instr)->type; break;
+        case OpCode::DIV: decoded.type = DIV::From(_instr)->type; break;
+        case OpCode::EQ: decoded.type = EQ::From(_instr)->type; break;
+        case OpCode::NEQ: decoded.type = NEQ::From(_instr)->type; break;
+        case OpCode::PUSH: decoded.value = PUSH::From(_instr)->value; break;
+        case OpCode::SLOAD: decoded.offset = SLOAD::From(_instr)->offset; break;
+        case OpCode::SSTORE: decoded.offset = SSTORE::From(_instr)->offset; break;
+        case OpCode::MLOAD: decoded.offset = MLOAD::From(_instr)->offset; break;
+        case OpCode::MSTORE: decoded.offset = MSTORE::From(_instr)->offset; break;
+        case OpCode::ATOMIC: {
+            decoded.atomic = ATOMIC::From(_instr)->code;
+            decoded.offset = ATOMIC::From(_instr)->offset;
+
+            if (decoded.atomic >= AtomicCode::_COUNT)
+            {
+                decoded.value = *_instr;
+                decoded.opcode = OpCode::INVALID;
+            }
+        } break;
+        case OpCode::LLOAD: decoded.offset = vm_i64(LLOAD::From(_instr)->idx * WORD_SIZE); break;
+        case OpCode::LSTORE: decoded.offset = vm_i64(LSTORE::From(_instr)->idx * WORD_SIZE); break;
+        case OpCode::PLOAD: decoded.offset = -vm_i64(WORD_SIZE * 2 + (PLOAD::From(_instr)->idx + 1ull) * WORD_SIZE); break;
+        case OpCode::PSTORE: decoded.offset = -vm_i64(WORD_SIZE * 2 + (PSTORE::From(_instr)->idx + 1ull) * WORD_SIZE); break;
+
+        //Branch targets are left as pointers into the code for Program::Decode to turn into indices
+        case OpCode::JUMP: decoded.value = JUMP::From(_instr)->target; break;
+        case OpCode::JUMPZ: decoded.value = JUMPZ::From(_instr)->target; break;
+        case OpCode::JUMPNZ: decoded.value = JUMPNZ::From(_instr)->target; break;
+        case OpCode::CALL: decoded.value = CALL::From(_instr)->target; decoded.storage = CALL::From(_instr)->storage; break;
+        default: {
+            decoded.opcode = OpCode::INVALID;
+            decoded.value = *_instr;
+        } break;
+        }
+
+        //Specialize typed binops so that their handlers never have to switch on the data type
+        switch (decoded.opcode)
+        {
+        case OpCode::ADD:
+        case OpCode::SUB:
+        case OpCode::MUL:
+        case OpCode::DIV:
+        case OpCode::EQ:
+        case OpCode::NEQ: {
+            if (decoded.type > DataType::F64)
+            {
+                decoded.value = *_instr;
+                decoded.opcode = OpCode::INVALID;
+            }
+            else
+                decoded.opcode = Specialize(decoded.opcode, decoded.type);
+        } break;
+        default: break;
+        }
+
+#ifdef EVM_THREADED_DISPATCH
+        decoded.handler = GetThreadedHandler(decoded.opcode);
+#endif
+        return decoded;
     }
 
-    void Execute(const vm_byte* _instr, Thread* _thread)
+    std::string ToString(OpCode _opcode)
     {
-        switch ((OpCode)*_instr)
+        switch (_opcode)
         {
-        case OpCode::NOOP: Execute(NOOP::From(_instr), _thread); break;
-        case OpCode::PUSH: Execute(PUSH::From(_instr), _thread); break;
-        case OpCode::POP: Execute(POP::From(_instr), _thread); break;
-        case OpCode::ADD: Execute(ADD::From(_instr), _thread); break;
-        case OpCode::SUB: Execute(SUB::From(_instr), _thread); break;
-        case OpCode::MUL: Execute(MUL::From(_instr), _thread); break;
-        case OpCode::DIV: Execute(DIV::From(_instr), _thread); break;
-        case OpCode::EQ: Execute(EQ::From(_instr), _thread); break;
-        case OpCode::NEQ: Execute(NEQ::From(_instr), _thread); break;
-        case OpCode::JUMP: Execute(JUMP::From(_instr), _thread); break;
-        case OpCode::JUMPZ: Execute(JUMPZ::From(_instr), _thread); break;
-        case OpCode::JUMPNZ: Execute(JUMPNZ::From(_instr), _thread); break;
-        case OpCode::SYSCALL: Execute(SYSCALL::From(_instr), _thread); break;
-        case OpCode::SLOAD: Execute(SLOAD::From(_instr), _thread); break;
-        case OpCode::SSTORE: Execute(SSTORE::From(_instr), _thread); break;
-        case OpCode::LLOAD: Execute(LLOAD::From(_instr), _thread); break;
-        case OpCode::LSTORE: Execute(LSTORE::From(_instr), _thread); break;
-        case OpCode::PLOAD: Execute(PLOAD::From(_instr), _thread); break;
-        case OpCode::PSTORE: Execute(PSTORE::From(_instr), _thread); break;
-        case OpCode::MLOAD: Execute(MLOAD::From(_instr), _thread); break;
-        case OpCode::MSTORE: Execute(MSTORE::From(_instr), _thread); break;
-        case OpCode::CONVERT: Execute(CONVERT::From(_instr), _thread); break;
-        case OpCode::CALL: Execute(CALL::From(_instr), _thread); break;
-        case OpCode::RET: Execute(RET::From(_instr), _thread); break;
-        case OpCode::RETV: Execute(RETV::From(_instr), _thread); break;
+        case OpCode::NOOP: return "NOOP";
+        case OpCode::SYSCALL: return "SYSCALL";
+        case OpCode::CONVERT: return "CONVERT";
+        case OpCode::PUSH: return "PUSH";
+        case OpCode::POP: return "POP";
+        case OpCode::SLOAD: return "SLOAD";
+        case OpCode::SSTORE: return "SSTORE";
+        case OpCode::LLOAD: return "LLOAD";
+        case OpCode::LSTORE: return "LSTORE";
+        case OpCode::PLOAD: return "PLOAD";
+        case OpCode::PSTORE: return "PSTORE";
+        case OpCode::MLOAD: return "MLOAD";
+        case OpCode::MSTORE: return "MSTORE";
+        case OpCode::ADD: return "ADD";
+        case OpCode::SUB: return "SUB";
+        case OpCode::MUL: return "MUL";
+        case OpCode::DIV: return "DIV";
+        case OpCode::EQ: return "EQ";
+        case OpCode::NEQ: return "NEQ";
+        case OpCode::JUMP: return "JUMP";
+        case OpCode::JUMPZ: return "JUMPZ";
+        case OpCode::JUMPNZ: return "JUMPNZ";
+        case OpCode::CALL: return "CALL";
+        case OpCode::RET: return "RET";
+        case OpCode::RETV: return "RETV";
+        case OpCode::ATOMIC: return "ATOMIC";
+        case OpCode::INVALID: return "INVALID";
+#define TYPED_BINOP_CASE(OPCODE, TYPE) case OpCode::OPCODE##_##TYPE: return #OPCODE "_" #TYPE;
+        FOR_EACH_TYPED_BINOP(TYPED_BINOP_CASE)
+#undef TYPED_BINOP_CASE
+#define SUPERINSTRUCTION_CASE(NAME, ...) case OpCode::NAME: return #NAME;
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_CASE)
+#undef SUPERINSTRUCTION_CASE
         default: assert(false && "Case not handled");
         }
+
+        return "";
     }
 
     std::string ToString(DataType _dt)
@@ -496,6 +1041,23 @@ namespace Instructions
         return "";
     }
 
+    std::string ToString(AtomicCode _code)
+    {
+        switch (_code)
+        {
+        case AtomicCode::LOAD: return "LOAD";
+        case AtomicCode::STORE: return "STORE";
+        case AtomicCode::CAS: return "CAS";
+        case AtomicCode::FETCH_ADD: return "FETCH_ADD";
+        case AtomicCode::FETCH_AND: return "FETCH_AND";
+        case AtomicCode::FETCH_OR: return "FETCH_OR";
+        case AtomicCode::EXCHANGE: return "EXCHANGE";
+        default: assert(false && "Case not handled");
+        }
+
+        return "";
+    }
+
     std::string ToString(const vm_byte* _instr)
     {
         switch ((OpCode)*_instr)
@@ -524,6 +1086,20 @@ namespace Instructions
             case SysCallCode::PRINTC: return "SYSCALL PRINTC";
             case SysCallCode::MALLOC: return "SYSCALL MALLOC";
             case SysCallCode::FREE: return "SYSCALL FREE";
+            case SysCallCode::SPAWN: return "SYSCALL SPAWN";
+            case SysCallCode::JOIN: return "SYSCALL JOIN";
+            case SysCallCode::YIELD: return "SYSCALL YIELD";
+            case SysCallCode::WAIT: return "SYSCALL WAIT";
+            case SysCallCode::NOTIFY: return "SYSCALL NOTIFY";
+            case SysCallCode::CHANNEL: return "SYSCALL CHANNEL";
+            case SysCallCode::SEND: return "SYSCALL SEND";
+            case SysCallCode::RECV: return "SYSCALL RECV";
+            case SysCallCode::TRY_RECV: return "SYSCALL TRY_RECV";
+            case SysCallCode::PARALLEL_FOR: return "SYSCALL PARALLEL_FOR";
+            case SysCallCode::ARENA: return "SYSCALL ARENA";
+            case SysCallCode::ARENA_ALLOC: return "SYSCALL ARENA_ALLOC";
+            case SysCallCode::ARENA_RESET: return "SYSCALL ARENA_RESET";
+            case SysCallCode::ARENA_DESTROY: return "SYSCALL ARENA_DESTROY";
             default: assert(false && "Case not handled");
             }
         } break;
@@ -535,40 +1111,373 @@ namespace Instructions
         case OpCode::PSTORE: return "PSTORE " + std::to_string(PSTORE::From(_instr)->idx);
         case OpCode::MLOAD: return "MLOAD " + std::to_string(MLOAD::From(_instr)->offset);
         case OpCode::MSTORE: return "MSTORE " + std::to_string(MSTORE::From(_instr)->offset);
+        case OpCode::ATOMIC: return "ATOMIC " + ToString(ATOMIC::From(_instr)->code) + " " + std::to_string(ATOMIC::From(_instr)->offset);
         default: assert(false && "Case not handled");
         }
 
         return "";
     }
 
-    void ToNASM(const vm_byte* _instr, std::ostream& _stream, const std::string& _indent)
+    std::string ToString(const Decoded* _instr)
     {
-        _stream << _indent << ToString(_instr) << "\n";
+        if (_instr->source && _instr->opcode != OpCode::INVALID)
+            return ToString(_instr->source);
+
+        switch (_instr->opcode)
+        {
+        case OpCode::JUMP: return "JUMP [" + std::to_string(_instr->target) + "]"; //Inserted by Program::Decode to join decoded code
+        case OpCode::INVALID: return "INVALID " + std::to_string(_instr->value.as_byte);
+        default: assert(false && "Case not handled");
+        }
+
+        return "";
+    }
+
+    namespace NASM
+    {
+        //The names of a register at each width
+        struct Register { const char* q, * d, * w, * b; };
+        constexpr Register RAX = { "rax", "eax", "ax", "al" }, RCX = { "rcx", "ecx", "cx", "cl" };
+
+        bool IsFloat(DataType _type) { return _type == DataType::F32 || _type == DataType::F64; }
+        bool IsSigned(DataType _type) { return !IsFloat(_type) && (vm_byte)_type % 2 == 0; }
+
+        //Returns the suffix of SSE instructions for a float type
+        std::string SSE(DataType _type) { return _type == DataType::F32 ? "ss" : "sd"; }
+
+        //Returns the name of the register at the width of an integer type
+        std::string Sized(DataType _type, Register _reg)
+        {
+            switch ((vm_byte)_type / 2)
+            {
+            case 0: return _reg.b;
+            case 1: return _reg.w;
+            case 2: return _reg.d;
+            default: return _reg.q;
+            }
+        }
+
+        //Returns the instruction that sign or zero extends an integer type in the low bytes of a register to all of it
+        std::string Extend(DataType _type, Register _reg)
+        {
+            switch (_type)
+            {
+            case DataType::I8: return std::string("movsx ") + _reg.q + ", " + _reg.b;
+            case DataType::UI8: return std::string("movzx ") + _reg.d + ", " + _reg.b;
+            case DataType::I16: return std::string("movsx ") + _reg.q + ", " + _reg.w;
+            case DataType::UI16: return std::string("movzx ") + _reg.d + ", " + _reg.w;
+            case DataType::I32: return std::string("movsxd ") + _reg.q + ", " + _reg.d;
+            case DataType::UI32: return std::string("mov ") + _reg.d + ", " + _reg.d;
+            default: return "";
+            }
+        }
+
+        std::string Address(const std::string& _base, vm_i64 _disp)
+        {
+            if (_disp < INT32_MIN || _disp > INT32_MAX)
+                throw std::runtime_error("Offset does not fit in a displacement: " + std::to_string(_disp));
+
+            return "qword [" + _base + (_disp < 0 ? " - " : " + ") + std::to_string(_disp < 0 ? -_disp : _disp) + "]";
+        }
+
+        //The label of the instruction at an offset in the code
+        std::string Label(vm_ui64 _offset) { return "L" + std::to_string(_offset); }
+    }
+
+    //Translates an instruction to x86-64 NASM for Linux. The VM's stack maps onto the machine stack in reverse: it grows
+    //down from rsp, and rbp points at the saved frame pointer so that locals are below it and parameters above the
+    //return address. Syscalls other than EXIT call into the runtime that Program::ToNASM bundles with the program.
+    void ToNASM(const vm_byte* _instr, const vm_byte* _start, std::ostream& _stream, const std::string& _indent)
+    {
+        using namespace NASM;
+
+        auto line = [&](const std::string& _line) { if (!_line.empty()) _stream << _indent << _line << "\n"; };
+        auto label = [&](const std::string& _label) { _stream << _label << ":\n"; };
+        vm_ui64 next = vm_ui64(_instr - _start) + GetSize((OpCode)*_instr);
 
         switch ((OpCode)*_instr)
         {
+        case OpCode::NOOP: break;
         case OpCode::PUSH:
-        {
-            _stream << _indent << "mov rax, " << Hex(PUSH::From(_instr)->value) << "\n";
-            _stream << _indent << "push rax";
-        } break;
-        case OpCode::NOOP: { _stream << _indent << "mov rax, rax"; } break;
+            line("mov rax, " + Hex(PUSH::From(_instr)->value));
+            line("push rax");
+            break;
+        case OpCode::POP: line("add rsp, 8"); break;
         case OpCode::SYSCALL:
         {
             switch (SYSCALL::From(_instr)->code)
             {
             case SysCallCode::EXIT:
+                line("pop rdi");
+                line("mov eax, 60");
+                line("syscall");
+                break;
+            case SysCallCode::PRINTC:
+                line("pop rdi");
+                line("call evm_printc");
+                break;
+            case SysCallCode::MALLOC:
+                line("pop rdi");
+                line("call evm_malloc");
+                line("push rax");
+                break;
+            case SysCallCode::FREE:
+                line("pop rdi");
+                line("call evm_free");
+                break;
+            default: throw Error::CompilationNotImplemented(_instr);
+            }
+        } break;
+        case OpCode::CONVERT:
+        {
+            DataType from = CONVERT::From(_instr)->from, to = CONVERT::From(_instr)->to;
+
+            if (IsFloat(from))
+            {
+                line("mov" + SSE(from) + " xmm0, [rsp]");
+
+                if (IsFloat(to))
+                {
+                    if (from != to)
+                        line("cvt" + SSE(from) + "2" + SSE(to) + " xmm0, xmm0");
+
+                    line("mov" + SSE(to) + " [rsp], xmm0");
+                }
+                else if (to == DataType::UI64)
+                {
+                    //Values of 2^63 and above do not fit in a signed conversion
+                    line(from == DataType::F32 ? "mov ecx, 0x5F000000" : "mov rcx, 0x43E0000000000000");
+                    line(from == DataType::F32 ? "movd xmm1, ecx" : "movq xmm1, rcx");
+                    line("ucomi" + SSE(from) + " xmm0, xmm1");
+                    line("jae .big");
+                    line("cvtt" + SSE(from) + "2si rax, xmm0");
+                    line("jmp .done");
+                    label(".big");
+                    line("sub" + SSE(from) + " xmm0, xmm1");
+                    line("cvtt" + SSE(from) + "2si rax, xmm0");
+                    line("btc rax, 63");
+                    label(".done");
+                    line("mov [rsp], rax");
+                }
+                else
+                {
+                    line("cvtt" + SSE(from) + "2si rax, xmm0");
+                    line("mov [rsp], rax");
+                }
+            }
+            else
+            {
+                line("mov rax, [rsp]");
+                line(Extend(from, RAX));
+
+                if (!IsFloat(to))
+                    line("mov [rsp], rax");
+                else if (from == DataType::UI64)
+                {
+                    //Values of 2^63 and above are halved, keeping the lowest bit for rounding, and doubled after converting
+                    line("test rax, rax");
+                    line("js .big");
+                    line("cvtsi2" + SSE(to) + " xmm0, rax");
+                    line("jmp .done");
+                    label(".big");
+                    line("mov rcx, rax");
+                    line("shr rcx, 1");
+                    line("and eax, 1");
+                    line("or rcx, rax");
+                    line("cvtsi2" + SSE(to) + " xmm0, rcx");
+                    line("add" + SSE(to) + " xmm0, xmm0");
+                    label(".done");
+                    line("mov" + SSE(to) + " [rsp], xmm0");
+                }
+                else
+                {
+                    line("cvtsi2" + SSE(to) + " xmm0, rax");
+                    line("mov" + SSE(to) + " [rsp], xmm0");
+                }
+            }
+        } break;
+        case OpCode::ADD:
+        case OpCode::SUB:
+        case OpCode::MUL:
+        case OpCode::DIV:
+        case OpCode::EQ:
+        case OpCode::NEQ:
+        {
+            OpCode binop = (OpCode)*_instr;
+            DataType type = ((const ADD*)_instr)->type; //Every binop is laid out the same
+
+            if (IsFloat(type))
+            {
+                line("mov" + SSE(type) + " xmm0, [rsp]");     //Left
+                line("mov" + SSE(type) + " xmm1, [rsp + 8]"); //Right
+                line("add rsp, 16");
+
+                switch (binop)
+                {
+                case OpCode::ADD: line("add" + SSE(type) + " xmm0, xmm1"); break;
+                case OpCode::SUB: line("sub" + SSE(type) + " xmm0, xmm1"); break;
+                case OpCode::MUL: line("mul" + SSE(type) + " xmm0, xmm1"); break;
+                case OpCode::DIV:
+                    line("xorps xmm2, xmm2");
+                    line("ucomi" + SSE(type) + " xmm1, xmm2");
+                    line("jp .divide"); //NaN is not zero
+                    line("je evm_div_by_zero");
+                    label(".divide");
+                    line("div" + SSE(type) + " xmm0, xmm1");
+                    break;
+                case OpCode::EQ:
+                case OpCode::NEQ:
+                    //Comparisons with NaN are unordered, which sets the parity flag
+                    line("ucomi" + SSE(type) + " xmm0, xmm1");
+                    line(binop == OpCode::EQ ? "sete al" : "setne al");
+                    line(binop == OpCode::EQ ? "setnp cl" : "setp cl");
+                    line(binop == OpCode::EQ ? "and al, cl" : "or al, cl");
+                    line("movzx eax, al");
+                    line("push rax");
+                    return;
+                default: break;
+                }
+
+                line("sub rsp, 8");
+                line("mov" + SSE(type) + " [rsp], xmm0");
+            }
+            else
+            {
+                line("pop rax"); //Left
+                line("pop rcx"); //Right
+
+                switch (binop)
+                {
+                case OpCode::ADD: line("add rax, rcx"); break;
+                case OpCode::SUB: line("sub rax, rcx"); break;
+                case OpCode::MUL: line("imul rax, rcx"); break;
+                case OpCode::DIV:
+                    line(Extend(type, RAX));
+                    line(Extend(type, RCX));
+                    line("test rcx, rcx");
+                    line("jz evm_div_by_zero");
+                    line(IsSigned(type) ? "cqo" : "xor edx, edx");
+                    line(IsSigned(type) ? "idiv rcx" : "div rcx");
+                    break;
+                case OpCode::EQ:
+                case OpCode::NEQ:
+                    line("cmp " + Sized(type, RAX) + ", " + Sized(type, RCX));
+                    line(binop == OpCode::EQ ? "sete al" : "setne al");
+                    line("movzx eax, al");
+                    break;
+                default: break;
+                }
+
+                line("push rax");
+            }
+        } break;
+        case OpCode::SLOAD: line("push " + Address("rsp", -SLOAD::From(_instr)->offset - (vm_i64)WORD_SIZE)); break;
+        case OpCode::SSTORE:
+            line("pop rax");
+            line("mov " + Address("rsp", -SSTORE::From(_instr)->offset - (vm_i64)WORD_SIZE) + ", rax");
+            break;
+        case OpCode::LLOAD: line("push " + Address("rbp", -(vm_i64)WORD_SIZE * (LLOAD::From(_instr)->idx + 1ll))); break;
+        case OpCode::LSTORE:
+            line("pop rax");
+            line("mov " + Address("rbp", -(vm_i64)WORD_SIZE * (LSTORE::From(_instr)->idx + 1ll)) + ", rax");
+            break;
+        case OpCode::PLOAD: line("push " + Address("rbp", 2 * WORD_SIZE + WORD_SIZE * PLOAD::From(_instr)->idx)); break;
+        case OpCode::PSTORE:
+            line("pop rax");
+            line("mov " + Address("rbp", 2 * WORD_SIZE + WORD_SIZE * PSTORE::From(_instr)->idx) + ", rax");
+            break;
+        case OpCode::MLOAD:
+            line("pop rax");
+            line("push " + Address("rax", MLOAD::From(_instr)->offset));
+            break;
+        case OpCode::MSTORE:
+            line("pop rax"); //Address
+            line("pop rcx"); //Value
+            line("mov " + Address("rax", MSTORE::From(_instr)->offset) + ", rcx");
+            break;
+        case OpCode::ATOMIC:
+        {
+            //Plain loads and stores already acquire and release on x86-64 and locked instructions do both
+            std::string word = Address("rax", ATOMIC::From(_instr)->offset);
+            line("pop rax"); //Address
+
+            switch (ATOMIC::From(_instr)->code)
+            {
+            case AtomicCode::LOAD: line("push " + word); break;
+            case AtomicCode::STORE:
+                line("pop rcx");
+                line("mov " + word + ", rcx");
+                break;
+            case AtomicCode::CAS:
+            {
+                std::string address = Address("rsp", 0);
+                line("mov rcx, rax");
+                line("pop rax");                                               //Expected value
+                line("mov rdx, " + address);                                   //Desired value
+                line("lock cmpxchg " + Address("rcx", ATOMIC::From(_instr)->offset) + ", rdx");
+                line("mov " + address + ", rax");                              //The word found
+            } break;
+            case AtomicCode::FETCH_ADD:
+                line("pop rcx");
+                line("lock xadd " + word + ", rcx");
+                line("push rcx");
+                break;
+            case AtomicCode::FETCH_AND:
+            case AtomicCode::FETCH_OR:
             {
-                _stream << _indent << "pop rdi\n";
-                _stream << _indent << "mov rax, 0x02000001\n";
-                _stream << _indent << "syscall";
+                std::string retry = Label(vm_ui64(_instr - _start)) + "_retry";
+                line("mov rsi, rax");
+                line("pop rcx");
+                line("mov rax, " + Address("rsi", ATOMIC::From(_instr)->offset));
+                label(retry);
+                line("mov rdx, rax");
+                line(std::string(ATOMIC::From(_instr)->code == AtomicCode::FETCH_AND ? "and" : "or") + " rdx, rcx");
+                line("lock cmpxchg " + Address("rsi", ATOMIC::From(_instr)->offset) + ", rdx");
+                line("jnz " + retry);
+                line("push rax");
             } break;
+            case AtomicCode::EXCHANGE:
+                line("pop rcx");
+                line("xchg " + word + ", rcx");
+                line("push rcx");
+                break;
             default: throw Error::CompilationNotImplemented(_instr);
             }
         } break;
-        case OpCode::POP: { _stream << _indent << "pop rax"; } break;
-        default:
-        throw Error::CompilationNotImplemented(_instr);
+        case OpCode::JUMP: line("jmp " + Label(JUMP::From(_instr)->target - _start)); break;
+        case OpCode::JUMPZ:
+            line("pop rax");
+            line("test rax, rax");
+            line("jz " + Label(JUMPZ::From(_instr)->target - _start));
+            break;
+        case OpCode::JUMPNZ:
+            line("pop rax");
+            line("test rax, rax");
+            line("jnz " + Label(JUMPNZ::From(_instr)->target - _start));
+            break;
+        case OpCode::CALL:
+            line("lea rax, [rel " + Label(next) + "]");
+            line("push rax");
+            line("push rbp");
+            line("mov rbp, rsp");
+            if (CALL::From(_instr)->storage != 0)
+                line("sub rsp, " + std::to_string(CALL::From(_instr)->storage));
+            line("jmp " + Label(CALL::From(_instr)->target - _start));
+            break;
+        case OpCode::RET:
+            line("mov rsp, rbp");
+            line("pop rbp");
+            line("ret");
+            break;
+        case OpCode::RETV:
+            line("pop rax");
+            line("mov rsp, rbp");
+            line("pop rbp");
+            line("pop rcx");
+            line("push rax");
+            line("jmp rcx");
+            break;
+        default: throw Error::CompilationNotImplemented(_instr);
         }
     }
 }
\ No newline at end of file
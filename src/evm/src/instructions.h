@@ -1,8 +1,31 @@
 #pragma once
 #include "evm.h"
+#include <span>
+#include <atomic>
 
 class Thread;
 
+//Calls MACRO(ARG, TYPE) for every data type in the order they are declared in DataType
+#define FOR_EACH_DATA_TYPE(MACRO, ARG) \
+    MACRO(ARG, I8) MACRO(ARG, UI8) MACRO(ARG, I16) MACRO(ARG, UI16) MACRO(ARG, I32) MACRO(ARG, UI32) MACRO(ARG, I64) MACRO(ARG, UI64) MACRO(ARG, F32) MACRO(ARG, F64)
+
+//Calls MACRO(OPCODE, TYPE) for every binop that takes a data type operand and every data type
+#define FOR_EACH_TYPED_BINOP(MACRO) \
+    FOR_EACH_DATA_TYPE(MACRO, ADD) FOR_EACH_DATA_TYPE(MACRO, SUB) FOR_EACH_DATA_TYPE(MACRO, MUL) \
+    FOR_EACH_DATA_TYPE(MACRO, DIV) FOR_EACH_DATA_TYPE(MACRO, EQ) FOR_EACH_DATA_TYPE(MACRO, NEQ)
+
+//Calls MACRO(NAME, OPCODES...) for every superinstruction, a sequence of decoded instructions that executes with
+//a single dispatch. They are the sequences of the factorial loop that the PROFILER test counts and FACTORIAL_DISPATCH
+//runs, along with the same loops over signed counters and over locals.
+#define FOR_EACH_SUPERINSTRUCTION(MACRO) \
+    MACRO(SLOAD_PUSH_EQ_UI64_JUMPNZ, OpCode::SLOAD, OpCode::PUSH, OpCode::EQ_UI64, OpCode::JUMPNZ) \
+    MACRO(SLOAD_PUSH_EQ_I64_JUMPNZ, OpCode::SLOAD, OpCode::PUSH, OpCode::EQ_I64, OpCode::JUMPNZ) \
+    MACRO(LLOAD_LLOAD_ADD_I64, OpCode::LLOAD, OpCode::LLOAD, OpCode::ADD_I64) \
+    MACRO(PUSH_SLOAD_SUB_UI64, OpCode::PUSH, OpCode::SLOAD, OpCode::SUB_UI64) \
+    MACRO(SLOAD_MUL_UI64, OpCode::SLOAD, OpCode::MUL_UI64) \
+    MACRO(SSTORE_JUMP, OpCode::SSTORE, OpCode::JUMP) \
+    MACRO(LSTORE_JUMP, OpCode::LSTORE, OpCode::JUMP)
+
 namespace Instructions
 {
     enum class OpCode : vm_byte
@@ -39,7 +62,25 @@ namespace Instructions
         RET,
         RETV,
 
-        _COUNT
+        //Atomic accesses of heap words
+        ATOMIC,
+
+        _COUNT,
+
+        //Op codes below are never found in bytecode; they are only produced by Program::Decode
+        INVALID = _COUNT, //An undecodable op code or the end of the code; executing it throws UNKNOWN_OP_CODE
+
+        //Binops specialized for the data type of their operands (ADD_I8, ..., NEQ_F64)
+#define TYPED_BINOP_OPCODE(OPCODE, TYPE) OPCODE##_##TYPE,
+        FOR_EACH_TYPED_BINOP(TYPED_BINOP_OPCODE)
+#undef TYPED_BINOP_OPCODE
+
+        //Superinstructions produced by Program::Fuse (SLOAD_PUSH_EQ_UI64_JUMPNZ, ...)
+#define SUPERINSTRUCTION_OPCODE(NAME, ...) NAME,
+        FOR_EACH_SUPERINSTRUCTION(SUPERINSTRUCTION_OPCODE)
+#undef SUPERINSTRUCTION_OPCODE
+
+        _DECODED_COUNT
     };
 
     enum class SysCallCode : vm_byte
@@ -48,6 +89,34 @@ namespace Instructions
         PRINTC,
         MALLOC,
         FREE,
+        SPAWN, // Pops the arg count N, a code address and N args and pushes the id of a thread that calls the address with the args
+        JOIN,  // Replaces the id of a thread on the top of the stack with its exit value once it finishes
+        YIELD, // Lets the other threads on the worker run
+        WAIT,   // Pops a timeout in nanoseconds, an expected value and the address of a heap word, blocks until the word is notified if it holds the expected value and pushes how the wait ended as a WaitResult. Negative timeouts never pass.
+        NOTIFY, // Pops a count and the address of a heap word, wakes up to that many threads waiting on it and pushes how many it woke
+        CHANNEL,  // Pops a capacity and pushes the id of a new channel that holds up to that many words
+        SEND,     // Pops a channel id and a value and sends the value, blocking while the channel is full
+        RECV,     // Replaces a channel id with the value received from it, blocking while the channel is empty
+        TRY_RECV, // Replaces a channel id with the value received from it, or 0 if it is empty, and pushes whether it received one
+        PARALLEL_FOR, // Pops a grain, an end, a begin and a code address, calls the address with the begin and the end of every chunk of [begin, end) that is grain long on the vm's workers and returns once every call returned. A grain of zero lets the vm choose.
+        ARENA,         // Pops a capacity and pushes the id of a new arena whose first region holds at least that many bytes
+        ARENA_ALLOC,   // Pops a size and an arena id and pushes the address of that many bytes bumped off the arena
+        ARENA_RESET,   // Pops an arena id and frees every allocation of the arena at once
+        ARENA_DESTROY, // Pops an arena id and gives the memory of the arena back to the heap
+        _COUNT
+    };
+
+    //Atomic accesses of the heap word at a popped address plus the offset operand. Loads acquire, stores release
+    //and the others do both.
+    enum class AtomicCode : vm_byte
+    {
+        LOAD,      // Pushes the word
+        STORE,     // Pops a value and stores it
+        CAS,       // Pops the expected value and the desired one, stores the desired one if the word is the expected one and pushes the word it found
+        FETCH_ADD, // Pops a value, adds it to the word and pushes the old word
+        FETCH_AND, // Pops a value, bitwise ands it into the word and pushes the old word
+        FETCH_OR,  // Pops a value, bitwise ors it into the word and pushes the old word
+        EXCHANGE,  // Pops a value, stores it and pushes the old word
         _COUNT
     };
 
@@ -60,8 +129,43 @@ namespace Instructions
         F32, F64
     };
 
+    constexpr vm_byte DATA_TYPE_COUNT = (vm_byte)DataType::F64 + 1;
+
+    //The host type of each data type
+    template <DataType TYPE> struct HostType;
+    template <> struct HostType<DataType::I8> { typedef vm_i8 type; };
+    template <> struct HostType<DataType::UI8> { typedef vm_ui8 type; };
+    template <> struct HostType<DataType::I16> { typedef vm_i16 type; };
+    template <> struct HostType<DataType::UI16> { typedef vm_ui16 type; };
+    template <> struct HostType<DataType::I32> { typedef vm_i32 type; };
+    template <> struct HostType<DataType::UI32> { typedef vm_ui32 type; };
+    template <> struct HostType<DataType::I64> { typedef vm_i64 type; };
+    template <> struct HostType<DataType::UI64> { typedef vm_ui64 type; };
+    template <> struct HostType<DataType::F32> { typedef vm_f32 type; };
+    template <> struct HostType<DataType::F64> { typedef vm_f64 type; };
+
+    //Returns the op code of _binop specialized for _type
+    constexpr OpCode Specialize(OpCode _binop, DataType _type)
+    {
+        switch (_binop)
+        {
+        case OpCode::ADD: return OpCode((vm_byte)OpCode::ADD_I8 + (vm_byte)_type);
+        case OpCode::SUB: return OpCode((vm_byte)OpCode::SUB_I8 + (vm_byte)_type);
+        case OpCode::MUL: return OpCode((vm_byte)OpCode::MUL_I8 + (vm_byte)_type);
+        case OpCode::DIV: return OpCode((vm_byte)OpCode::DIV_I8 + (vm_byte)_type);
+        case OpCode::EQ: return OpCode((vm_byte)OpCode::EQ_I8 + (vm_byte)_type);
+        case OpCode::NEQ: return OpCode((vm_byte)OpCode::NEQ_I8 + (vm_byte)_type);
+        default: assert(false && "Case not handled");
+        }
+
+        return _binop;
+    }
+
+    static_assert(Specialize(OpCode::NEQ, DataType::F64) == OpCode((vm_byte)OpCode::ADD_I8 + 6 * DATA_TYPE_COUNT - 1), "Specialized binops are not laid out by data type!");
+
 #define OP_CODE_SIZE sizeof(Instructions::OpCode)
 #define SYSCALL_CODE_SIZE sizeof(Instructions::SysCallCode)
+#define ATOMIC_CODE_SIZE sizeof(Instructions::AtomicCode)
 #define DATA_TYPE_SIZE sizeof(Instructions::DataType)
 
 #pragma pack(push, 1)
@@ -112,12 +216,66 @@ namespace Instructions
     INSTRUCTION(CALL, OPERAND(vm_byte*, target) OPERAND(vm_ui32, storage));
     INSTRUCTION(RET, );
     INSTRUCTION(RETV, );
+    INSTRUCTION(ATOMIC, OPERAND(AtomicCode, code) OPERAND(vm_i64, offset));
 
 #undef OPERAND
 #undef INSTRUCTION
 #pragma pack(pop)
 
-    void Execute(const vm_byte* _instr, Thread* _thread);
+    typedef Word (*Converter)(Word _value); //Converts a value from one data type to another
+
+    //The aligned form of an instruction that the interpreter executes. Operands are widened and
+    //pre-scaled so that handlers never have to touch the packed bytecode.
+    struct alignas(WORD_SIZE) Decoded
+    {
+        const void* handler = nullptr; //Address of the handler for this instruction in ExecuteThreaded
+
+        union
+        {
+            Word value{};    //PUSH: the value to push; INVALID: the op code that could not be decoded
+            vm_i64 offset;   //SLOAD, SSTORE, MLOAD, MSTORE, ATOMIC: the operand; LLOAD, LSTORE, PLOAD, PSTORE: the byte offset from the frame pointer
+            vm_ui64 target;  //JUMP, JUMPZ, JUMPNZ, CALL: the index of the target in the decoded instructions
+            Converter converter; //CONVERT: the kernel for the pair of data types
+        };
+
+        const vm_byte* source = nullptr; //The instruction in the program's code that this was decoded from
+        vm_ui32 storage = 0;             //CALL: the amount of storage for locals
+        OpCode opcode = OpCode::NOOP;
+        DataType type = DataType::I8;    //ADD, SUB, MUL, DIV, EQ, NEQ: the operand type; CONVERT: the type converted from
+        DataType to = DataType::I8;      //CONVERT: the type converted to
+
+        union
+        {
+            SysCallCode code = SysCallCode::EXIT;
+            AtomicCode atomic; //ATOMIC: the access
+        };
+    };
+
+    static_assert(sizeof(Decoded) == 4 * WORD_SIZE, "Decoded instructions should fit in half of a cache line!");
+
+    template <bool CHECKED> struct StackCache;
+
+    Decoded Decode(const vm_byte* _instr);
+
+    //Reads the op code of an instruction that Tiering may fuse while other threads are running it. The rest of
+    //the instruction never changes after it is decoded, so the op code is all that has to be read atomically.
+    inline OpCode LoadOpCode(const Decoded* _instr) { return std::atomic_ref(const_cast<OpCode&>(_instr->opcode)).load(std::memory_order_relaxed); }
+
+    const Decoded* Execute(const Decoded* _instr, Thread* _thread);
+    void ExecuteCached(Thread* _thread);
+    void ExecuteVerified(Thread* _thread); //Only for programs that passed Program::Verify
+
+    //Returns the op codes that execute when _opcode does. Only superinstructions execute more than one.
+    std::span<const OpCode> GetSequence(OpCode _opcode);
+
+    //Returns the longest superinstruction whose sequence starts at _instrs, or the op code of _instrs if there
+    //is none. _count is the number of instructions that follow _instrs, including itself.
+    OpCode Fuse(const Decoded* _instrs, vm_ui64 _count);
+
+#ifdef EVM_THREADED_DISPATCH
+    void ExecuteThreaded(Thread* _thread);
+    const void* GetThreadedHandler(OpCode _opcode);
+#endif
 
     constexpr vm_ui64 GetSize(OpCode _opCode)
     {
@@ -148,13 +306,17 @@ namespace Instructions
         case OpCode::PLOAD: return PLOAD::GetSize();
         case OpCode::PSTORE: return PSTORE::GetSize();
         case OpCode::CONVERT: return CONVERT::GetSize();
+        case OpCode::ATOMIC: return ATOMIC::GetSize();
         default: assert(false && "Case not handled");
         }
 
         return 0;
     }
 
+    std::string ToString(OpCode _opcode);
     std::string ToString(DataType _dt);
+    std::string ToString(AtomicCode _code);
     std::string ToString(const vm_byte* _instr);
-    void ToNASM(const vm_byte* _instr, std::ostream& _stream, const std::string& _indent);
+    std::string ToString(const Decoded* _instr);
+    void ToNASM(const vm_byte* _instr, const vm_byte* _start, std::ostream& _stream, const std::string& _indent); //_start is the start of the program's code
 }
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include "jit.h"
+
+#ifdef EVM_JIT
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <sys/mman.h>
+#include "thread.h"
+#include "vm.h"
+
+using namespace Instructions;
+
+namespace
+{
+    enum Reg : vm_byte { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+    enum Cond : vm_byte { B = 0x2, AE = 0x3, E = 0x4, NE = 0x5, BE = 0x6, A = 0x7, LE = 0xE, G = 0xF };
+
+    //The registers compiled code keeps its state in. They are callee saved so calls back into the vm preserve them.
+    constexpr Reg CTX = RBX, STACK = R12, SP = R13, STACK_END = R14, RUNNING = R15, FP = RBP;
+
+    typedef size_t Label;
+    constexpr Label NO_LABEL = SIZE_MAX;
+
+    //Emits x86-64 machine code. Jumps go to labels which are patched once all of them are bound.
+    class Assembler
+    {
+    private:
+        std::vector<vm_byte> bytes;
+        std::vector<size_t> labels;
+        std::vector<std::pair<size_t, Label>> fixups; //The position of every rel32 and the label it jumps to
+
+        void Rex(bool _wide, vm_byte _reg, vm_byte _rm)
+        {
+            vm_byte rex = 0x40 | (_wide ? 0x8 : 0) | (_reg & 8 ? 0x4 : 0) | (_rm & 8 ? 0x1 : 0);
+            if (rex != 0x40)
+                Byte(rex);
+        }
+
+        //Encodes [_base + _disp] as the memory operand
+        void Memory(vm_byte _reg, Reg _base, vm_i32 _disp)
+        {
+            Byte(0x80 | (_reg & 7) << 3 | (_base & 7));
+            if ((_base & 7) == RSP)
+                Byte(0x24);
+            Imm32(_disp);
+        }
+
+        void Direct(vm_byte _reg, vm_byte _rm) { Byte(0xC0 | (_reg & 7) << 3 | (_rm & 7)); }
+
+        void Fixup(Label _label)
+        {
+            fixups.emplace_back(bytes.size(), _label);
+            Imm32(0);
+        }
+
+    public:
+        void Byte(vm_byte _byte) { bytes.push_back(_byte); }
+        void Imm32(vm_i32 _imm) { bytes.insert(bytes.end(), (vm_byte*)&_imm, (vm_byte*)&_imm + sizeof(_imm)); }
+        void Imm64(vm_ui64 _imm) { bytes.insert(bytes.end(), (vm_byte*)&_imm, (vm_byte*)&_imm + sizeof(_imm)); }
+
+        void Push(Reg _reg) { Rex(false, 0, _reg); Byte(0x50 | (_reg & 7)); }
+        void Pop(Reg _reg) { Rex(false, 0, _reg); Byte(0x58 | (_reg & 7)); }
+        void Ret() { Byte(0xC3); }
+
+        void Mov(Reg _dst, Reg _src) { Rex(true, _src, _dst); Byte(0x89); Direct(_src, _dst); }
+        void Mov(Reg _dst, vm_ui64 _imm) { Rex(true, 0, _dst); Byte(0xB8 | (_dst & 7)); Imm64(_imm); }
+        void Load(Reg _dst, Reg _base, vm_i32 _disp) { Rex(true, _dst, _base); Byte(0x8B); Memory(_dst, _base, _disp); }
+        void Store(Reg _base, vm_i32 _disp, Reg _src) { Rex(true, _src, _base); Byte(0x89); Memory(_src, _base, _disp); }
+        void Lea(Reg _dst, Reg _base, vm_i32 _disp) { Rex(true, _dst, _base); Byte(0x8D); Memory(_dst, _base, _disp); }
+
+        void Add(Reg _dst, Reg _src) { Rex(true, _src, _dst); Byte(0x01); Direct(_src, _dst); }
+        void Sub(Reg _dst, Reg _src) { Rex(true, _src, _dst); Byte(0x29); Direct(_src, _dst); }
+        void Imul(Reg _dst, Reg _src) { Rex(true, _dst, _src); Byte(0x0F); Byte(0xAF); Direct(_dst, _src); }
+        void Add(Reg _dst, vm_i32 _imm) { Rex(true, 0, _dst); Byte(0x81); Direct(0, _dst); Imm32(_imm); }
+        void Sub(Reg _dst, vm_i32 _imm) { Rex(true, 0, _dst); Byte(0x81); Direct(5, _dst); Imm32(_imm); }
+        void Test(Reg _a, Reg _b) { Rex(true, _b, _a); Byte(0x85); Direct(_b, _a); }
+
+        //Compares the low _width bytes of _a with those of _b
+        void Cmp(Reg _a, Reg _b, vm_ui64 _width = WORD_SIZE)
+        {
+            if (_width == 2)
+                Byte(0x66);
+
+            Rex(_width == WORD_SIZE, _b, _a);
+            Byte(_width == 1 ? 0x38 : 0x39);
+            Direct(_b, _a);
+        }
+
+        void CmpByte(Reg _base, vm_byte _imm) { Rex(false, 0, _base); Byte(0x80); Memory(7, _base, 0); Byte(_imm); }
+
+        //Sets rax to 1 if the condition holds and to 0 otherwise
+        void Set(Cond _cond)
+        {
+            Byte(0x0F); Byte(0x90 | _cond); Direct(0, RAX);
+            Byte(0x0F); Byte(0xB6); Direct(RAX, RAX);
+        }
+
+        void MovToXMM(vm_byte _xmm, Reg _src) { Byte(0x66); Rex(true, _xmm, _src); Byte(0x0F); Byte(0x6E); Direct(_xmm, _src); }
+        void MovFromXMM(Reg _dst, vm_byte _xmm) { Byte(0x66); Rex(true, _xmm, _dst); Byte(0x0F); Byte(0x7E); Direct(_xmm, _dst); }
+        void SSE(vm_byte _prefix, vm_byte _op, vm_byte _dst, vm_byte _src) { Byte(_prefix); Byte(0x0F); Byte(_op); Direct(_dst, _src); }
+
+        void CallReg(Reg _reg) { Rex(false, 0, _reg); Byte(0xFF); Direct(2, _reg); }
+        void JmpReg(Reg _reg) { Rex(false, 0, _reg); Byte(0xFF); Direct(4, _reg); }
+        void Jmp(Label _label) { Byte(0xE9); Fixup(_label); }
+        void Jcc(Cond _cond, Label _label) { Byte(0x0F); Byte(0x80 | _cond); Fixup(_label); }
+
+        Label NewLabel() { labels.push_back(NO_LABEL); return labels.size() - 1; }
+        void Bind(Label _label) { labels[_label] = bytes.size(); }
+        size_t GetPosition(Label _label) const { return labels[_label]; }
+
+        //Patches every jump with the offset to its label and returns the code
+        std::vector<vm_byte> Finish()
+        {
+            for (auto [pos, label] : fixups)
+            {
+                assert(labels[label] != NO_LABEL && "Jump to an unbound label!");
+                vm_i32 rel = vm_i32(labels[label] - (pos + sizeof(vm_i32)));
+                std::memcpy(&bytes[pos], &rel, sizeof(rel));
+            }
+
+            return std::move(bytes);
+        }
+    };
+
+    constexpr bool FitsDisp(vm_i64 _disp) { return _disp >= INT32_MIN + 16 && _disp <= INT32_MAX - 16; }
+
+    //Translates decoded instructions into machine code. The code starts with the entry function
+    //void(JITContext*, const void* native) which jumps to the native code of an instruction.
+    class Compiler
+    {
+    private:
+        Assembler as;
+        const std::vector<Decoded>& decoded;
+        const std::vector<bool>& compiled;
+        vm_ui64 callBack;
+        Label exit;
+        std::vector<Label> entries, slowPaths, stops;
+
+        //Instructions whose checks fail or that have no native code run in the interpreter through their slow path
+        Label SlowPath(size_t _idx)
+        {
+            if (slowPaths[_idx] == NO_LABEL)
+                slowPaths[_idx] = as.NewLabel();
+
+            return slowPaths[_idx];
+        }
+
+        //Leaves compiled code so that the interpreter resumes at the instruction
+        Label Stop(size_t _idx)
+        {
+            if (stops[_idx] == NO_LABEL)
+                stops[_idx] = as.NewLabel();
+
+            return stops[_idx];
+        }
+
+        void ReloadPointers()
+        {
+            as.Load(SP, CTX, offsetof(JITContext, sp));
+            as.Add(SP, STACK);
+            as.Load(FP, CTX, offsetof(JITContext, fp));
+            as.Add(FP, STACK);
+        }
+
+        void RequirePush(size_t _idx)
+        {
+            as.Lea(RAX, SP, WORD_SIZE);
+            as.Cmp(RAX, STACK_END);
+            as.Jcc(A, SlowPath(_idx));
+        }
+
+        void RequirePop(size_t _idx, vm_i32 _count)
+        {
+            as.Lea(RAX, SP, -_count * (vm_i32)WORD_SIZE);
+            as.Cmp(RAX, STACK);
+            as.Jcc(B, SlowPath(_idx));
+        }
+
+        //Requires the word at the address in _addr to be in the stack
+        void RequireInStack(size_t _idx, Reg _addr)
+        {
+            as.Cmp(_addr, STACK);
+            as.Jcc(B, SlowPath(_idx));
+            as.Lea(RDX, _addr, WORD_SIZE);
+            as.Cmp(RDX, STACK_END);
+            as.Jcc(A, SlowPath(_idx));
+        }
+
+        void CompileLoad(size_t _idx, Reg _base, vm_i64 _offset)
+        {
+            if (!FitsDisp(_offset))
+            {
+                as.Jmp(SlowPath(_idx));
+                return;
+            }
+
+            as.Lea(RCX, _base, (vm_i32)_offset);
+            RequireInStack(_idx, RCX);
+            RequirePush(_idx);
+            as.Load(RAX, RCX, 0);
+            as.Store(SP, 0, RAX);
+            as.Add(SP, (vm_i32)WORD_SIZE);
+        }
+
+        //Pops the top of the stack into [_base + _offset], where _offset is relative to the base before the pop
+        void CompileStore(size_t _idx, Reg _base, vm_i64 _offset)
+        {
+            if (!FitsDisp(_offset))
+            {
+                as.Jmp(SlowPath(_idx));
+                return;
+            }
+
+            RequirePop(_idx, 1);
+            as.Lea(RCX, _base, (vm_i32)_offset);
+            RequireInStack(_idx, RCX);
+            as.Load(RAX, SP, -(vm_i32)WORD_SIZE);
+            as.Store(RCX, 0, RAX);
+            as.Sub(SP, (vm_i32)WORD_SIZE);
+        }
+
+        void CompileJump(size_t _idx, vm_ui64 _target)
+        {
+            //Loops have to notice when the vm quits and leave compiled code once their quantum runs out
+            if (_target <= _idx)
+            {
+                as.CmpByte(RUNNING, 0);
+                as.Jcc(E, Stop(_target));
+                as.Load(RAX, CTX, offsetof(JITContext, fuel));
+                as.Sub(RAX, (vm_i32)std::min<size_t>(_idx - _target + 1, INT32_MAX));
+                as.Store(CTX, offsetof(JITContext, fuel), RAX);
+                as.Jcc(LE, Stop(_target));
+            }
+
+            as.Jmp(entries[_target]);
+        }
+
+        void CompileBranch(size_t _idx, Cond _cond, vm_ui64 _target)
+        {
+            if (_target <= _idx)
+            {
+                Label fallthrough = as.NewLabel();
+                as.Jcc(Cond(_cond ^ 1), fallthrough);
+                CompileJump(_idx, _target);
+                as.Bind(fallthrough);
+            }
+            else
+                as.Jcc(_cond, entries[_target]);
+        }
+
+        //Division throws on zero and comparing floats has to handle NaNs, so those stay in the interpreter
+        static bool IsNativeBinop(OpCode _binop, DataType _type)
+        {
+            bool isFloat = _type == DataType::F32 || _type == DataType::F64;
+            return _binop == OpCode::ADD || _binop == OpCode::SUB || _binop == OpCode::MUL || (!isFloat && (_binop == OpCode::EQ || _binop == OpCode::NEQ));
+        }
+
+        void CompileBinop(size_t _idx, OpCode _binop, DataType _type)
+        {
+            RequirePop(_idx, 2);
+            as.Load(RAX, SP, -(vm_i32)WORD_SIZE);     //Left
+            as.Load(RCX, SP, -2 * (vm_i32)WORD_SIZE); //Right
+
+            if (_type == DataType::F32 || _type == DataType::F64)
+            {
+                vm_byte prefix = _type == DataType::F32 ? 0xF3 : 0xF2;
+                vm_byte op = _binop == OpCode::ADD ? 0x58 : _binop == OpCode::SUB ? 0x5C : 0x59;
+
+                as.MovToXMM(0, RAX);
+                as.MovToXMM(1, RCX);
+                as.SSE(prefix, op, 0, 1);
+                as.MovFromXMM(RAX, 0);
+            }
+            else
+            {
+                //Only the low bytes of a result are defined, so adding, subtracting and multiplying can use all 64 bits
+                switch (_binop)
+                {
+                case OpCode::ADD: as.Add(RAX, RCX); break;
+                case OpCode::SUB: as.Sub(RAX, RCX); break;
+                case OpCode::MUL: as.Imul(RAX, RCX); break;
+                case OpCode::EQ: as.Cmp(RAX, RCX, 1ull << ((vm_byte)_type / 2)); as.Set(E); break;
+                case OpCode::NEQ: as.Cmp(RAX, RCX, 1ull << ((vm_byte)_type / 2)); as.Set(NE); break;
+                default: assert(false && "Case not handled");
+                }
+            }
+
+            as.Store(SP, -2 * (vm_i32)WORD_SIZE, RAX);
+            as.Sub(SP, (vm_i32)WORD_SIZE);
+        }
+
+        void CompileInstruction(size_t _idx)
+        {
+            const Decoded& instr = decoded[_idx];
+            OpCode opcode = GetSequence(instr.opcode)[0]; //The rest of a superinstruction compiles from its own decoded instructions
+
+            switch (opcode)
+            {
+            case OpCode::NOOP: break;
+            case OpCode::PUSH:
+                RequirePush(_idx);
+                as.Mov(RAX, instr.value.as_ui64);
+                as.Store(SP, 0, RAX);
+                as.Add(SP, (vm_i32)WORD_SIZE);
+                break;
+            case OpCode::POP:
+                RequirePop(_idx, 1);
+                as.Sub(SP, (vm_i32)WORD_SIZE);
+                break;
+            case OpCode::SLOAD: CompileLoad(_idx, SP, instr.offset); break;
+            case OpCode::LLOAD: CompileLoad(_idx, FP, instr.offset); break;
+            case OpCode::PLOAD: CompileLoad(_idx, FP, instr.offset); break;
+            case OpCode::SSTORE: CompileStore(_idx, SP, instr.offset - (vm_i64)WORD_SIZE); break;
+            case OpCode::LSTORE: CompileStore(_idx, FP, instr.offset); break;
+            case OpCode::PSTORE: CompileStore(_idx, FP, instr.offset); break;
+            case OpCode::CONVERT:
+                RequirePop(_idx, 1);
+                as.Load(RDI, SP, -(vm_i32)WORD_SIZE);
+                as.Mov(RAX, (vm_ui64)instr.converter);
+                as.CallReg(RAX);
+                as.Store(SP, -(vm_i32)WORD_SIZE, RAX);
+                break;
+            case OpCode::JUMP:
+                if (instr.target < decoded.size()) { CompileJump(_idx, instr.target); }
+                else { as.Jmp(SlowPath(_idx)); }
+                break;
+            case OpCode::JUMPZ:
+            case OpCode::JUMPNZ:
+                if (instr.target >= decoded.size())
+                {
+                    as.Jmp(SlowPath(_idx));
+                    break;
+                }
+
+                RequirePop(_idx, 1);
+                as.Load(RAX, SP, -(vm_i32)WORD_SIZE);
+                as.Sub(SP, (vm_i32)WORD_SIZE);
+                as.Test(RAX, RAX);
+                CompileBranch(_idx, opcode == OpCode::JUMPNZ ? NE : E, instr.target);
+                break;
+            default:
+                if (opcode >= OpCode::ADD_I8 && opcode <= OpCode::NEQ_F64)
+                {
+                    vm_byte binop = (vm_byte)opcode - (vm_byte)OpCode::ADD_I8;
+                    OpCode base = OpCode((vm_byte)OpCode::ADD + binop / DATA_TYPE_COUNT);
+                    DataType type = DataType(binop % DATA_TYPE_COUNT);
+
+                    if (IsNativeBinop(base, type))
+                    {
+                        CompileBinop(_idx, base, type);
+                        break;
+                    }
+                }
+
+                as.Jmp(SlowPath(_idx)); //Syscalls, heap accesses, calls, returns and everything else run in the interpreter
+                break;
+            }
+        }
+
+        //Writes back the stack pointer and calls back into the vm to execute the instruction. The vm returns
+        //the native code to continue with or null to leave compiled code.
+        void CompileSlowPath(size_t _idx)
+        {
+            as.Bind(slowPaths[_idx]);
+            as.Sub(SP, STACK);
+            as.Store(CTX, offsetof(JITContext, sp), SP);
+            as.Mov(RDI, CTX);
+            as.Mov(RSI, (vm_ui64)&decoded[_idx]);
+            as.Mov(RAX, callBack);
+            as.CallReg(RAX);
+            ReloadPointers();
+            as.Test(RAX, RAX);
+            as.Jcc(E, exit);
+            as.JmpReg(RAX);
+        }
+
+        void CompileStop(size_t _idx)
+        {
+            as.Bind(stops[_idx]);
+            as.Mov(RAX, (vm_ui64)&decoded[_idx]);
+            as.Store(CTX, offsetof(JITContext, resume), RAX);
+            as.Jmp(exit);
+        }
+
+    public:
+        Compiler(const std::vector<Decoded>& _decoded, const std::vector<bool>& _compiled, vm_ui64 _callBack)
+            : decoded(_decoded), compiled(_compiled), callBack(_callBack), exit(as.NewLabel()),
+            entries(_decoded.size()), slowPaths(_decoded.size(), NO_LABEL), stops(_decoded.size(), NO_LABEL)
+        {
+            for (auto& entry : entries)
+                entry = as.NewLabel();
+        }
+
+        //Returns the machine code and sets the position of every compiled instruction's native code in it
+        std::vector<vm_byte> Compile(std::vector<size_t>& _positions)
+        {
+            //Entry: save the callee saved registers, keeping the stack aligned for calls, and load the context
+            for (Reg reg : { RBX, RBP, R12, R13, R14, R15 })
+                as.Push(reg);
+
+            as.Sub(RSP, 8);
+            as.Mov(CTX, RDI);
+            as.Load(STACK, CTX, offsetof(JITContext, stack));
+            as.Load(STACK_END, CTX, offsetof(JITContext, stackEnd));
+            as.Load(RUNNING, CTX, offsetof(JITContext, running));
+            ReloadPointers();
+            as.JmpReg(RSI);
+
+            //Exit: write back the context and restore the registers
+            as.Bind(exit);
+            as.Sub(SP, STACK);
+            as.Store(CTX, offsetof(JITContext, sp), SP);
+            as.Sub(FP, STACK);
+            as.Store(CTX, offsetof(JITContext, fp), FP);
+            as.Add(RSP, 8);
+
+            for (Reg reg : { R15, R14, R13, R12, RBP, RBX })
+                as.Pop(reg);
+
+            as.Ret();
+
+            //Decoding ends every run of instructions with INVALID or a jump, so compiled code never falls off the end
+            for (size_t i = 0; i < decoded.size(); i++)
+            {
+                as.Bind(entries[i]);
+
+                //Branching to an instruction that is not compiled leaves compiled code
+                if (compiled.empty() || compiled[i])
+                    CompileInstruction(i);
+                else
+                    as.Jmp(Stop(i));
+            }
+
+            //Slow paths and stops are rarely taken so they are kept out of the way of the compiled instructions
+            for (size_t i = 0; i < decoded.size(); i++)
+            {
+                if (slowPaths[i] != NO_LABEL)
+                    CompileSlowPath(i);
+
+                if (stops[i] != NO_LABEL)
+                    CompileStop(i);
+            }
+
+            _positions.clear();
+            for (size_t i = 0; i < decoded.size(); i++)
+                _positions.push_back(compiled.empty() || compiled[i] ? as.GetPosition(entries[i]) : NO_LABEL);
+
+            return as.Finish();
+        }
+    };
+}
+
+JIT::JIT(const std::vector<Decoded>& _decoded, const std::vector<bool>& _compiled)
+    : code(nullptr), codeSize(0), decoded(_decoded.data()), natives(), entries(0)
+{
+    static_assert(std::is_standard_layout_v<JITContext>, "Compiled code accesses the context by offset!");
+    static_assert(sizeof(std::atomic<bool>) == 1 && std::atomic<bool>::is_always_lock_free, "Compiled code polls the running flag as a byte!");
+
+    std::vector<size_t> positions;
+    auto machineCode = Compiler(_decoded, _compiled, (vm_ui64)&JIT::CallBack).Compile(positions);
+
+    //Code is written while the memory is writable and only made executable afterwards
+    codeSize = machineCode.size();
+    void* memory = mmap(nullptr, codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("Could not map memory for compiled code!");
+
+    code = (vm_byte*)memory;
+    std::memcpy(code, machineCode.data(), codeSize);
+
+    if (mprotect(code, codeSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, codeSize);
+        throw std::runtime_error("Could not make compiled code executable!");
+    }
+
+    for (auto pos : positions)
+        natives.push_back(pos == NO_LABEL ? nullptr : code + pos);
+}
+
+JIT::~JIT()
+{
+    munmap(code, codeSize);
+}
+
+const void* JIT::GetNative(const Decoded* _instr) const
+{
+    auto idx = (vm_ui64)((uintptr_t)_instr - (uintptr_t)decoded) / sizeof(Decoded);
+    if ((uintptr_t)_instr < (uintptr_t)decoded || idx >= natives.size() || decoded + idx != _instr)
+        return nullptr;
+
+    return natives[idx];
+}
+
+//Takes no lock since it runs on the thread that entered the compiled code, just like the interpreter loop does.
+//The instruction synchronizes itself when it touches state that threads share, as it would in the interpreter.
+const void* JIT::CallBack(JITContext* _ctx, const Decoded* _instr)
+{
+    Thread* thread = _ctx->thread;
+    thread->stackPtr = _ctx->sp;
+    thread->fuel = _ctx->fuel;
+
+    try
+    {
+        _ctx->resume = Instructions::Execute(_instr, thread);
+    }
+    catch (...)
+    {
+        //Exceptions cannot unwind through compiled code so they are rethrown once it returns
+        *_ctx->error = std::current_exception();
+        _ctx->resume = _instr;
+    }
+
+    _ctx->sp = thread->stackPtr;
+    _ctx->fp = thread->framePtr;
+    _ctx->fuel = thread->fuel;
+
+    if (*_ctx->error || !thread->IsRunning())
+        return nullptr;
+
+    return _ctx->jit->GetNative(_ctx->resume);
+}
+
+void JIT::Run(Thread* _thread)
+{
+    const void* native = GetNative(_thread->instrPtr);
+    if (!native)
+        return;
+
+    entries.fetch_add(1, std::memory_order_relaxed);
+
+    std::exception_ptr error;
+    JITContext ctx = {
+        _thread->stack.data(), _thread->stack.data() + _thread->stack.size(),
+        _thread->stackPtr, _thread->framePtr, _thread->fuel,
+        &_thread->GetVM()->running, _thread->instrPtr,
+        _thread, this, &error };
+
+    ((void (*)(JITContext*, const void*))code)(&ctx, native);
+
+    _thread->stackPtr = ctx.sp;
+    _thread->framePtr = ctx.fp;
+    _thread->instrPtr = ctx.resume;
+    _thread->fuel = ctx.fuel;
+
+    if (error)
+        std::rethrow_exception(error);
+
+    //Compiled code only burns fuel, so refueling happens once it returns
+    if (_thread->fuel <= 0)
+        _thread->Refuel();
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#pragma once
+#include "evm.h"
+#include <vector>
+#include <exception>
+#include <atomic>
+#include "instructions.h"
+
+class Thread;
+class JIT;
+
+#ifdef EVM_JIT
+//The state that compiled code shares with the vm. Compiled code keeps the stack pointer and the frame pointer in
+//registers and only writes them back here when it calls back into the vm or returns.
+struct JITContext
+{
+    vm_byte* stack;                      //The first byte of the thread's stack
+    vm_byte* stackEnd;                   //One past the last byte of the thread's stack
+    vm_ui64 sp, fp;                      //The stack pointer and the frame pointer as offsets into the stack
+    vm_i64 fuel;                         //The thread's fuel, which backward branches burn
+    const std::atomic<bool>* running;    //Polled at backward branches so that loops stop once the vm quits
+    const Instructions::Decoded* resume; //The instruction to continue with once compiled code returns
+    Thread* thread;
+    const JIT* jit;
+    std::exception_ptr* error;           //Set when an instruction that compiled code called back for throws
+};
+
+//A baseline compiler from decoded instructions to x86-64 machine code. Each basic block is translated one
+//instruction at a time into executable memory, with every instruction keeping its own entry point so that
+//calls can return into the middle of a block. Stack operations, arithmetic and branches run natively while
+//syscalls, heap accesses, calls and returns call back into the interpreter.
+class JIT
+{
+private:
+    vm_byte* code;
+    vm_ui64 codeSize;
+    const Instructions::Decoded* decoded;
+    std::vector<const void*> natives; //The native code of every decoded instruction
+    std::atomic<vm_ui64> entries;     //How many times threads entered native code
+
+    static const void* CallBack(JITContext* _ctx, const Instructions::Decoded* _instr);
+
+public:
+    //Compiles the instructions that are set in _compiled, or all of them if it is empty
+    JIT(const std::vector<Instructions::Decoded>& _decoded, const std::vector<bool>& _compiled = {});
+    ~JIT();
+
+    JIT(const JIT&) = delete;
+    JIT& operator=(const JIT&) = delete;
+
+    //Runs the thread in native code until it dies, the vm stops, an instruction throws, its fuel runs out or it reaches
+    //an instruction that was not compiled
+    void Run(Thread* _thread);
+
+    //Returns the native code of a decoded instruction or null if it was not compiled
+    const void* GetNative(const Instructions::Decoded* _instr) const;
+    vm_ui64 GetCodeSize() const { return codeSize; }
+    vm_ui64 GetEntryCount() const { return entries; }
+};
+#endif
\ No newline at end of file
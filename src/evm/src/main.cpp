@@ -1,11 +1,13 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <optional>
 #include <unistd.h>
 #include "evm.h"
 #include "program.h"
 #include "instructions.h"
 #include "vm.h"
+#include "profiler.h"
 #include "../build.h"
 
 #ifdef BUILD_DEBUG
@@ -19,6 +21,10 @@ bool PRINT_HEAP_AFTER_PROGRAM_END = false;
 #include "tests.h"
 #endif
 
+#ifdef BUILD_WITH_BENCHMARKS
+#include "benchmarks.h"
+#endif
+
 #define CLI_FAILURE() assert(false && "CLI Failure!")
 
 int usage(const std::string& _cmd = "", const std::string& _err = "")
@@ -39,6 +45,7 @@ int usage(const std::string& _cmd = "", const std::string& _err = "")
             "\n"
             "Commands:\n"
             "   test       Run test suite.\n"
+            "   bench      Run benchmark suite.\n"
             "   run        Executes an ede program.\n"
             << std::endl;
     }
@@ -46,19 +53,38 @@ int usage(const std::string& _cmd = "", const std::string& _err = "")
     {
         std::cout << "Usage: evm run FILEPATH [ARGS]...\n\n"
             "Options:\n"
-            "  --debugger RID WID      Enables interaction with a debugger through the read (RID) and write (WID) file ids created by the calling debugger."
+            "  --debugger RID WID      Enables interaction with a debugger through the read (RID) and write (WID) file ids created by the calling debugger.\n"
+            "  --dispatch MODE         Sets how the interpreter dispatches instructions. MODE is either switch, threaded, cached, verified, jit or tiered.\n"
+            "  --jit                   Compiles the program to native code before running it. The same as --dispatch jit.\n"
+            "  --profile N             Prints the most frequent sequences of up to N instructions that executed back to back once the program exits.\n"
+            "  --workers N             Runs the program's threads on N worker threads. Defaults to one for every hardware thread.\n"
+            "  --quantum N             Makes threads yield their worker after burning N fuel. Backward branches burn the length of their loop and calls burn one. Zero never preempts threads.\n"
+            "  --fuel N                Stops the program with an error once its threads burnt N fuel together.\n"
+            "  --gc N                  Collects the heap once the program allocated N bytes and again whenever it allocated as much as the last collection kept alive, but at least N. Prints the pauses and heap sizes once the program exits.\n"
             "\n"
             "Args:\n"
             "  FILEPATH                The edeasm file to execute.\n"
             "  ARGS                    List of arguments to pass to the program.\n"
             << std::endl;
     }
+    else if (_cmd == "test")
+    {
+        std::cout << "Usage: evm test [NAMES]...\n\n"
+            "Options:\n"
+            "  --dispatch MODE         Runs the tests with MODE as the default dispatch mode of every vm. MODE is the same as for run.\n"
+            "  --jit                   The same as --dispatch jit.\n"
+            "\n"
+            "Args:\n"
+            "  NAMES                   The names of the tests to run. Runs every test if none are given.\n"
+            << std::endl;
+    }
     else if (_cmd == "compile")
     {
         std::cout << "Usage: evm compile FILEPATH\n\n"
+            "Compiles the program to a static Linux x86-64 ELF executable using nasm and ld.\n\n"
             "Options:\n"
-            "  -o, --output PATH       Sets the destination of the output executable to PATH."
-            "  --otasm PATH            Sets the destination of the target assembly's output to PATH."
+            "  -o, --output PATH       Sets the destination of the output executable to PATH.\n"
+            "  --otasm PATH            Sets the destination of the target assembly's output to PATH.\n"
             "\n"
             "Args:\n"
             "  FILEPATH                The edeasm file to compile.\n"
@@ -70,15 +96,49 @@ int usage(const std::string& _cmd = "", const std::string& _err = "")
     return 0;
 }
 
+std::optional<DispatchMode> ParseDispatchMode(const std::string& _mode)
+{
+    if (_mode == "switch") { return DispatchMode::SWITCH; }
+    else if (_mode == "cached") { return DispatchMode::CACHED; }
+    else if (_mode == "verified") { return DispatchMode::VERIFIED; }
+    else if (_mode == "jit") { return DispatchMode::JIT; }
+    else if (_mode == "tiered") { return DispatchMode::TIERED; }
+#ifdef EVM_THREADED_DISPATCH
+    else if (_mode == "threaded") { return DispatchMode::THREADED; }
+#endif
+    else { return std::nullopt; }
+}
+
 int test(const std::vector<std::string>& _args)
 {
 #ifdef BUILD_WITH_TESTS
-    if (_args.size() == 0)
+    auto itArg = _args.begin();
+
+    while (itArg != _args.end())
+    {
+        auto arg = *itArg;
+        if (arg[0] != '-')
+            break;
+
+        //Add new options here
+        if (arg == "--dispatch")
+        {
+            if (++itArg == _args.end()) { return usage("test", "Expected MODE for option " + arg); }
+            else if (auto mode = ParseDispatchMode(*itArg)) { VM::SetDefaultDispatchMode(*mode); }
+            else { return usage("test", "Unknown dispatch mode: " + *itArg); }
+        }
+        else if (arg == "--jit") { VM::SetDefaultDispatchMode(DispatchMode::JIT); }
+        else { return usage("test", "Unknown Option: " + arg); }
+
+        itArg++;
+    }
+
+    if (itArg == _args.end())
         RUN_TEST_SUITE();
     else
     {
-        for (auto& name : _args)
-            RUN_TEST(name);
+        for (; itArg != _args.end(); itArg++)
+            RUN_TEST(*itArg);
     }
 #else
     std::cout << "Tests were not included in build!" << std::endl;
@@ -87,12 +147,32 @@ int test(const std::vector<std::string>& _args)
     return 0;
 }
 
+int bench(const std::vector<std::string>& _args)
+{
+#ifdef BUILD_WITH_BENCHMARKS
+    if (_args.size() == 0)
+        RUN_BENCHMARK_SUITE();
+    else
+    {
+        for (auto& name : _args)
+            RUN_BENCHMARK(name);
+    }
+#else
+    std::cout << "Benchmarks were not included in build!" << std::endl;
+#endif
+
+    return 0;
+}
+
 int run(const std::vector<std::string>& _args)
 {
     if (_args.empty())
         return usage("run");
 
     DebuggerInfo dbInfo;
+    VM vm;
+    std::optional<Profiler> profiler;
+    bool collect = false;
 
     auto itArg = _args.begin();
 
@@ -115,6 +195,54 @@ int run(const std::vector<std::string>& _args)
             if (++itArg != _args.end()) { dbInfo.wID = *itArg; }
             else { return usage("run", "Expected WID for option " + arg); }
         }
+        else if (arg == "--dispatch")
+        {
+            if (++itArg == _args.end()) { return usage("run", "Expected MODE for option " + arg); }
+            else if (auto mode = ParseDispatchMode(*itArg)) { vm.SetDispatchMode(*mode); }
+            else { return usage("run", "Unknown dispatch mode: " + *itArg); }
+        }
+        else if (arg == "--jit") { vm.SetDispatchMode(DispatchMode::JIT); }
+        else if (arg == "--profile")
+        {
+            //Get N
+            if (++itArg == _args.end()) { return usage("run", "Expected N for option " + arg); }
+
+            try { profiler.emplace(std::stoull(*itArg)); }
+            catch (const std::logic_error&) { return usage("run", "Expected N to be a number for option " + arg); }
+
+            vm.SetProfiler(&profiler.value());
+        }
+        else if (arg == "--workers")
+        {
+            //Get N
+            if (++itArg == _args.end()) { return usage("run", "Expected N for option " + arg); }
+
+            try { vm.SetWorkerCount(std::stoull(*itArg)); }
+            catch (const std::logic_error&) { return usage("run", "Expected N to be a number for option " + arg); }
+        }
+        else if (arg == "--gc")
+        {
+            //Get N
+            if (++itArg == _args.end()) { return usage("run", "Expected N for option " + arg); }
+
+            try { vm.SetCollectionThreshold(std::stoull(*itArg)); }
+            catch (const std::logic_error&) { return usage("run", "Expected N to be a number for option " + arg); }
+
+            collect = true;
+        }
+        else if (arg == "--quantum" || arg == "--fuel")
+        {
+            //Get N
+            if (++itArg == _args.end()) { return usage("run", "Expected N for option " + arg); }
+
+            try
+            {
+                vm_ui64 n = std::stoull(*itArg);
+                if (arg == "--quantum") { vm.SetQuantum(n); }
+                else { vm.SetFuelBudget(n); }
+            }
+            catch (const std::logic_error&) { return usage("run", "Expected N to be a number for option " + arg); }
+        }
         else { return usage("run", "Unknown Option: " + arg); }
 
         itArg++;
@@ -156,7 +284,13 @@ int run(const std::vector<std::string>& _args)
         //be in the place where the paramters are
 
         Program program = Program::FromFile(filePath);                  //Parse the ede asm file
-        auto exitCode = VM().Run(1024, program, std::move(cmdLineArgs)); //Run
+        auto exitCode = vm.Run(1024, program, std::move(cmdLineArgs));  //Run
+
+        if (profiler)
+            profiler->Print(std::cout, 10);
+
+        if (collect)
+            vm.GetCollector().Print(std::cout);
 
         std::cout << "\nExited with code " << exitCode << "." << std::endl;
         return exitCode;
@@ -244,13 +378,13 @@ int compile(const std::vector<std::string>& _args)
 
         //Compile target assembly
         std::string objFilePath = tempFileName + ".o";
-        std::string cmd = "nasm -fmacho64 " + tempFileName + " -o " + objFilePath;
+        std::string cmd = "nasm -felf64 " + tempFileName + " -o " + objFilePath;
         
-        if (std::system(cmd.c_str()) != 0) { throw std::runtime_error("Could not compile to target assembly using cmd: "); }
+        if (std::system(cmd.c_str()) != 0) { throw std::runtime_error("Could not compile to target assembly using cmd: " + cmd); }
         else { filesToDelete.push_back(objFilePath); }
 
         //Link object file
-        cmd = "ld -e start -static -o " + outputPath + " " + objFilePath;
+        cmd = "ld -static -o " + outputPath + " " + objFilePath;
         if (std::system(cmd.c_str()) != 0)
             throw std::runtime_error("Could not link generated object file using cmd: " + cmd);
 
@@ -277,6 +411,7 @@ int main(int _argc, char* _argv[])
     typedef int (*CommandFunc)(const std::vector<std::string>&);
     static std::map<std::string, CommandFunc> commands = {
         {"test", &test},
+        {"bench", &bench},
         {"run", &run},
         {"compile", &compile},
     };
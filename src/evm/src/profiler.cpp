@@ -0,0 +1,75 @@
+#include "profiler.h"
+#include <algorithm>
+
+using Instructions::OpCode;
+
+Profiler::Profiler(vm_ui64 _maxLength)
+    : maxLength(std::max(_maxLength, vm_ui64(2))), windows(), counts() { }
+
+//Counts every sequence that ends with the instruction. An instruction that is not the one after the
+//previous instruction of the thread (a taken branch, call or return) starts new sequences.
+void Profiler::Record(ThreadID _thread, const Instructions::Decoded* _instr)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    Window& window = windows[_thread];
+    auto sequence = Instructions::GetSequence(_instr->opcode); //Superinstructions are counted as the op codes they execute
+
+    if (_instr != window.next)
+        window.opcodes.clear();
+
+    for (OpCode opcode : sequence)
+    {
+        window.opcodes.push_back(opcode);
+        if (window.opcodes.size() > maxLength)
+            window.opcodes.pop_front();
+
+        for (size_t length = 2; length <= window.opcodes.size(); length++)
+            counts[Sequence(window.opcodes.end() - length, window.opcodes.end())]++;
+    }
+
+    window.next = _instr + sequence.size();
+}
+
+vm_ui64 Profiler::GetCount(const Sequence& _sequence)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    auto search = counts.find(_sequence);
+    return search == counts.end() ? 0 : search->second;
+}
+
+std::vector<std::pair<Profiler::Sequence, vm_ui64>> Profiler::GetMostFrequent(vm_ui64 _length, size_t _top)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+    std::vector<std::pair<Sequence, vm_ui64>> result;
+
+    for (auto& [sequence, count] : counts)
+    {
+        if (sequence.size() == _length)
+            result.emplace_back(sequence, count);
+    }
+
+    std::stable_sort(result.begin(), result.end(), [](const auto& _a, const auto& _b) { return _a.second > _b.second; });
+
+    if (result.size() > _top)
+        result.resize(_top);
+
+    return result;
+}
+
+void Profiler::Print(std::ostream& _stream, size_t _top)
+{
+    for (vm_ui64 length = 2; length <= maxLength; length++)
+    {
+        _stream << "Most frequent sequences of " << length << " instructions:" << std::endl;
+
+        for (auto& [sequence, count] : GetMostFrequent(length, _top))
+        {
+            _stream << "\t" << count << "\t";
+
+            for (size_t i = 0; i < sequence.size(); i++)
+                _stream << (i == 0 ? "" : " ") << Instructions::ToString(sequence[i]);
+
+            _stream << std::endl;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+#include "evm.h"
+#include <map>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include "vm.h"
+#include "instructions.h"
+
+//Counts how often each sequence of decoded op codes executes back to back. The most frequent sequences
+//are the candidates for superinstructions (see FOR_EACH_SUPERINSTRUCTION).
+class Profiler
+{
+public:
+    typedef std::vector<Instructions::OpCode> Sequence;
+
+private:
+    struct Window
+    {
+        const Instructions::Decoded* next = nullptr; //The instruction that continues the sequence
+        std::deque<Instructions::OpCode> opcodes;    //The most recent op codes that executed back to back
+    };
+
+    vm_ui64 maxLength;
+    std::unordered_map<ThreadID, Window> windows;
+    std::map<Sequence, vm_ui64> counts;
+    std::mutex mutex;
+
+public:
+    Profiler(vm_ui64 _maxLength);
+
+    void Record(ThreadID _thread, const Instructions::Decoded* _instr);
+    void Print(std::ostream& _stream, size_t _top);
+
+    vm_ui64 GetCount(const Sequence& _sequence);
+    std::vector<std::pair<Sequence, vm_ui64>> GetMostFrequent(vm_ui64 _length, size_t _top);
+};
\ No newline at end of file
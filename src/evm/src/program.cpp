@@ -5,12 +5,15 @@
 #include <fstream>
 #include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
+#include <optional>
 #include "instructions.h"
+#include "vm.h"
 #include "../build.h"
 #include "deps/lpc.h"
 
 using namespace lpc;
-using Instructions::OpCode, Instructions::SysCallCode, Instructions::DataType;
+using Instructions::OpCode, Instructions::SysCallCode, Instructions::AtomicCode, Instructions::DataType;
 
 namespace Error
 {
@@ -259,7 +262,7 @@ lpc::LPC<ProgramParseValue> CreateLPC()
     return LPC(lexer, Parser("PROGRAM", CODE), { "WS" });
 }
 
-Program::Program() : header(), code() { }
+Program::Program() : header(), code(), decoded(), indices(), entryIdx(0) { }
 Program::Program(Program&& _p) noexcept { this->operator=(std::move(_p)); }
 
 void Program::Resolve()
@@ -320,7 +323,356 @@ void Program::Validate()
     }
 }
 
-const vm_byte* Program::GetEntryPtr() { return &code[header.entryPoint]; }
+//Decodes the code into an array of aligned instructions for the interpreter. Decoding starts at the
+//beginning of the code, the entry point and every branch target. A branch target that lands in the middle
+//of an already decoded instruction is decoded as a separate run of instructions that ends with a jump back
+//into the run it overlaps, so programs execute exactly as their bytecode reads.
+void Program::Decode()
+{
+    vm_byte* start = code.data();
+    vm_ui64 end = code.size();
+
+    std::vector<std::pair<vm_ui64, vm_ui64>> branches;    //The index of each branch instruction and the offset of its target
+    std::vector<vm_ui64> runs = { header.entryPoint, 0 }; //Offsets that decoding has to start from
+
+    //Pushed values may be code addresses that are only used at run time, like the functions that SPAWN starts,
+    //so every pushed value that is the offset of an instruction in the code is decoded from as well
+    std::unordered_set<vm_ui64> offsets;
+    std::vector<vm_ui64> pushed;
+
+    for (vm_ui64 offset = 0; offset < end && start[offset] < (vm_byte)OpCode::_COUNT; offset += GetSize((OpCode)start[offset]))
+    {
+        if (end - offset < GetSize((OpCode)start[offset]))
+            break;
+
+        offsets.insert(offset);
+        if ((OpCode)start[offset] == OpCode::PUSH)
+            pushed.push_back(Instructions::PUSH::From(start + offset)->value.as_ui64);
+    }
+
+    for (auto value : pushed)
+    {
+        if (offsets.count(value))
+            runs.push_back(value);
+    }
+
+    //Creates an instruction that does not come from the code
+    auto createPseudo = [](OpCode _opcode)
+    {
+        Instructions::Decoded instr;
+        instr.opcode = _opcode;
+#ifdef EVM_THREADED_DISPATCH
+        instr.handler = Instructions::GetThreadedHandler(_opcode);
+#endif
+        return instr;
+    };
+
+    decoded.clear();
+    indices.clear();
+
+    while (!runs.empty())
+    {
+        vm_ui64 offset = std::min(runs.back(), end);
+        bool decodedAny = false;
+
+        runs.pop_back();
+
+        while (true)
+        {
+            //Join the run that has already been decoded at this offset
+            if (auto search = indices.find(offset); search != indices.end())
+            {
+                if (decodedAny)
+                {
+                    auto link = createPseudo(OpCode::JUMP);
+                    link.target = search->second;
+                    decoded.push_back(link);
+                }
+
+                break;
+            }
+
+            indices[offset] = decoded.size();
+            decodedAny = true;
+
+            //Running off the end of the code is the same as executing an unknown op code
+            if (offset == end)
+            {
+                auto invalid = createPseudo(OpCode::INVALID);
+                invalid.value = (vm_byte)OpCode::INVALID;
+                decoded.push_back(invalid);
+                break;
+            }
+
+            //Make sure the whole instruction is in the program
+            OpCode opcode = (OpCode)start[offset];
+            vm_ui64 size = opcode < OpCode::_COUNT ? GetSize(opcode) : OP_CODE_SIZE;
+            if (end - offset < size)
+                throw Error::INVALID_PROGRAM();
+
+            auto instr = Instructions::Decode(start + offset);
+            if (instr.opcode == OpCode::INVALID)
+            {
+                decoded.push_back(instr);
+                break;
+            }
+
+            switch (instr.opcode)
+            {
+            case OpCode::JUMP:
+            case OpCode::JUMPZ:
+            case OpCode::JUMPNZ:
+            case OpCode::CALL: {
+                vm_ui64 targetOffset = vm_ui64(instr.value.as_ptr - start);
+                branches.emplace_back(decoded.size(), targetOffset);
+                runs.push_back(targetOffset);
+            } break;
+            default: break;
+            }
+
+            decoded.push_back(instr);
+            offset += size;
+        }
+    }
+
+    //Resolve branch targets into indices
+    for (auto& [idx, targetOffset] : branches)
+        decoded[idx].target = indices.at(std::min(targetOffset, end));
+
+    entryIdx = indices.at(std::min(header.entryPoint, end));
+    Verify();
+}
+
+//Follows every path through the decoded instructions of each function to find the height of the stack, the
+//bytes between the frame pointer and the stack pointer, before every instruction. Functions are analyzed
+//when they are first called, so each one knows the most stack it and the functions it calls can use.
+class StackVerifier
+{
+public:
+    struct Function
+    {
+        bool analyzed = false;            //A call to a function that is still being analyzed is recursive
+        vm_i64 entryHeight = 0;           //The height at the first instruction, which is the storage for locals
+        std::optional<bool> returnsValue; //Whether the function returns with RETV; empty if it never returns
+        vm_i64 maxHeight = 0;             //The most bytes that the function and its callees use above its frame pointer
+        vm_i64 paramsSize = 0;            //The bytes of parameters that PLOAD and PSTORE access below the frame
+    };
+
+    StackVerifier(const std::vector<Instructions::Decoded>& _decoded) : decoded(_decoded), functions() { }
+
+    const Function& Analyze(vm_ui64 _entry, vm_i64 _entryHeight, bool _isMain)
+    {
+        auto [search, inserted] = functions.try_emplace(_entry);
+        Function& function = search->second;
+
+        if (!inserted)
+        {
+            if (!function.analyzed)
+                throw Fail(_entry, "is called recursively so the size of the stack is unbounded");
+            else if (function.entryHeight != _entryHeight)
+                throw Fail(_entry, "is called with different amounts of storage");
+
+            return function;
+        }
+
+        function.entryHeight = function.maxHeight = _entryHeight;
+
+        std::unordered_map<vm_ui64, vm_i64> heights; //Map from the index of an instruction to the height before it
+        std::vector<vm_ui64> worklist;
+
+        auto reach = [&](vm_ui64 _idx, vm_i64 _height)
+        {
+            auto [search, inserted] = heights.try_emplace(_idx, _height);
+            if (inserted)
+                worklist.push_back(_idx);
+            else if (search->second != _height)
+                throw Fail(_idx, "is reached with different stack heights");
+        };
+
+        reach(_entry, _entryHeight);
+
+        while (!worklist.empty())
+        {
+            vm_ui64 idx = worklist.back();
+            vm_i64 height = heights.at(idx);
+            auto& instr = decoded[idx];
+            worklist.pop_back();
+
+            auto pop = [&](vm_i64 _bytes)
+            {
+                if (height < _bytes)
+                    throw Fail(idx, "pops more than its frame holds");
+
+                height -= _bytes;
+            };
+
+            auto push = [&](vm_i64 _bytes)
+            {
+                height += _bytes;
+                function.maxHeight = std::max(function.maxHeight, height);
+            };
+
+            //Positions are relative to the frame pointer
+            auto access = [&](vm_i64 _pos)
+            {
+                if (_pos < 0 || _pos + (vm_i64)WORD_SIZE > height)
+                    throw Fail(idx, "accesses the stack outside of its frame");
+            };
+
+            auto accessParam = [&](vm_i64 _pos)
+            {
+                if (_isMain)
+                    throw Fail(idx, "accesses a parameter outside of a function");
+
+                function.paramsSize = std::max(function.paramsSize, -_pos - (vm_i64)WORD_SIZE * 2);
+            };
+
+            switch (instr.opcode)
+            {
+            case OpCode::NOOP: break;
+            case OpCode::PUSH: push(WORD_SIZE); break;
+            case OpCode::POP: pop(WORD_SIZE); break;
+            case OpCode::CONVERT: pop(WORD_SIZE); push(WORD_SIZE); break;
+            case OpCode::SLOAD: access(height + instr.offset); push(WORD_SIZE); break;
+            case OpCode::SSTORE: pop(WORD_SIZE); access(height + instr.offset); break;
+            case OpCode::LLOAD: access(instr.offset); push(WORD_SIZE); break;
+            case OpCode::LSTORE: pop(WORD_SIZE); access(instr.offset); break;
+            case OpCode::PLOAD: accessParam(instr.offset); push(WORD_SIZE); break;
+            case OpCode::PSTORE: pop(WORD_SIZE); accessParam(instr.offset); break;
+            case OpCode::MLOAD: pop(WORD_SIZE); push(WORD_SIZE); break;
+            case OpCode::MSTORE: pop(WORD_SIZE * 2); break;
+            case OpCode::ATOMIC: {
+                switch (instr.atomic)
+                {
+                case AtomicCode::LOAD: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case AtomicCode::STORE: pop(WORD_SIZE * 2); break;
+                case AtomicCode::CAS: pop(WORD_SIZE * 3); push(WORD_SIZE); break;
+                default: pop(WORD_SIZE * 2); push(WORD_SIZE); break;
+                }
+            } break;
+            case OpCode::JUMP: reach(instr.target, height); continue;
+            case OpCode::JUMPZ:
+            case OpCode::JUMPNZ: pop(WORD_SIZE); reach(instr.target, height); break;
+            case OpCode::CALL: {
+                auto& callee = Analyze(instr.target, instr.storage, false);
+
+                if (callee.paramsSize > height)
+                    throw Fail(idx, "passes fewer parameters than the function uses");
+
+                //The return address and frame pointer are pushed before the callee's frame
+                function.maxHeight = std::max(function.maxHeight, height + (vm_i64)WORD_SIZE * 2 + callee.maxHeight);
+
+                if (!callee.returnsValue.has_value())
+                    continue;
+                else if (callee.returnsValue.value())
+                    push(WORD_SIZE);
+            } break;
+            case OpCode::RET:
+            case OpCode::RETV: {
+                bool returnsValue = instr.opcode == OpCode::RETV;
+
+                if (_isMain)
+                    throw Fail(idx, "returns outside of a function");
+                else if (function.returnsValue.has_value() && function.returnsValue.value() != returnsValue)
+                    throw Fail(idx, "returns without a value from a function that returns a value elsewhere");
+
+                if (returnsValue)
+                    pop(WORD_SIZE);
+
+                function.returnsValue = returnsValue;
+            } continue;
+            case OpCode::SYSCALL: {
+                switch (instr.code)
+                {
+                case SysCallCode::EXIT: pop(WORD_SIZE); continue;
+                case SysCallCode::PRINTC: pop(WORD_SIZE); break;
+                case SysCallCode::MALLOC: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case SysCallCode::FREE: pop(WORD_SIZE); break;
+                case SysCallCode::SPAWN: throw Fail(idx, "spawns a thread whose function cannot be found before running");
+                case SysCallCode::JOIN: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case SysCallCode::YIELD: break;
+                case SysCallCode::WAIT: pop(WORD_SIZE * 3); push(WORD_SIZE); break;
+                case SysCallCode::NOTIFY: pop(WORD_SIZE * 2); push(WORD_SIZE); break;
+                case SysCallCode::CHANNEL: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case SysCallCode::SEND: pop(WORD_SIZE * 2); break;
+                case SysCallCode::RECV: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case SysCallCode::TRY_RECV: pop(WORD_SIZE); push(WORD_SIZE * 2); break;
+                case SysCallCode::PARALLEL_FOR: throw Fail(idx, "runs a parallel loop whose function cannot be found before running");
+                case SysCallCode::ARENA: pop(WORD_SIZE); push(WORD_SIZE); break;
+                case SysCallCode::ARENA_ALLOC: pop(WORD_SIZE * 2); push(WORD_SIZE); break;
+                case SysCallCode::ARENA_RESET: pop(WORD_SIZE); break;
+                case SysCallCode::ARENA_DESTROY: pop(WORD_SIZE); break;
+                default: throw Fail(idx, "is an unknown syscall");
+                }
+            } break;
+            case OpCode::INVALID: throw Fail(idx, "cannot be executed");
+            default: {
+                //Decoding leaves only specialized binops
+                assert(instr.opcode >= OpCode::ADD_I8 && instr.opcode <= OpCode::NEQ_F64 && "Case not handled");
+                pop(WORD_SIZE * 2);
+                push(WORD_SIZE);
+            } break;
+            }
+
+            reach(idx + 1, height);
+        }
+
+        function.analyzed = true;
+        return function;
+    }
+
+private:
+    const std::vector<Instructions::Decoded>& decoded;
+    std::unordered_map<vm_ui64, Function> functions; //Map from the index of the first instruction of a function to its analysis
+
+    std::runtime_error Fail(vm_ui64 _idx, const std::string& _msg)
+    {
+        return std::runtime_error("Instruction " + std::to_string(_idx) + " (" + Instructions::ToString(decoded[_idx].opcode) + ") " + _msg + "!");
+    }
+};
+
+//Checks that every path through the program keeps the stack inside of the frame that it runs in and finds
+//the most stack the main thread can use. Programs that pass can run without checking the bounds of the stack.
+//Programs that fail still run with those checks, so the reason is only recorded.
+void Program::Verify()
+{
+    verification = Verification();
+
+    try
+    {
+        //The main thread starts with the pointer to the command line arguments on its stack
+        StackVerifier verifier(decoded);
+        auto& main = verifier.Analyze(entryIdx, WORD_SIZE, true);
+
+        verification.verified = true;
+        verification.maxStackSize = (vm_ui64(main.maxHeight) + WORD_SIZE - 1) / WORD_SIZE * WORD_SIZE;
+    }
+    catch (const std::runtime_error& e)
+    {
+        verification.error = e.what();
+    }
+}
+
+//Replaces the first instruction of every sequence that has a superinstruction with that superinstruction.
+//The rest of the sequence is left in place so that branches into the middle of it still execute it.
+void Program::Fuse()
+{
+    for (vm_ui64 idx = 0; idx < decoded.size();)
+    {
+        auto& instr = decoded[idx];
+        OpCode fused = Instructions::Fuse(&instr, decoded.size() - idx);
+
+        if (fused != instr.opcode)
+        {
+            instr.opcode = fused;
+#ifdef EVM_THREADED_DISPATCH
+            instr.handler = Instructions::GetThreadedHandler(fused);
+#endif
+        }
+
+        idx += Instructions::GetSequence(fused).size();
+    }
+}
 
 Program Program::FromFile(const std::string& _filePath)
 {
@@ -346,14 +698,19 @@ Program Program::FromStream(std::istream& _stream)
         if (labelSearch == parseResult.GetLabels().end())
             throw Error::UNDEFINED_LABEL(token.position, token.value);
 
-        vm_byte* target = program.code.data() + labelSearch->second;
-        *(vm_byte**)&program.code[pos] = target;
+        //Pushed labels are code addresses, which are offsets into the code, while branches are resolved to pointers
+        if ((OpCode)program.code[pos - OP_CODE_SIZE] == OpCode::PUSH)
+            *(vm_ui64*)&program.code[pos] = labelSearch->second;
+        else
+            *(vm_byte**)&program.code[pos] = program.code.data() + labelSearch->second;
     }
 
 #ifdef BUILD_DEBUG
     program.Validate(); //Note that the program should already be validated since we generated a valid program
 #endif
 
+    program.Decode();
+    program.Fuse();
     return std::move(program);
 }
 
@@ -363,37 +720,160 @@ Program Program::FromString(const std::string& _string)
     return Program::FromStream(stream);
 }
 
+//The runtime that compiled programs call for the syscalls that take more than one system call. Heap blocks start
+//with their size and a link to the next free block, which is only used while the block is free.
+static const char* NASM_RUNTIME = R"(evm_printc:
+        mov [rel evm_char], dil
+        mov eax, 1
+        mov edi, 1
+        lea rsi, [rel evm_char]
+        mov edx, 1
+        syscall
+        ret
+
+evm_malloc:
+        add rdi, 15
+        and rdi, -16
+        lea rsi, [rel evm_free_list]
+.search:                                ;First fit in the free list
+        mov rax, [rsi]
+        test rax, rax
+        jz .grow
+        cmp [rax - 16], rdi
+        jae .take
+        lea rsi, [rax - 8]
+        jmp .search
+.take:
+        mov rcx, [rax - 8]
+        mov [rsi], rcx
+        ret
+.grow:                                  ;Move the program break past a new block
+        mov r8, rdi
+        mov r9, [rel evm_heap_end]
+        test r9, r9
+        jnz .bump
+        mov eax, 12
+        xor edi, edi
+        syscall
+        mov r9, rax
+.bump:
+        lea rdi, [r9 + r8 + 16]
+        mov eax, 12
+        syscall
+        cmp rax, rdi
+        jb evm_out_of_memory
+        mov [rel evm_heap_end], rax
+        mov [r9], r8
+        lea rax, [r9 + 16]
+        ret
+
+evm_free:
+        test rdi, rdi
+        jz .done
+        mov rax, [rel evm_free_list]
+        mov [rdi - 8], rax
+        mov [rel evm_free_list], rdi
+.done:
+        ret
+
+evm_args:                               ;Copies argv without the program name to the heap the way VM::Run stores the command line args
+        mov r12, [rsp + 8]
+        dec r12
+        lea r13, [rsp + 24]
+        lea rdi, [r12 * 8 + 8]
+        call evm_malloc
+        mov r14, rax
+        mov [r14], r12
+        xor r15d, r15d
+.arg:
+        cmp r15, r12
+        je .done
+        mov rbx, [r13 + r15 * 8]
+        xor ecx, ecx
+.length:
+        cmp byte [rbx + rcx], 0
+        je .copy
+        inc rcx
+        jmp .length
+.copy:
+        mov rbp, rcx
+        lea rdi, [rcx + 8]
+        call evm_malloc
+        mov [rax], rbp
+        mov [r14 + r15 * 8 + 8], rax
+        lea rdi, [rax + 8]
+        mov rsi, rbx
+        mov rcx, rbp
+        rep movsb
+        inc r15
+        jmp .arg
+.done:
+        mov rax, r14
+        ret
+
+evm_div_by_zero:
+        lea rsi, [rel evm_div_by_zero_msg]
+        mov edx, evm_div_by_zero_len
+        jmp evm_error
+
+evm_invalid_op_code:
+        lea rsi, [rel evm_invalid_op_code_msg]
+        mov edx, evm_invalid_op_code_len
+        jmp evm_error
+
+evm_out_of_memory:
+        lea rsi, [rel evm_out_of_memory_msg]
+        mov edx, evm_out_of_memory_len
+
+evm_error:                              ;Prints the message and exits like the vm does on an error
+        mov eax, 1
+        mov edi, 1
+        syscall
+        mov eax, 60
+        mov edi, -1
+        syscall
+
+        section .bss
+evm_char:       resb 1
+evm_free_list:  resq 1
+evm_heap_end:   resq 1
+)";
+
 void Program::ToNASM(std::ostream& _stream)
 {
-    vm_byte* start = code.data(), * end = &code.back() + 1;
+    vm_byte* start = code.data();
+    vm_ui64 end = code.size();
 
-    //Get Label Positions
-    std::unordered_map<vm_byte*, std::string> labelPositions; //Map from label pointer position to a unique string
-
-    for (vm_byte* ptr = start; ptr != end; ptr += GetSize((OpCode)*ptr))
+    _stream << "\t\tglobal\t\t_start\n\n";
+    _stream << "\t\tsection\t\t.text\n";
+    _stream << "_start:\n";
+    _stream << "\t\tcall evm_args\n";
+    _stream << "\t\tpush rax\n";
+    _stream << "\t\tlea rbp, [rsp + 8]\n";
+    _stream << "\t\tjmp L" << header.entryPoint << "\n\n";
+
+    //Every instruction is labeled with its offset so that branches and return addresses can refer to it
+    for (vm_ui64 offset = 0; offset < end; offset += GetSize((OpCode)start[offset]))
     {
-        OpCode opcode = (OpCode)*ptr;
-
-        switch (opcode)
-        {
-        case OpCode::JUMP: labelPositions.emplace(Instructions::JUMP::From(ptr)->target, "label" + std::to_string(labelPositions.size())); break;
-        case OpCode::JUMPNZ: labelPositions.emplace(Instructions::JUMPNZ::From(ptr)->target, "label" + std::to_string(labelPositions.size())); break;
-        case OpCode::JUMPZ: labelPositions.emplace(Instructions::JUMPZ::From(ptr)->target, "label" + std::to_string(labelPositions.size())); break;
-        case OpCode::CALL: labelPositions.emplace(Instructions::CALL::From(ptr)->target, "label" + std::to_string(labelPositions.size())); break;
-        default:
-        continue;
-        }
+        _stream << "L" << offset << ":\t\t;" << Instructions::ToString(start + offset) << "\n";
+        Instructions::ToNASM(start + offset, start, _stream, "\t\t");
+        _stream << "\n";
     }
 
-    //Translate
-    _stream << "\t\tglobal\t\tstart\n\n";
-    _stream << "\t\tsection\t\t.text\n";
-    _stream << "start:\n";
+    //Running off the end of the code is the same as executing an unknown op code
+    _stream << "L" << end << ":\n";
+    _stream << "\t\tjmp evm_invalid_op_code\n\n";
+    _stream << NASM_RUNTIME << "\n";
 
-    for (vm_byte* ptr = start; ptr != end; ptr += GetSize((OpCode)*ptr))
+    //Errors print the same messages as the vm
+    auto message = [&](const std::string& _name, const std::string& _msg)
     {
-        _stream << "\t\t;" << Instructions::ToString(ptr) << "\n";
-        Instructions::ToNASM(ptr, _stream, "\t\t");
-        _stream << "\n";
-    }
+        _stream << _name << "_msg:\tdb \"" << _msg << "\", 10\n";
+        _stream << _name << "_len\tequ $ - " << _name << "_msg\n";
+    };
+
+    _stream << "\t\tsection .rodata\n";
+    message("evm_div_by_zero", VMError::DIV_BY_ZERO().what());
+    message("evm_invalid_op_code", VMError::UNKNOWN_OP_CODE((vm_byte)OpCode::INVALID).what());
+    message("evm_out_of_memory", "Out of memory!");
 }
\ No newline at end of file
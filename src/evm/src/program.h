@@ -1,6 +1,9 @@
 #pragma once
 #include "evm.h"
 #include <vector>
+#include <optional>
+#include <unordered_map>
+#include "instructions.h"
 
 #pragma pack(push, 1) //This pragma ensures that the structed is packed and has no padding
 struct ProgramHeader
@@ -9,25 +12,56 @@ struct ProgramHeader
 };
 #pragma pack(pop)
 
+//The outcome of verifying the stack effects of a program's instructions
+struct Verification
+{
+    bool verified = false;
+    std::string error;        //Why the program could not be verified
+    vm_ui64 maxStackSize = 0; //The most bytes that the stack of the main thread holds at any point
+};
+
 class Program
 {
     ProgramHeader header;
     Memory code;
+    std::vector<Instructions::Decoded> decoded;
+    std::unordered_map<vm_ui64, vm_ui64> indices; //Map from the offset of every decoded instruction in the code to its index in decoded
+    vm_ui64 entryIdx;
+    Verification verification;
 public:
     Program();
     Program(Program&& _p) noexcept;
 
     void Resolve();
     void Validate();
+    void Decode();
+    void Verify();
+    void Fuse();
 
     void ToNASM(std::ostream& _stream);
 
-    const vm_byte* GetEntryPtr();
+    const Instructions::Decoded* GetEntry() const { return &decoded[entryIdx]; }
+
+    //Returns the index in decoded of the instruction at a code address, which is an offset into the code
+    std::optional<vm_ui64> GetIndex(vm_ui64 _address) const
+    {
+        auto search = indices.find(_address);
+        return search != indices.end() ? std::optional(search->second) : std::nullopt;
+    }
+
     const ProgramHeader& GetHeader() const { return header; }
     const Memory& GetCode() const { return code; };
+    const std::vector<Instructions::Decoded>& GetDecoded() const { return decoded; }
+    bool IsDecoded() const { return !decoded.empty(); }
+    const Verification& GetVerification() const { return verification; }
 
     template <class T>
-    void Insert(T _value) { code.insert(code.end(), (vm_byte*)&_value, (vm_byte*)&_value + sizeof(_value)); }
+    void Insert(T _value)
+    {
+        code.insert(code.end(), (vm_byte*)&_value, (vm_byte*)&_value + sizeof(_value));
+        decoded.clear(); //The code changed so it has to be decoded and verified again
+        verification = Verification();
+    }
 
     template <typename Arg1, typename... Rest>
     void Insert(Arg1 _arg1, Rest const &..._rest)
@@ -43,6 +77,10 @@ public:
 
         header = _p.header;
         code = std::move(_p.code);
+        decoded = std::move(_p.decoded);
+        indices = std::move(_p.indices);
+        entryIdx = _p.entryIdx;
+        verification = std::move(_p.verification);
         return *this;
     }
 
@@ -58,6 +96,8 @@ public:
 
         program.Resolve();
         program.Validate();
+        program.Decode();
+        program.Fuse();
         return std::move(program);
     }
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "scheduler.h"
+#include "thread.h"
+#include "vm.h"
+#include "../build.h"
+
+static thread_local Scheduler* currentScheduler = nullptr; //The scheduler of the worker running on this thread
+static thread_local size_t currentWorker = 0;
+
+Scheduler::Scheduler(VM* _vm, size_t _workerCount)
+    : vm(_vm), workers(), queued(0), sleeping(0), next(0), stopping(false)
+{
+    assert(_workerCount > 0);
+
+    for (size_t i = 0; i < _workerCount; i++)
+        workers.push_back(std::make_unique<Worker>());
+}
+
+Scheduler::~Scheduler()
+{
+    Stop();
+}
+
+void Scheduler::Start()
+{
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i]->thread = std::thread([this, i] { Work(i); });
+}
+
+void Scheduler::Stop()
+{
+    {
+        std::scoped_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    wakeUp.notify_all();
+
+    for (auto& worker : workers)
+    {
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+}
+
+void Scheduler::Submit(Thread* _thread, bool _yielded)
+{
+    size_t idx = currentScheduler == this ? currentWorker : size_t(next++ % workers.size());
+    Worker& worker = *workers[idx];
+
+    {
+        std::scoped_lock<std::mutex> lock(worker.mutex);
+        if (_yielded)
+            worker.queue.push_front(_thread);
+        else
+            worker.queue.push_back(_thread);
+    }
+
+    //Sleeping workers count themselves before they check for threads, so one of them always sees this one
+    queued++;
+    if (sleeping > 0)
+    {
+        std::scoped_lock<std::mutex> lock(mutex);
+        wakeUp.notify_one();
+    }
+}
+
+Thread* Scheduler::Take(size_t _idx)
+{
+    //The worker's own threads go first, starting with the one queued last since its stack is likely still cached
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        Worker& worker = *workers[(_idx + i) % workers.size()];
+        std::scoped_lock<std::mutex> lock(worker.mutex);
+
+        if (worker.queue.empty())
+            continue;
+
+        Thread* thread;
+        if (i == 0)
+        {
+            thread = worker.queue.back();
+            worker.queue.pop_back();
+        }
+        else
+        {
+            thread = worker.queue.front();
+            worker.queue.pop_front();
+        }
+
+        queued--;
+        return thread;
+    }
+
+    return nullptr;
+}
+
+void Scheduler::Work(size_t _idx)
+{
+    currentScheduler = this;
+    currentWorker = _idx;
+
+    while (!stopping)
+    {
+        Thread* thread = Take(_idx);
+
+        if (!thread)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping++;
+            wakeUp.wait(lock, [this] { return stopping || queued > 0; });
+            sleeping--;
+            continue;
+        }
+
+        //Threads that are still alive yielded and wait for their next turn
+        if (thread->Resume())
+            Submit(thread, true);
+    }
+
+    currentScheduler = nullptr;
+}
\ No newline at end of file
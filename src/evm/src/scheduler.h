@@ -0,0 +1,62 @@
+#pragma once
+#include "evm.h"
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+class VM;
+class Thread;
+
+//Multiplexes the threads of a vm onto a fixed pool of workers. A thread's state is only its stack and its
+//instruction pointer, so it runs on a worker until it finishes or yields and then continues on whichever
+//worker takes it next. Every worker has its own deque of runnable threads that it takes from at the back,
+//and workers that run out steal from the front of the others'.
+class Scheduler
+{
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Thread*> queue;
+        std::thread thread;
+    };
+
+    VM* vm;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<vm_ui64> queued;   //The number of threads in all of the queues
+    std::atomic<vm_ui64> sleeping; //The number of workers waiting for threads to be queued
+    std::atomic<vm_ui64> next;     //The worker that gets the next thread queued from outside of the workers
+    std::atomic<bool> stopping;
+    std::mutex mutex;              //Guards waking up sleeping workers
+    std::condition_variable wakeUp;
+
+    void Work(size_t _idx);
+    Thread* Take(size_t _idx);
+
+public:
+    Scheduler(VM* _vm, size_t _workerCount);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    //Starts the workers. Threads can be queued before.
+    void Start();
+
+    //Waits for the workers to finish the threads they are running and stops them. Queued threads are dropped.
+    void Stop();
+
+    //Queues a thread to run. Threads queued by a worker go to its own queue, at the front if they yielded
+    //so that the other threads in it run first.
+    void Submit(Thread* _thread, bool _yielded = false);
+
+    size_t GetWorkerCount() const { return workers.size(); }
+
+    //Returns the number of workers to use when none is given
+    static size_t GetDefaultWorkerCount() { return std::max(1u, std::thread::hardware_concurrency()); }
+};
\ No newline at end of file
@@ -3,14 +3,22 @@
 #include "instructions.h"
 #include "program.h"
 #include "vm.h"
+#include "thread.h"
+#include "profiler.h"
+#include "tiering.h"
+#include "jit.h"
+#include "arena.h"
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <random>
+#include <thread>
+#include <unordered_set>
+#include <algorithm>
 
 INIT_TEST_SUITE();
 
-using Instructions::OpCode, Instructions::SysCallCode, Instructions::DataType;
+using Instructions::OpCode, Instructions::SysCallCode, Instructions::AtomicCode, Instructions::DataType;
 
 DEFINE_TEST(NOOP)
 {
@@ -46,9 +54,42 @@ DEFINE_TEST(POP)
     ASSERT(VM().Run(64, program, {}) == 789ll);
 }
 
+//Converts _value from FROM to TO and exits with the result converted to an I64
+template <DataType FROM, DataType TO>
+vm_i64 RunConvert(typename Instructions::HostType<FROM>::type _value)
+{
+    Program program = Program::FromCode(
+        OpCode::PUSH, Word(_value),
+        OpCode::CONVERT, FROM, TO,
+        OpCode::CONVERT, TO, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    return VM().Run(64, program, {});
+}
+
 DEFINE_TEST(CONVERT)
 {
-    ASSERT(false);
+    ASSERT((RunConvert<DataType::I8, DataType::I64>(-5) == -5));
+    ASSERT((RunConvert<DataType::I8, DataType::UI8>(-1) == 255));
+    ASSERT((RunConvert<DataType::UI8, DataType::I16>(200) == 200));
+    ASSERT((RunConvert<DataType::I64, DataType::UI16>(65537) == 1));
+    ASSERT((RunConvert<DataType::I32, DataType::UI32>(-1) == 4294967295ll));
+    ASSERT((RunConvert<DataType::UI64, DataType::I32>(4294967298ull) == 2));
+    ASSERT((RunConvert<DataType::F64, DataType::I32>(-3.75) == -3));
+    ASSERT((RunConvert<DataType::F64, DataType::F32>(2.5) == 2));
+    ASSERT((RunConvert<DataType::I16, DataType::F64>(-300) == -300));
+    ASSERT((RunConvert<DataType::F32, DataType::F32>(7.5f) == 7));
+
+    //Conversions that do not change the bytes of the value are decoded as NOOPs
+    Program program = Program::FromCode(
+        OpCode::PUSH, 1ll,
+        OpCode::CONVERT, DataType::I64, DataType::UI64,
+        OpCode::CONVERT, DataType::UI64, DataType::F64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    ASSERT(program.GetDecoded()[1].opcode == OpCode::NOOP);
+    ASSERT(program.GetDecoded()[2].opcode == OpCode::CONVERT);
+    ASSERT(Instructions::ToString(&program.GetDecoded()[1]) == "CONVERT I64 UI64");
 }
 
 #pragma region Instructions
@@ -226,29 +267,75 @@ DEFINE_TEST(ADD)
     ASSERT(VM().Run(64, program, {}) == 33ll);
 }
 
+//Runs _left BINOP _right for TYPE and exits with the result converted to an I64
+template <DataType TYPE>
+vm_i64 RunBinop(OpCode _binop, typename Instructions::HostType<TYPE>::type _left, typename Instructions::HostType<TYPE>::type _right)
+{
+    bool isComparison = _binop == OpCode::EQ || _binop == OpCode::NEQ;
+    Program program = Program::FromCode(
+        OpCode::PUSH, Word(_right),
+        OpCode::PUSH, Word(_left),
+        _binop, TYPE,
+        OpCode::CONVERT, isComparison ? DataType::UI64 : TYPE, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    return VM().Run(64, program, {});
+}
+
+#define ASSERT_BINOP(BINOP, LEFT, RIGHT, EXPECTED)                             \
+    do                                                                         \
+    {                                                                          \
+        ASSERT(RunBinop<DataType::I8>(BINOP, LEFT, RIGHT) == EXPECTED);        \
+        ASSERT(RunBinop<DataType::UI8>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+        ASSERT(RunBinop<DataType::I16>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+        ASSERT(RunBinop<DataType::UI16>(BINOP, LEFT, RIGHT) == EXPECTED);      \
+        ASSERT(RunBinop<DataType::I32>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+        ASSERT(RunBinop<DataType::UI32>(BINOP, LEFT, RIGHT) == EXPECTED);      \
+        ASSERT(RunBinop<DataType::I64>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+        ASSERT(RunBinop<DataType::UI64>(BINOP, LEFT, RIGHT) == EXPECTED);      \
+        ASSERT(RunBinop<DataType::F32>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+        ASSERT(RunBinop<DataType::F64>(BINOP, LEFT, RIGHT) == EXPECTED);       \
+    } while (false)
+
 DEFINE_TEST(SUB)
 {
-    ASSERT(false);
+    ASSERT_BINOP(OpCode::SUB, 20, 7, 13);
 }
 
 DEFINE_TEST(MUL)
 {
-    ASSERT(false);
+    ASSERT_BINOP(OpCode::MUL, 6, 7, 42);
 }
 
 DEFINE_TEST(DIV)
 {
-    ASSERT(false);
+    ASSERT_BINOP(OpCode::DIV, 42, 6, 7);
 }
 
 DEFINE_TEST(EQ)
 {
-    ASSERT(false);
+    ASSERT_BINOP(OpCode::EQ, 5, 5, 1);
+    ASSERT_BINOP(OpCode::EQ, 5, 6, 0);
 }
 
 DEFINE_TEST(NEQ)
 {
-    ASSERT(false);
+    ASSERT_BINOP(OpCode::NEQ, 5, 6, 1);
+    ASSERT_BINOP(OpCode::NEQ, 5, 5, 0);
+}
+
+DEFINE_TEST(SPECIALIZED_BINOPS)
+{
+    Program program = Program::FromCode(
+        OpCode::PUSH, 16ll,
+        OpCode::PUSH, 17ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    auto& addInstr = program.GetDecoded()[2];
+    ASSERT(addInstr.opcode == OpCode::ADD_I64);
+    ASSERT(Instructions::ToString(&addInstr) == "ADD I64");
+    ASSERT(VM().Run(64, program, {}) == 33ll);
 }
 #pragma endregion
 
@@ -357,6 +444,32 @@ DEFINE_TEST(RETV)
     ASSERT(VM().Run(56, program, {}) == 123);
 }
 
+DEFINE_TEST(RET_INVALID_ADDRESS)
+{
+    //The function overwrites the return address that the call pushed below its frame
+    Program program = Program::FromCode(
+        OpCode::CALL, 15ull, 0u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 1000000ll,        //@FUNC
+        OpCode::SSTORE, -16ll,
+        OpCode::RET);
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::THREADED, DispatchMode::CACHED, DispatchMode::JIT, DispatchMode::TIERED })
+    {
+        try
+        {
+            VM vm;
+            vm.SetDispatchMode(mode);
+            vm.Run(64, program, {});
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::INVALID_CODE_ADDRESS);
+        }
+    }
+}
+
 DEFINE_TEST(JUMPZ)
 {
     Program program = Program::FromCode(
@@ -424,6 +537,25 @@ DEFINE_TEST(SYSCALL_MALLOC)
     VM vm;
     vm_byte* address = (vm_byte*)Word(vm.Run(24, program, {})).as_ptr;
     ASSERT(vm.GetHeap().IsAllocated(address));
+
+    //Sizes the heap cannot grow to fail the program instead of the vm
+    for (vm_ui64 amt : { 1ull << 62, 0x7FFFFFFFFFFFFFF0ull, ~0ull - 0xFF })
+    {
+        Program tooBig = Program::FromCode(
+            OpCode::PUSH, amt,
+            OpCode::SYSCALL, SysCallCode::MALLOC,
+            OpCode::SYSCALL, SysCallCode::EXIT);
+
+        try
+        {
+            VM().Run(24, tooBig, {});
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::OUT_OF_MEMORY);
+        }
+    }
 }
 
 DEFINE_TEST(SYSCALL_FREE)
@@ -592,67 +724,1474 @@ DEFINE_TEST(INVALID_MEM_ACCESS2)
 }
 #pragma endregion
 
-DEFINE_TEST(TEST_FILES)
+#pragma region Decoding
+DEFINE_TEST(DECODE)
 {
-    std::string dirPath = "tests/evm/";
-    std::ifstream expectedFile(dirPath + "expected.txt");
-    ASSERT(expectedFile.is_open());
+    Program program = Program::FromCode(
+        OpCode::PUSH, 5ull,
+        OpCode::JUMP, 19ull,
+        OpCode::NOOP,
+        OpCode::LLOAD, 2u,
+        OpCode::PLOAD, 0u,
+        OpCode::SYSCALL, SysCallCode::EXIT);
 
-    //Skip Header
-    std::string line;
-    std::getline(expectedFile, line);
-    std::getline(expectedFile, line);
+    auto& decoded = program.GetDecoded();
+    ASSERT(decoded.size() == 7); //Includes the end of the code
+    ASSERT(decoded[0].opcode == OpCode::PUSH && decoded[0].value.as_ui64 == 5ull);
+    ASSERT(decoded[1].opcode == OpCode::JUMP && decoded[1].target == 3);
+    ASSERT(decoded[3].opcode == OpCode::LLOAD && decoded[3].offset == 16);
+    ASSERT(decoded[4].opcode == OpCode::PLOAD && decoded[4].offset == -24);
+    ASSERT(decoded[5].opcode == OpCode::SYSCALL && decoded[5].code == SysCallCode::EXIT);
+    ASSERT(decoded[6].opcode == OpCode::INVALID);
+    ASSERT(program.GetEntry() == &decoded[0]);
+}
 
-    std::string caseName, expectedOutput;
-    vm_i64 expectedExitCode;
+DEFINE_TEST(DECODE_MISALIGNED_TARGET)
+{
+    //The jump lands on the second byte of the SYSCALL which is the op code for NOOP
+    Program program = Program::FromCode(
+        OpCode::PUSH, 123ll,
+        OpCode::JUMP, 19ull,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::SYSCALL, SysCallCode::EXIT);
 
-    while (expectedFile >> caseName)
+    auto& decoded = program.GetDecoded();
+    ASSERT(decoded[1].opcode == OpCode::JUMP && decoded[decoded[1].target].opcode == OpCode::NOOP);
+    ASSERT(VM().Run(64, program, {}) == 123ll);
+}
+#pragma endregion
+
+#pragma region Verification
+//Computes 5! with the loop in tests/evm/factorial.edeasm
+Program FactorialProgram()
+{
+    return Program::FromCode(
+        OpCode::PUSH, 5ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 1ull,
+        OpCode::EQ, DataType::UI64,
+        OpCode::JUMPNZ, 96ull,
+        OpCode::SLOAD, -16ll,
+        OpCode::MUL, DataType::UI64,
+        OpCode::PUSH, 1ull,
+        OpCode::SLOAD, -24ll,
+        OpCode::SUB, DataType::UI64,
+        OpCode::SSTORE, -16ll,
+        OpCode::JUMP, 18ull,
+        OpCode::CONVERT, DataType::UI64, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+}
+
+DEFINE_TEST(VERIFY)
+{
+    Program factorial = FactorialProgram();
+
+    ASSERT(factorial.GetVerification().verified && factorial.GetVerification().maxStackSize == 40);
+
+    //The callee's frame is on top of the caller's stack
+    Program call = Program::FromCode(
+        OpCode::PUSH, 2ll,
+        OpCode::CALL, 24ull, 8u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PLOAD, 0u,
+        OpCode::LSTORE, 0u,
+        OpCode::LLOAD, 0u,
+        OpCode::LLOAD, 0u,
+        OpCode::ADD, DataType::I64,
+        OpCode::RETV);
+
+    ASSERT(call.GetVerification().verified && call.GetVerification().maxStackSize == 56);
+
+    VM factorialVM, callVM;
+    factorialVM.SetDispatchMode(DispatchMode::VERIFIED);
+    callVM.SetDispatchMode(DispatchMode::VERIFIED);
+    ASSERT(factorialVM.Run(40, factorial, {}) == 120);
+    ASSERT(callVM.Run(56, call, {}) == 4);
+
+    //Stacks smaller than the most that a verified program can use are rejected before it runs
+    try
     {
-        expectedFile >> expectedExitCode;
+        factorialVM.Run(32, factorial, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::STACK_OVERFLOW);
+    }
+}
 
-        //Get expected output
-        std::getline(expectedFile, expectedOutput);
-        expectedOutput = expectedOutput.substr(expectedOutput.find_first_of('"') + 1);
-        expectedOutput = expectedOutput.substr(0, expectedOutput.find_last_of('"'));
+DEFINE_TEST(VERIFY_FAILURES)
+{
+    Program underflow = Program::FromCode(OpCode::POP, OpCode::POP, OpCode::SYSCALL, SysCallCode::EXIT);
+    Program outsideFrame = Program::FromCode(OpCode::PUSH, 1ll, OpCode::SLOAD, -24ll, OpCode::SYSCALL, SysCallCode::EXIT);
+    Program recursive = Program::FromCode(OpCode::CALL, 0ull, 0u);
+    Program heights = Program::FromCode(
+        OpCode::PUSH, 0ll,
+        OpCode::JUMPNZ, 27ull,
+        OpCode::PUSH, 2ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+    Program params = Program::FromCode(
+        OpCode::CALL, 15ull, 0u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PLOAD, 1u,
+        OpCode::RETV);
 
-        std::string filePath = dirPath + std::string(caseName.begin(), caseName.end()) + ".edeasm";
-        Program program = Program::FromFile(filePath.c_str());
+    for (Program* program : { &underflow, &outsideFrame, &recursive, &heights, &params })
+        ASSERT(!program->GetVerification().verified && !program->GetVerification().error.empty());
+
+    //Unverified programs still run with checks, which VERIFIED falls back to for them
+    ASSERT(VM().Run(64, heights, {}) == 2);
+
+    VM vm;
+    vm.SetDispatchMode(DispatchMode::VERIFIED);
+    ASSERT(vm.Run(64, heights, {}) == 2 && vm.GetRunMode() == DispatchMode::CACHED);
+
+    try
+    {
+        vm.Run(64, underflow, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::STACK_UNDERFLOW);
+    }
+}
+#pragma endregion
+
+#pragma region Dispatch
+DEFINE_TEST(DISPATCH_MODES)
+{
+    Program program = FactorialProgram();
+
+    VM switchVM;
+    switchVM.SetDispatchMode(DispatchMode::SWITCH);
+    ASSERT(switchVM.Run(64, program, {}) == 120);
 
+#ifdef EVM_THREADED_DISPATCH
+    VM threadedVM;
+    threadedVM.SetDispatchMode(DispatchMode::THREADED);
+    ASSERT(threadedVM.Run(64, program, {}) == 120);
+#endif
+
+    VM cachedVM;
+    cachedVM.SetDispatchMode(DispatchMode::CACHED);
+    ASSERT(cachedVM.Run(64, program, {}) == 120);
+
+    VM jitVM;
+    jitVM.SetDispatchMode(DispatchMode::JIT);
+    ASSERT(jitVM.Run(64, program, {}) == 120);
+}
+
+DEFINE_TEST(DISPATCH_CACHED)
+{
+    auto runCached = [](Program& _program, vm_ui64 _stackSize, std::string* _output = nullptr)
+    {
         VM vm;
         std::stringstream stdIO;
+        vm.SetDispatchMode(DispatchMode::CACHED);
         vm.SetStdIO(stdIO.rdbuf(), stdIO.rdbuf());
+        vm_i64 exitCode = vm.Run(_stackSize, _program, {});
 
-        ASSERT_MSG(vm.Run(64, program, {}) == expectedExitCode, filePath);
-        ASSERT_MSG(stdIO.str() == expectedOutput, filePath);
+        if (_output)
+            *_output = stdIO.str();
+
+        return exitCode;
+    };
+
+    //Stores into the slot on the top of the stack which is cached
+    Program overlap = Program::FromCode(
+        OpCode::PUSH, 1ll,
+        OpCode::PUSH, 2ll,
+        OpCode::PUSH, 3ll,
+        OpCode::SSTORE, -8ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+    ASSERT(runCached(overlap, 64) == 6);
+
+    //Syscalls and calls run on the thread's stack so the cache has to be spilled around them
+    Program spill = Program::FromCode(
+        OpCode::PUSH, (vm_i64)'h',
+        OpCode::SYSCALL, SysCallCode::PRINTC,
+        OpCode::CALL, 26ull, 0u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, (vm_i64)'i',
+        OpCode::SYSCALL, SysCallCode::PRINTC,
+        OpCode::PUSH, 7ll,
+        OpCode::RETV);
+
+    std::string output;
+    ASSERT(runCached(spill, 64, &output) == 7 && output == "hi");
+
+    Program overflow = Program::FromCode(OpCode::PUSH, 1ll, OpCode::PUSH, 2ll);
+    Program underflow = Program::FromCode(OpCode::POP, OpCode::POP, OpCode::ADD, DataType::I64);
+
+    try
+    {
+        runCached(overflow, 16);
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::STACK_OVERFLOW);
+    }
+
+    try
+    {
+        runCached(underflow, 64);
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::STACK_UNDERFLOW);
     }
 }
 
-DEFINE_TEST(TEST_HEAP)
+DEFINE_TEST(DISPATCH_JIT)
 {
-    std::random_device randDev;
-    std::mt19937 randRng(randDev());
-    std::vector<vm_byte*> alives;
-    Heap heap(nullptr);
+    //Runs a program with the interpreter and with compiled code and returns the exit code or error of both
+    auto runBoth = [](Program& _program, vm_ui64 _stackSize, std::string* _output = nullptr)
+    {
+        std::vector<std::variant<vm_i64, VMErrorType>> results;
+        std::vector<std::string> outputs;
 
-    std::uniform_int_distribution<std::mt19937::result_type> boolGenerator(0, 2);
-    std::uniform_int_distribution<std::mt19937::result_type> sizeGenerator(1, 128);
+        for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::JIT })
+        {
+            VM vm;
+            std::stringstream stdIO;
+            vm.SetDispatchMode(mode);
+            vm.SetStdIO(stdIO.rdbuf(), stdIO.rdbuf());
 
-    for (int i = 0; i < 1000; i++)
+            try { results.push_back(vm.Run(_stackSize, _program, {})); }
+            catch (const VMError& e) { results.push_back(e.GetType()); }
+
+            outputs.push_back(stdIO.str());
+        }
+
+        ASSERT(results[0] == results[1] && outputs[0] == outputs[1]);
+
+        if (_output)
+            *_output = outputs[1];
+
+        return results[1];
+    };
+
+    //Calls, returns and syscalls call back into the vm from compiled code
+    Program calls = Program::FromCode(
+        OpCode::PUSH, (vm_i64)'h',
+        OpCode::SYSCALL, SysCallCode::PRINTC,
+        OpCode::PUSH, 3ll,
+        OpCode::CALL, 35ull, 8u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, (vm_i64)'i',
+        OpCode::SYSCALL, SysCallCode::PRINTC,
+        OpCode::PLOAD, 0u,
+        OpCode::LSTORE, 0u,
+        OpCode::LLOAD, 0u,
+        OpCode::LLOAD, 0u,
+        OpCode::MUL, DataType::I64,
+        OpCode::RETV);
+
+    std::string output;
+    ASSERT(std::get<vm_i64>(runBoth(calls, 64, &output)) == 9 && output == "hi");
+
+    //Typed binops and conversions that run natively
+    Program arithmetic = Program::FromCode(
+        OpCode::PUSH, 2.5,
+        OpCode::PUSH, 4.0,
+        OpCode::MUL, DataType::F64,
+        OpCode::PUSH, 0.5,
+        OpCode::SUB, DataType::F64,
+        OpCode::CONVERT, DataType::F64, DataType::I64,
+        OpCode::PUSH, 0x100ll,
+        OpCode::PUSH, 0x200ll,
+        OpCode::EQ, DataType::I8,
+        OpCode::ADD, DataType::I64,
+        OpCode::PUSH, 7ll,
+        OpCode::PUSH, 3ll,
+        OpCode::SUB, DataType::I32,
+        OpCode::CONVERT, DataType::I32, DataType::I64,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+    ASSERT(std::get<vm_i64>(runBoth(arithmetic, 64)) == -9 + 1 + (3 - 7)); //0.5 - 10.0 truncates to -9
+
+    //Errors thrown by native code and by the instructions it calls back for
+    Program overflow = Program::FromCode(OpCode::PUSH, 1ll, OpCode::PUSH, 2ll, OpCode::PUSH, 3ll);
+    Program underflow = Program::FromCode(OpCode::POP, OpCode::POP, OpCode::ADD, DataType::I64);
+    Program outsideStack = Program::FromCode(OpCode::SLOAD, 64ll);
+    Program divByZero = Program::FromCode(OpCode::PUSH, 0ll, OpCode::PUSH, 1ll, OpCode::DIV, DataType::I64);
+
+    ASSERT(std::get<VMErrorType>(runBoth(overflow, 16)) == VMErrorType::STACK_OVERFLOW);
+    ASSERT(std::get<VMErrorType>(runBoth(underflow, 64)) == VMErrorType::STACK_UNDERFLOW);
+    ASSERT(std::get<VMErrorType>(runBoth(outsideStack, 64)) == VMErrorType::STACK_OVERFLOW);
+    ASSERT(std::get<VMErrorType>(runBoth(divByZero, 64)) == VMErrorType::DIV_BY_ZERO);
+}
+
+DEFINE_TEST(DISPATCH_TIERED)
+{
+    //Calls a function that returns 1 in a loop and adds up what it returns
+    auto loop = [](vm_i64 _iterations)
     {
-        if (boolGenerator(randRng) > 0)
+        return Program::FromCode(
+            OpCode::PUSH, _iterations,
+            OpCode::PUSH, 0ll,
+            OpCode::CALL, 82ull, 0u,
+            OpCode::ADD, DataType::I64,
+            OpCode::PUSH, 1ll,
+            OpCode::SLOAD, -24ll,
+            OpCode::SUB, DataType::I64,
+            OpCode::SSTORE, -16ll,
+            OpCode::SLOAD, -16ll,
+            OpCode::JUMPNZ, 18ull,
+            OpCode::SYSCALL, SysCallCode::EXIT,
+            OpCode::PUSH, 1ll,
+            OpCode::RETV);
+    };
+
+    //Returns the tier of the targets of the first instructions with the op codes. Superinstructions keep the
+    //instructions they are fused from after their first one.
+    auto getTiers = [](VM& _vm, OpCode _call, OpCode _branch)
+    {
+        Tiering* tiering = _vm.GetTiering();
+        const Instructions::Decoded* code = tiering->GetCode();
+        const Instructions::Decoded *function = nullptr, *header = nullptr;
+
+        for (auto instr = code; instr < code + tiering->GetCodeSize() && (!function || !header); instr++)
         {
-            alives.push_back(heap.Alloc(sizeGenerator(randRng)));
+            if (instr->opcode == _call && !function) { function = code + instr->target; }
+            else if (instr->opcode == _branch && !header) { header = code + instr->target; }
         }
-        else if (!alives.empty())
-        {
-            std::uniform_int_distribution<std::mt19937::result_type> aliveIdxPicker(0, alives.size() - 1);
-            auto pos = alives.begin() + aliveIdxPicker(randRng);
-            auto ptr = *pos;
 
-            heap.Free(ptr);
-            alives.erase(pos);
-        }
+        ASSERT(function && header);
+        return std::make_pair(tiering->GetTier(function), tiering->GetTier(header));
+    };
+
+    //Short scripts stay on the cheapest tier
+    Program shortLoop = loop(3);
+    VM shortVM;
+    shortVM.SetDispatchMode(DispatchMode::TIERED);
+    ASSERT(shortVM.Run(64, shortLoop, {}) == 3);
+    ASSERT(getTiers(shortVM, OpCode::CALL, OpCode::JUMPNZ) == std::make_pair(Tiering::Tier::INTERPRETED, Tiering::Tier::INTERPRETED));
+    ASSERT(shortVM.GetTiering()->GetCompilationCount() == 0);
+
+    //The function is promoted at its calls and the loop is replaced while it runs
+    Program longLoop = loop(50);
+    VM longVM;
+    longVM.SetDispatchMode(DispatchMode::TIERED);
+    longVM.SetTierThresholds(4, 16);
+    ASSERT(longVM.Run(64, longLoop, {}) == 50);
+    ASSERT(getTiers(longVM, OpCode::CALL, OpCode::JUMPNZ) == std::make_pair(Tiering::Tier::NATIVE, Tiering::Tier::NATIVE));
+
+#ifdef EVM_JIT
+    ASSERT(longVM.GetTiering()->GetCompilationCount() == 2);
+#endif
+
+    //Only fusing
+    VM fusedVM;
+    fusedVM.SetDispatchMode(DispatchMode::TIERED);
+    fusedVM.SetTierThresholds(4, 1000);
+    ASSERT(fusedVM.Run(64, longLoop, {}) == 50);
+    ASSERT(getTiers(fusedVM, OpCode::CALL, OpCode::JUMPNZ) == std::make_pair(Tiering::Tier::FUSED, Tiering::Tier::FUSED));
+}
+#pragma endregion
 
-        heap.AssertHeuristics();
+#pragma region Superinstructions
+DEFINE_TEST(FUSION)
+{
+    Program factorial = FactorialProgram();
+
+    auto& decoded = factorial.GetDecoded();
+    ASSERT(decoded[2].opcode == OpCode::SLOAD_PUSH_EQ_UI64_JUMPNZ && decoded[3].opcode == OpCode::PUSH && decoded[5].opcode == OpCode::JUMPNZ);
+    ASSERT(decoded[6].opcode == OpCode::SLOAD_MUL_UI64);
+    ASSERT(decoded[8].opcode == OpCode::PUSH_SLOAD_SUB_UI64);
+    ASSERT(decoded[11].opcode == OpCode::SSTORE_JUMP);
+
+    //Adds two locals in a call
+    Program locals = Program::FromCode(
+        OpCode::CALL, 15ull, 16u,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 40ll,
+        OpCode::LSTORE, 0u,
+        OpCode::PUSH, 2ll,
+        OpCode::LSTORE, 1u,
+        OpCode::LLOAD, 0u,
+        OpCode::LLOAD, 1u,
+        OpCode::ADD, DataType::I64,
+        OpCode::RETV);
+
+    ASSERT(locals.GetDecoded()[6].opcode == OpCode::LLOAD_LLOAD_ADD_I64);
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::THREADED, DispatchMode::CACHED })
+    {
+        VM factorialVM, localsVM;
+        factorialVM.SetDispatchMode(mode);
+        localsVM.SetDispatchMode(mode);
+        ASSERT(factorialVM.Run(64, factorial, {}) == 120);
+        ASSERT(localsVM.Run(64, locals, {}) == 42);
+    }
+}
+
+DEFINE_TEST(FUSION_BRANCH_INTO_SEQUENCE)
+{
+    //The jump lands on the PUSH inside of a fused SLOAD, PUSH, EQ, JUMPNZ so the SLOAD must not execute
+    Program program = Program::FromCode(
+        OpCode::PUSH, 7ull,
+        OpCode::JUMP, 27ull,
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 7ull,
+        OpCode::EQ, DataType::UI64,
+        OpCode::JUMPNZ, 58ull,
+        OpCode::PUSH, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 1ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    ASSERT(program.GetDecoded()[2].opcode == OpCode::SLOAD_PUSH_EQ_UI64_JUMPNZ);
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::THREADED, DispatchMode::CACHED })
+    {
+        VM vm;
+        vm.SetDispatchMode(mode);
+        ASSERT(vm.Run(64, program, {}) == 1);
+    }
+}
+
+DEFINE_TEST(THREADS_IN_PARALLEL)
+{
+    //Every thread allocates, writes, reads and frees heap memory in a loop while the others do the same
+    Program program = Program::FromCode(
+        OpCode::PUSH, 1000ll,
+        OpCode::SLOAD, -8ll,        //@LOOP
+        OpCode::JUMPZ, 115ull,
+        OpCode::PUSH, 8ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::SLOAD, -16ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 0ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::SYSCALL, SysCallCode::FREE,
+        OpCode::POP,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 9ull,
+        OpCode::PUSH, 7ll,          //@EXIT
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::CACHED, DispatchMode::JIT, DispatchMode::TIERED })
+    {
+        VM vm;
+        vm.SetDispatchMode(mode);
+        vm.SetThreadCount(4);
+
+        ASSERT(vm.Run(1024, program, {}) == 7);
+        vm.GetHeap().AssertHeuristics();
+    }
+}
+
+DEFINE_TEST(WORKERS)
+{
+    //Many more threads than workers, each counting down from 10 before exiting
+    Program program = Program::FromCode(
+        OpCode::PUSH, 10ll,
+        OpCode::SLOAD, -8ll,        //@LOOP
+        OpCode::JUMPZ, 65ull,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 9ull,
+        OpCode::PUSH, 7ll,          //@EXIT
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    for (size_t workers : { 1, 3 })
+    {
+        VM vm;
+        vm.SetWorkerCount(workers);
+        vm.SetThreadCount(1000);
+
+        ASSERT(vm.Run(1024, program, {}) == 7);
     }
+}
+
+DEFINE_TEST(SPAWN_JOIN)
+{
+    //Two threads square their arg and the main thread exits with the sum of their exit values
+    Program program = Program::FromCode(
+        OpCode::PUSH, 3ll,
+        OpCode::PUSH, 77ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::PUSH, 5ll,
+        OpCode::PUSH, 77ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::SLOAD, -16ll,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::YIELD,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PLOAD, 0u,          //@SQUARE
+        OpCode::PLOAD, 0u,
+        OpCode::MUL, DataType::I64,
+        OpCode::RETV);
+
+    for (size_t workers : { 1, 3 })
+    {
+        VM vm;
+        vm.SetWorkerCount(workers);
+        ASSERT(vm.Run(1024, program, {}) == 34);
+    }
+
+    //A thread can only be joined once, even before the vm destroys it
+    Program twice = Program::FromCode(
+        OpCode::PUSH, 36ull,
+        OpCode::PUSH, 0ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SLOAD, -8ll,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 5ll,          //@THREAD
+        OpCode::RETV);
+
+    for (size_t workers : { 1, 3 })
+    {
+        try
+        {
+            VM vm;
+            vm.SetWorkerCount(workers);
+            vm.Run(1024, twice, {});
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::INVALID_THREAD_ID);
+        }
+    }
+
+    //Code addresses have to point at an instruction
+    Program invalid = Program::FromCode(
+        OpCode::PUSH, 1ull,
+        OpCode::PUSH, 0ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    try
+    {
+        VM().Run(1024, invalid, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::INVALID_CODE_ADDRESS);
+    }
+}
+
+DEFINE_TEST(ATOMICS)
+{
+    Program program = Program::FromCode(
+        OpCode::PUSH, 16ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 5ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::STORE, 8ll,     //5
+        OpCode::PUSH, 3ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::FETCH_ADD, 8ll, //8
+        OpCode::POP,
+        OpCode::PUSH, 100ll,
+        OpCode::PUSH, 8ll,
+        OpCode::SLOAD, -24ll,
+        OpCode::ATOMIC, AtomicCode::CAS, 8ll,       //100
+        OpCode::POP,
+        OpCode::PUSH, 1ll,
+        OpCode::PUSH, 2ll,
+        OpCode::SLOAD, -24ll,
+        OpCode::ATOMIC, AtomicCode::CAS, 8ll,       //Still 100 since it is not 2
+        OpCode::POP,
+        OpCode::PUSH, 3ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::FETCH_OR, 8ll,  //103
+        OpCode::POP,
+        OpCode::PUSH, 246ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::FETCH_AND, 8ll, //102
+        OpCode::POP,
+        OpCode::PUSH, 7ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::EXCHANGE, 8ll,  //7
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::LOAD, 8ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    ASSERT(VM().Run(1024, program, {}) == 109);
+
+    //Four threads increment a shared counter 1000 times each
+    Program counter = Program::FromCode(
+        OpCode::PUSH, 8ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 160ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 160ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SLOAD, -24ll,
+        OpCode::PUSH, 160ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SLOAD, -32ll,
+        OpCode::PUSH, 160ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::POP,
+        OpCode::SLOAD, -8ll,
+        OpCode::ATOMIC, AtomicCode::LOAD, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 1000ll,                       //@INCREMENT
+        OpCode::SLOAD, -8ll,                        //@LOOP
+        OpCode::JUMPZ, 250ull,
+        OpCode::PUSH, 1ll,
+        OpCode::PLOAD, 0u,
+        OpCode::ATOMIC, AtomicCode::FETCH_ADD, 0ll,
+        OpCode::POP,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 169ull,
+        OpCode::RET);                               //@END
+
+    for (size_t workers : { 1, 3 })
+    {
+        VM vm;
+        vm.SetWorkerCount(workers);
+        ASSERT(vm.Run(1024, counter, {}) == 4000);
+    }
+
+    //Atomic accesses have to be aligned to a word
+    Program unaligned = Program::FromCode(
+        OpCode::PUSH, 16ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::ATOMIC, AtomicCode::LOAD, 1ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    try
+    {
+        VM().Run(1024, unaligned, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::UNALIGNED_MEM_ACCESS);
+    }
+}
+
+DEFINE_TEST(WAIT_NOTIFY)
+{
+    //A wait for a value the word does not hold returns at once and a wait that nobody notifies times out
+    Program timeouts = Program::FromCode(
+        OpCode::PUSH, 8ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::STORE, 0ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 1ll,
+        OpCode::PUSH, -1ll,
+        OpCode::SYSCALL, SysCallCode::WAIT,         //MISMATCH
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 0ll,
+        OpCode::PUSH, 1000000ll,
+        OpCode::SYSCALL, SysCallCode::WAIT,         //TIMED_OUT
+        OpCode::ADD, DataType::I64,
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 5ll,
+        OpCode::SYSCALL, SysCallCode::NOTIFY,       //Nobody is waiting anymore
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    ASSERT(VM().Run(1024, timeouts, {}) == (vm_i64)WaitResult::MISMATCH + (vm_i64)WaitResult::TIMED_OUT);
+
+    //A thread waits for the main thread to publish a value
+    Program publish = Program::FromCode(
+        OpCode::PUSH, 8ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::STORE, 0ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 123ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SYSCALL, SysCallCode::YIELD,
+        OpCode::PUSH, 42ll,
+        OpCode::SLOAD, -24ll,
+        OpCode::ATOMIC, AtomicCode::STORE, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::NOTIFY,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::JOIN,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PLOAD, 0u,                          //@CONSUME
+        OpCode::PUSH, 0ll,
+        OpCode::PUSH, -1ll,
+        OpCode::SYSCALL, SysCallCode::WAIT,
+        OpCode::POP,
+        OpCode::PLOAD, 0u,
+        OpCode::ATOMIC, AtomicCode::LOAD, 0ll,
+        OpCode::RETV);
+
+    for (size_t workers : { 1, 3 })
+    {
+        VM vm;
+        vm.SetWorkerCount(workers);
+        ASSERT(vm.Run(1024, publish, {}) == 42);
+    }
+
+    //Threads that are still waiting do not keep the program from exiting
+    Program quit = Program::FromCode(
+        OpCode::PUSH, 8ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::ATOMIC, AtomicCode::STORE, 0ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 81ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::SYSCALL, SysCallCode::YIELD,
+        OpCode::PUSH, 5ll,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PLOAD, 0u,                          //@BLOCK
+        OpCode::PUSH, 0ll,
+        OpCode::PUSH, -1ll,
+        OpCode::SYSCALL, SysCallCode::WAIT,
+        OpCode::RET);
+
+    ASSERT(VM().Run(1024, quit, {}) == 5);
+}
+
+DEFINE_TEST(CHANNELS)
+{
+    //A thread sends 100 down to 1 through a channel that holds a single word and the main thread sums them up
+    Program program = Program::FromCode(
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::CHANNEL,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 164ull,
+        OpCode::PUSH, 1ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::POP,
+        OpCode::PUSH, 0ll,                          //Sum
+        OpCode::PUSH, 100ll,                        //Counter
+        OpCode::SLOAD, -8ll,                        //@LOOP
+        OpCode::JUMPZ, 146ull,
+        OpCode::SLOAD, -24ll,
+        OpCode::SYSCALL, SysCallCode::RECV,
+        OpCode::SLOAD, -24ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SSTORE, -16ll,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 59ull,
+        OpCode::POP,                                //@END
+        OpCode::SLOAD, -16ll,
+        OpCode::SYSCALL, SysCallCode::TRY_RECV,     //Empty
+        OpCode::ADD, DataType::I64,
+        OpCode::ADD, DataType::I64,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 100ll,                        //@PRODUCE
+        OpCode::SLOAD, -8ll,                        //@PRODUCE_LOOP
+        OpCode::JUMPZ, 245ull,
+        OpCode::SLOAD, -8ll,
+        OpCode::PLOAD, 0u,
+        OpCode::SYSCALL, SysCallCode::SEND,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 173ull,
+        OpCode::RET);                               //@PRODUCE_END
+
+    for (size_t workers : { 1, 3 })
+    {
+        VM vm;
+        vm.SetWorkerCount(workers);
+        ASSERT(vm.Run(1024, program, {}) == 5050);
+    }
+
+    Program invalid = Program::FromCode(
+        OpCode::PUSH, 3ull,
+        OpCode::SYSCALL, SysCallCode::RECV,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    try
+    {
+        VM().Run(1024, invalid, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::INVALID_CHANNEL_ID);
+    }
+
+    //Capacities the vm cannot allocate fail the program instead of the vm
+    for (vm_ui64 capacity : { 0ull, MAX_CHANNEL_CAPACITY + 1, ~0ull })
+    {
+        Program tooBig = Program::FromCode(
+            OpCode::PUSH, capacity,
+            OpCode::SYSCALL, SysCallCode::CHANNEL,
+            OpCode::SYSCALL, SysCallCode::EXIT);
+
+        try
+        {
+            VM().Run(1024, tooBig, {});
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::INVALID_CHANNEL_CAPACITY);
+        }
+    }
+}
+
+DEFINE_TEST(PARALLEL_FOR)
+{
+    //Every call sends the numbers of its chunk through a channel and the main thread exits with their sum * 1000 + their count
+    auto program = [](vm_i64 _begin, vm_i64 _end, vm_ui64 _grain) {
+        return Program::FromCode(
+            OpCode::PUSH, 100ull,
+            OpCode::SYSCALL, SysCallCode::CHANNEL,
+            OpCode::POP,
+            OpCode::PUSH, 153ull,
+            OpCode::PUSH, _begin,
+            OpCode::PUSH, _end,
+            OpCode::PUSH, _grain,
+            OpCode::SYSCALL, SysCallCode::PARALLEL_FOR,
+            OpCode::PUSH, 0ll,                          //Sum
+            OpCode::PUSH, 0ll,                          //Count
+            OpCode::PUSH, 0ull,                         //@LOOP
+            OpCode::SYSCALL, SysCallCode::TRY_RECV,
+            OpCode::JUMPZ, 128ull,
+            OpCode::SLOAD, -24ll,
+            OpCode::ADD, DataType::I64,
+            OpCode::SSTORE, -16ll,
+            OpCode::PUSH, 1ll,
+            OpCode::ADD, DataType::I64,
+            OpCode::JUMP, 68ull,
+            OpCode::POP,                                //@END
+            OpCode::SLOAD, -16ll,
+            OpCode::PUSH, 1000ll,
+            OpCode::MUL, DataType::I64,
+            OpCode::ADD, DataType::I64,
+            OpCode::SYSCALL, SysCallCode::EXIT,
+            OpCode::PLOAD, 1u,                          //@BODY
+            OpCode::PLOAD, 0u,
+            OpCode::NEQ, DataType::I64,
+            OpCode::JUMPZ, 220ull,
+            OpCode::PLOAD, 1u,
+            OpCode::PUSH, 0ull,
+            OpCode::SYSCALL, SysCallCode::SEND,
+            OpCode::PUSH, 1ll,
+            OpCode::PLOAD, 1u,
+            OpCode::ADD, DataType::I64,
+            OpCode::PSTORE, 1u,
+            OpCode::JUMP, 153ull,
+            OpCode::RET);                               //@BODY_END
+    };
+
+    for (size_t workers : { 1, 3 })
+    {
+        for (vm_ui64 grain : { 7, 0, 1, 1000 })
+        {
+            Program chunked = program(0, 100, grain);
+            VM vm;
+            vm.SetWorkerCount(workers);
+            ASSERT(vm.Run(1024, chunked, {}) == 4950100);
+        }
+
+        Program negative = program(-50, 50, 9), empty = program(5, 5, 1), reversed = program(5, -5, 1);
+        VM vm;
+        vm.SetWorkerCount(workers);
+        ASSERT(vm.Run(1024, negative, {}) == -50 * 1000 + 100);
+        ASSERT(vm.Run(1024, empty, {}) == 0);
+        ASSERT(vm.Run(1024, reversed, {}) == 0);
+    }
+}
+
+DEFINE_TEST(ARENAS)
+{
+    //Arena memory is heap memory that MLOAD and MSTORE accept
+    Program program = Program::FromCode(
+        OpCode::PUSH, 16ull,
+        OpCode::SYSCALL, SysCallCode::ARENA,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 24ull,
+        OpCode::SYSCALL, SysCallCode::ARENA_ALLOC,
+        OpCode::PUSH, 40ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 0ll,
+        OpCode::PUSH, 2ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 16ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::MLOAD, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MLOAD, 16ll,
+        OpCode::ADD, DataType::I64,
+        OpCode::SLOAD, -24ll,
+        OpCode::SYSCALL, SysCallCode::ARENA_DESTROY,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    ASSERT(VM().Run(1024, program, {}) == 42);
+
+    //The arenas of an earlier run are gone once the next one starts
+    Program created = Program::FromCode(
+        OpCode::PUSH, 16ull,
+        OpCode::SYSCALL, SysCallCode::ARENA,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    VM vm;
+    vm_i64 first = vm.Run(1024, created, {});
+    ASSERT(vm.Run(1024, created, {}) != first);
+
+    Program destroyed = Program::FromCode(
+        OpCode::PUSH, 16ull,
+        OpCode::SYSCALL, SysCallCode::ARENA,
+        OpCode::SLOAD, -8ll,
+        OpCode::SYSCALL, SysCallCode::ARENA_DESTROY,
+        OpCode::SYSCALL, SysCallCode::ARENA_RESET,
+        OpCode::PUSH, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    try
+    {
+        VM().Run(1024, destroyed, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::INVALID_ARENA_ID);
+    }
+
+    //Sizes the heap cannot grow to fail the program instead of the vm
+    std::pair<vm_ui64, vm_ui64> tooBigSizes[] = {
+        { ~0ull - 0xFF, 8ull }, { 0x7FFFFFFFFFFFFFF0ull, 8ull },
+        { 16ull, 1ull << 62 }, { 16ull, 0x7FFFFFFFFFFFFFF0ull }, { 16ull, ~0ull } };
+
+    for (auto [capacity, amt] : tooBigSizes)
+    {
+        Program tooBig = Program::FromCode(
+            OpCode::PUSH, capacity,
+            OpCode::SYSCALL, SysCallCode::ARENA,
+            OpCode::PUSH, amt,
+            OpCode::SYSCALL, SysCallCode::ARENA_ALLOC,
+            OpCode::SYSCALL, SysCallCode::EXIT);
+
+        try
+        {
+            VM().Run(1024, tooBig, {});
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::OUT_OF_MEMORY);
+        }
+    }
+
+    //Only an arena frees its regions, so FREE cannot take one away from under it
+    Program freed = Program::FromCode(
+        OpCode::PUSH, 16ull,
+        OpCode::SYSCALL, SysCallCode::ARENA,
+        OpCode::SLOAD, -8ll,
+        OpCode::PUSH, 8ull,
+        OpCode::SYSCALL, SysCallCode::ARENA_ALLOC,
+        OpCode::SYSCALL, SysCallCode::FREE,
+        OpCode::SYSCALL, SysCallCode::ARENA_DESTROY,
+        OpCode::PUSH, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    try
+    {
+        VM().Run(1024, freed, {});
+        ASSERT(false);
+    }
+    catch (const VMError& e)
+    {
+        ASSERT(e.GetType() == VMErrorType::CANNOT_FREE_UNALLOCATED_PTR);
+    }
+
+    //Resets keep the newest region, which soon fits every allocation between two resets
+    Heap heap(nullptr);
+    {
+        Arena arena(&heap, 64);
+
+        for (int round = 0; round < 3; round++)
+        {
+            vm_byte* first = arena.Alloc(8);
+            for (int i = 0; i < 1000; i++)
+            {
+                vm_byte* addr = arena.Alloc(24);
+                ASSERT(addr >= first + 8 + i * 24 || arena.GetRegionCount() > 1);
+                ASSERT(heap.IsAddressRange(addr, addr + 23));
+            }
+
+            ASSERT(round < 2 || arena.GetRegionCount() == 1);
+            arena.Reset();
+            ASSERT(arena.GetRegionCount() == 1);
+        }
+
+        heap.AssertHeuristics();
+    }
+
+    ASSERT(heap.GetSize() == 0);
+}
+
+DEFINE_TEST(GARBAGE_COLLECTION)
+{
+    //Allocations are found from addresses anywhere inside them
+    Heap heap(nullptr);
+    vm_byte* big = heap.Alloc(300), * small = heap.Alloc(200);
+    ASSERT(heap.FindObject(big + 299)->start == big && heap.FindObject(big)->size >= 300);
+    ASSERT(heap.FindObject(small + 8)->start == small && !heap.FindObject(big - 8));
+
+    heap.Free(small);
+    ASSERT(!heap.FindObject(small) && !heap.FindObject(small + 8));
+
+    ASSERT(heap.Mark(big) && !heap.Mark(big));
+    ASSERT(heap.Sweep() == 0 && heap.Sweep() == 1 && heap.GetSize() == 0);
+
+    //B is only reachable through A while 20000 allocations that nothing points to are zeroed
+    Program program = Program::FromCode(
+        OpCode::PUSH, 8ull,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 7ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 0ll,
+        OpCode::PUSH, 8ull,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::SLOAD, -16ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 0ll,
+        OpCode::PUSH, 0ll,
+        OpCode::SSTORE, -16ll,
+        OpCode::PUSH, 20000ll,
+        OpCode::SLOAD, -8ll,                    //@LOOP
+        OpCode::JUMPZ, 198ull,
+        OpCode::PUSH, 64ull,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 0ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 0ll,
+        OpCode::POP,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 103ull,
+        OpCode::POP,                            //@END
+        OpCode::MLOAD, 0ll,
+        OpCode::MLOAD, 0ll,
+        OpCode::SYSCALL, SysCallCode::EXIT);
+
+    VM vm;
+    vm.SetCollectionThreshold(64 * 1024);
+    ASSERT(vm.Run(1024, program, {}) == 7);
+
+    const CollectionStats& stats = vm.GetCollector().GetStats();
+    ASSERT(stats.collections > 0 && stats.freedObjects > 1000 && stats.maxPause.count() > 0);
+    ASSERT(vm.GetHeap().GetSize() < 20000 * 64 / 4);
+}
+
+DEFINE_TEST(FUEL)
+{
+    //The main thread only gets its worker back from a thread that spins forever once the spinning thread's quantum runs out
+    Program program = Program::FromCode(
+        OpCode::PUSH, 34ull,
+        OpCode::PUSH, 0ull,
+        OpCode::SYSCALL, SysCallCode::SPAWN,
+        OpCode::POP,
+        OpCode::SYSCALL, SysCallCode::YIELD,
+        OpCode::PUSH, 7ll,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::JUMP, 34ull);                       //@SPIN
+
+    Program spin = Program::FromCode(
+        OpCode::NOOP,
+        OpCode::JUMP, 0ull);
+
+    for (DispatchMode mode : { DispatchMode::SWITCH, DispatchMode::CACHED, DispatchMode::JIT, DispatchMode::TIERED })
+    {
+        VM vm;
+        vm.SetDispatchMode(mode);
+        vm.SetWorkerCount(1);
+        vm.SetQuantum(1000);
+        ASSERT(vm.Run(1024, program, {}) == 7);
+
+        //Threads that are never preempted still burn the budget
+        for (vm_ui64 quantum : { 1000, 0 })
+        {
+            vm.SetQuantum(quantum);
+            vm.SetFuelBudget(1000000);
+
+            try
+            {
+                vm.Run(1024, spin, {});
+                ASSERT(false);
+            }
+            catch (const VMError& e)
+            {
+                ASSERT(e.GetType() == VMErrorType::OUT_OF_FUEL);
+            }
+        }
+    }
+
+#ifdef EVM_JIT
+    //A thread that is never preempted goes back to native code every time it refuels, which a loop that burns a few
+    //fuel in each of its 350000 iterations does more than a few times
+    Program loop = Program::FromCode(
+        OpCode::PUSH, 350000ll,
+        OpCode::SLOAD, -8ll,                    //@LOOP
+        OpCode::JUMPZ, 65ull,
+        OpCode::PUSH, 1ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::SUB, DataType::I64,
+        OpCode::SSTORE, -8ll,
+        OpCode::JUMP, 9ull,
+        OpCode::SYSCALL, SysCallCode::EXIT);    //@END
+
+    VM vm;
+    vm.SetDispatchMode(DispatchMode::JIT);
+    vm.SetQuantum(0);
+    ASSERT(vm.Run(1024, loop, {}) == 0);
+    ASSERT(vm.GetJIT()->GetEntryCount() > 5);
+#endif
+}
+
+DEFINE_TEST(TO_NASM)
+{
+    //Heap accesses, a call with a return value, float arithmetic and conversions
+    Program program = Program::FromCode(
+        OpCode::PUSH, 16ll,
+        OpCode::SYSCALL, SysCallCode::MALLOC,
+        OpCode::PUSH, 6ll,
+        OpCode::SLOAD, -16ll,
+        OpCode::MSTORE, 8ll,
+        OpCode::SLOAD, -8ll,
+        OpCode::MLOAD, 8ll,
+        OpCode::CALL, 82ull, 0u,
+        OpCode::SLOAD, -24ll,
+        OpCode::SYSCALL, SysCallCode::FREE,
+        OpCode::SYSCALL, SysCallCode::EXIT,
+        OpCode::PUSH, 2.0,
+        OpCode::PLOAD, 0u,
+        OpCode::PUSH, 7ll,
+        OpCode::MUL, DataType::I64,
+        OpCode::CONVERT, DataType::I64, DataType::F64,
+        OpCode::DIV, DataType::F64,
+        OpCode::CONVERT, DataType::F64, DataType::I32,
+        OpCode::CONVERT, DataType::I32, DataType::I64,
+        OpCode::RETV);
+
+    VM vm;
+    ASSERT(vm.Run(1024, program, {}) == 21);
+
+    std::stringstream nasm;
+    program.ToNASM(nasm);
+    std::string source = nasm.str();
+
+    for (auto expected : { "global\t\t_start", "jmp L0", "L82:", "jmp L82", "call evm_malloc", "call evm_free", "divsd", "cvttsd2si", "mov eax, 60", "evm_div_by_zero_msg:" })
+        ASSERT(source.find(expected) != std::string::npos);
+}
+
+DEFINE_TEST(PROFILER)
+{
+    Program program = FactorialProgram();
+
+    VM vm;
+    Profiler profiler(4);
+    vm.SetProfiler(&profiler);
+    ASSERT(vm.Run(64, program, {}) == 120);
+
+    //Superinstructions are counted as the instructions they are made of
+    ASSERT(profiler.GetCount({ OpCode::SLOAD, OpCode::PUSH, OpCode::EQ_UI64, OpCode::JUMPNZ }) == 5);
+    ASSERT(profiler.GetCount({ OpCode::SSTORE, OpCode::JUMP }) == 4);
+    ASSERT(profiler.GetCount({ OpCode::JUMP, OpCode::SLOAD }) == 0); //The jump is taken so they do not execute back to back
+    ASSERT(profiler.GetMostFrequent(4, 1).size() == 1);
+}
+#pragma endregion
+
+DEFINE_TEST(TEST_FILES)
+{
+    std::string dirPath = "tests/evm/";
+    std::ifstream expectedFile(dirPath + "expected.txt");
+    ASSERT(expectedFile.is_open());
+
+    //Skip Header
+    std::string line;
+    std::getline(expectedFile, line);
+    std::getline(expectedFile, line);
+
+    std::string caseName, expectedOutput;
+    vm_i64 expectedExitCode;
+
+    while (expectedFile >> caseName)
+    {
+        expectedFile >> expectedExitCode;
+
+        //Get expected output
+        std::getline(expectedFile, expectedOutput);
+        expectedOutput = expectedOutput.substr(expectedOutput.find_first_of('"') + 1);
+        expectedOutput = expectedOutput.substr(0, expectedOutput.find_last_of('"'));
+
+        std::string filePath = dirPath + std::string(caseName.begin(), caseName.end()) + ".edeasm";
+        Program program = Program::FromFile(filePath.c_str());
+
+        VM vm;
+        std::stringstream stdIO;
+        vm.SetStdIO(stdIO.rdbuf(), stdIO.rdbuf());
+
+        ASSERT_MSG(vm.Run(64, program, {}) == expectedExitCode, filePath);
+        ASSERT_MSG(stdIO.str() == expectedOutput, filePath);
+    }
+}
+
+DEFINE_TEST(TEST_HEAP)
+{
+    std::random_device randDev;
+    std::mt19937 randRng(randDev());
+    std::vector<vm_byte*> alives;
+    Heap heap(nullptr);
+
+    std::uniform_int_distribution<std::mt19937::result_type> boolGenerator(0, 2);
+    std::uniform_int_distribution<std::mt19937::result_type> sizeGenerator(1, 128);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        if (boolGenerator(randRng) > 0)
+        {
+            alives.push_back(heap.Alloc(sizeGenerator(randRng)));
+        }
+        else if (!alives.empty())
+        {
+            std::uniform_int_distribution<std::mt19937::result_type> aliveIdxPicker(0, alives.size() - 1);
+            auto pos = alives.begin() + aliveIdxPicker(randRng);
+            auto ptr = *pos;
+
+            heap.Free(ptr);
+            alives.erase(pos);
+        }
+
+        heap.AssertHeuristics();
+    }
+}
+
+DEFINE_TEST(HEAP_BLOCKS)
+{
+    //Allocations that are bigger than the free space left make the heap grow by blocks that are looked up by address
+    Heap heap(nullptr);
+    std::vector<vm_byte*> allocs;
+
+    for (vm_ui64 size = 512; size <= 512 * 1024; size *= 2)
+        allocs.push_back(heap.Alloc(size));
+
+    for (size_t i = 0; i < allocs.size(); i++)
+    {
+        vm_ui64 size = 512ull << i;
+        ASSERT(heap.IsAddress(allocs[i]) && heap.IsAllocated(allocs[i]));
+        ASSERT(heap.IsAddressRange(allocs[i], allocs[i] + size - 1));
+        ASSERT(!heap.IsAllocated(allocs[i] + 8));
+
+        try
+        {
+            heap.Free(allocs[i] + 8);
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::CANNOT_FREE_UNALLOCATED_PTR);
+        }
+    }
+
+    //Ranges cannot span blocks even where two happen to be next to each other
+    vm_byte* lowest = *std::min_element(allocs.begin(), allocs.end());
+    vm_byte* highest = *std::max_element(allocs.begin(), allocs.end());
+    ASSERT(!heap.IsAddress(lowest - 1));
+    ASSERT(!heap.IsAddressRange(lowest, highest + 1));
+    ASSERT(!heap.IsAddressRange(lowest - 8, lowest + 8));
+
+    for (vm_byte* alloc : allocs)
+    {
+        heap.Free(alloc);
+        heap.AssertHeuristics();
+        ASSERT(!heap.IsAllocated(alloc));
+    }
+
+    ASSERT(heap.GetSize() == 0 && !heap.IsAddress(lowest));
+}
+
+DEFINE_TEST(HEAP_TAGS)
+{
+    //Chunks that are freed merge with the free chunks on either side of them through their tags
+    Heap heap(nullptr);
+    vm_byte* a = heap.Alloc(24), * b = heap.Alloc(24), * c = heap.Alloc(24);
+    ASSERT(b == a + 40 && c == b + 40);
+
+    heap.Free(a);
+    heap.Free(c);
+    heap.Free(b);
+    heap.AssertHeuristics();
+    ASSERT(heap.GetSize() == 0);
+
+    auto expectCorrupted = [&](auto _action)
+    {
+        try
+        {
+            _action();
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::HEAP_CORRUPTED);
+        }
+    };
+
+    //Writing past the end of an allocation overwrites the tags of the next chunk
+    a = heap.Alloc(24), b = heap.Alloc(24), c = heap.Alloc(24);
+    std::fill(a, a + 40, 0xFF);
+    expectCorrupted([&]() { heap.Free(b); });
+
+    //Writing to a freed chunk overwrites the links of its bin
+    Heap other(nullptr);
+    a = other.Alloc(24), b = other.Alloc(24), c = other.Alloc(24);
+    other.Free(a);
+    std::fill(a, a + 16, 0xFF);
+    expectCorrupted([&]() { other.Alloc(24); });
+}
+
+DEFINE_TEST(HEAP_BEST_FIT)
+{
+    //Chunks of different sizes can share a bin, which still hands out the smallest one that fits
+    Heap heap(nullptr);
+    vm_byte* big = heap.Alloc(1350);
+    heap.Alloc(24);
+    vm_byte* small = heap.Alloc(1300);
+    heap.Alloc(24);
+
+    heap.Free(small);
+    heap.Free(big);
+    heap.AssertHeuristics();
+    ASSERT(heap.Alloc(1290) == small && heap.Alloc(1290) == big);
+}
+
+DEFINE_TEST(THREAD_CACHES)
+{
+    Heap heap(nullptr);
+    std::vector<vm_byte*> objects;
+
+    {
+        ThreadCache owner(&heap), other(&heap);
+
+        //The first allocation refills the cache with a slab that serves the rest
+        for (int i = 0; i < 64; i++)
+            objects.push_back(owner.Alloc(16));
+
+        ASSERT(owner.GetMisses() == 1 && owner.GetHits() == 63);
+        ASSERT(std::unordered_set<vm_byte*>(objects.begin(), objects.end()).size() == objects.size());
+        for (vm_byte* object : objects)
+            ASSERT(heap.IsAllocated(object) && heap.IsAddressRange(object, object + 15));
+
+        //Objects the thread frees are handed out again straight away
+        owner.Free(objects.back());
+        ASSERT(!heap.IsAllocated(objects.back()));
+        ASSERT(owner.Alloc(16) == objects.back() && owner.GetHits() == 64);
+
+        //Objects other threads free only come back once the slab runs out
+        for (vm_byte* object : objects)
+            other.Free(object);
+
+        ASSERT(other.GetHits() == 0 && other.GetMisses() == 0);
+        ASSERT(!heap.IsAllocated(objects.front()));
+
+        try
+        {
+            other.Free(objects.front());
+            ASSERT(false);
+        }
+        catch (const VMError& e)
+        {
+            ASSERT(e.GetType() == VMErrorType::CANNOT_FREE_UNALLOCATED_PTR);
+        }
+
+        std::vector<vm_byte*> rest;
+        for (vm_ui64 i = 0; i < HEAP_SLAB_SIZE / 16 - objects.size(); i++)
+            rest.push_back(owner.Alloc(9));
+
+        size_t heapSize = heap.GetSize();
+        vm_byte* reused = owner.Alloc(16);
+        ASSERT(std::find(objects.begin(), objects.end(), reused) != objects.end());
+        objects.insert(objects.end(), rest.begin(), rest.end());
+        ASSERT(owner.GetMisses() == 2 && heap.GetSize() == heapSize);
+
+        //Big allocations go to the heap
+        vm_byte* big = owner.Alloc(1024);
+        ASSERT(heap.IsAllocated(big));
+        owner.Free(big);
+        ASSERT(owner.GetMisses() == 2);
+
+        //Threads free each other's objects while they allocate
+        ThreadCache producer(&heap);
+        std::vector<vm_byte*> produced;
+        for (int i = 0; i < 1000; i++)
+            produced.push_back(producer.Alloc(8 + i % 200));
+
+        std::thread consumer([&]()
+            {
+                ThreadCache consumerCache(&heap);
+                for (vm_byte* object : produced)
+                    consumerCache.Free(object);
+            });
+
+        std::vector<vm_byte*> kept;
+        for (int i = 0; i < 1000; i++)
+            kept.push_back(producer.Alloc(8 + i % 200));
+
+        consumer.join();
+
+        for (vm_byte* object : kept)
+            producer.Free(object);
+
+        heap.AssertHeuristics();
+    }
+
+    ASSERT(heap.GetCacheMisses() > 2 && heap.GetCacheHits() > 64);
+
+    //Slabs that outlive their thread are released once their last object is freed
+    for (vm_byte* object : objects)
+    {
+        if (heap.IsAllocated(object))
+            heap.Free(object);
+    }
+
+    heap.AssertHeuristics();
+    ASSERT(heap.GetSize() == 0);
 }
\ No newline at end of file
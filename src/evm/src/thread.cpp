@@ -1,19 +1,26 @@
 #include "thread.h"
 #include <mutex>
+#include <chrono>
+#include <algorithm>
 #include <iostream>
 #include "program.h"
 #include "vm.h"
 #include "instructions.h"
+#include "profiler.h"
+#include "jit.h"
+#include "tiering.h"
+#include "scheduler.h"
 #include "../build.h"
 
-Thread::Thread(VM* _vm, ThreadID _id, vm_ui64 _stackSize, const vm_byte* _startIP)
-    : vm(_vm), instrPtr(_startIP), id(_id), stackPtr(0ull), framePtr(0ull), isAlive(false)
+Thread::Thread(VM* _vm, ThreadID _id, vm_ui64 _stackSize, const Instructions::Decoded* _code, const Instructions::Decoded* _startIP)
+    : vm(_vm), instrPtr(_startIP), id(_id), stackPtr(0ull), framePtr(0ull), code(_code), codeSize(_vm->program->GetDecoded().size()), heapCache(&_vm->GetHeap()), isAlive(false), yielding(false), fuel(_vm->GetRefuelAmount()),
+    exitValue(0), blocked(false), parked(false), joiners(), waitResult(), waitAddress(nullptr), waitEntry(), waitDeadline(), loop(), chunks(nullptr)
 {
     assert(_stackSize % WORD_SIZE == 0);
     stack = Memory(_stackSize);
 }
 
-void Thread::Start(const std::vector<Word>& _args)
+void Thread::Start(const std::vector<Word>& _args, bool _call)
 {
     isAlive = true;
 
@@ -21,43 +28,135 @@ void Thread::Start(const std::vector<Word>& _args)
     for (auto& arg : _args)
         PushStack(arg);
 
-    //Start thread
-    thread = std::thread([this]
+    //Returning to the index zero finishes the thread
+    if (_call)
+    {
+        PushStack((vm_ui64)0);
+        PushFrame();
+    }
+}
+
+bool Thread::Resume()
+{
+    if (!vm->EnterWorker(this))
+        return false;
+
+    try { Run(); }
+    catch (const VMError& e)
+    {
+        vm->Quit(e);
+        isAlive = false;
+    }
+
+    std::scoped_lock<std::mutex> lock(vm->mutex);
+
+    vm->onWorkers--;
+    if (vm->collecting)
+        vm->threadsChanged.notify_all();
+
+    //Blocked threads are parked until the thread they wait for wakes them
+    if (isAlive && vm->IsRunning())
+    {
+        yielding = false;
+        parked = blocked;
+
+        //Threads that yield while the heap is collected, or about to be, wait for the collection to finish
+        if (!blocked && (vm->collecting || vm->collectionRequested))
         {
-            try { this->Run(); }
-            catch (const VMError& e)
-            {
-                std::scoped_lock<std::mutex> lock(vm->mutex);
-                this->vm->Quit(e);
-            }
-
-            std::scoped_lock<std::mutex> lock(vm->mutex);
-            
+            vm->stopped.push_back(this);
+            return false;
+        }
+
+        return !blocked;
+    }
+
+    vm->fuelLeft -= vm->GetRefuelAmount() - fuel;
+
+    //Helpers of a parallel loop cannot be joined, the thread that runs the loop waits for them instead
+    if (chunks)
+    {
+        if (--chunks->running == 0)
+            chunks->caller->Wake();
+    }
+    else
+        vm->exitValues[id] = exitValue;
+
+    for (auto joiner : joiners)
+        joiner->Wake();
+    joiners.clear();
+
 #ifdef BUILD_DEBUG
-            if (PRINT_STACK_AFTER_THREAD_END)
-                PrintStack();
+    if (PRINT_STACK_AFTER_THREAD_END)
+        PrintStack();
 #endif
-            isAlive = false;
-        });
+    isAlive = false;
+    vm->finishedThreads.push_back(id);
+    vm->threadsChanged.notify_all();
+    return false; //The vm may destroy the thread as soon as the lock is released
 }
 
 void Thread::Run()
 {
-    while (vm->IsRunning() && isAlive)
+    Profiler* profiler = vm->GetProfiler(); //Profiling only hooks into this loop
+
+#ifdef EVM_THREADED_DISPATCH
+    if (vm->GetRunMode() == DispatchMode::THREADED && !profiler)
     {
-        std::scoped_lock<std::mutex> lock(vm->mutex); //Lock execution to a thread so that this finishes an instruction uninterrupted
+        Instructions::ExecuteThreaded(this);
+        return;
+    }
+#endif
 
-        vm_byte opcode = *instrPtr;
-        if (opcode >= (size_t)Instructions::OpCode::_COUNT)
-            throw VMError::UNKNOWN_OP_CODE(opcode);
+    if (vm->GetRunMode() == DispatchMode::CACHED && !profiler)
+    {
+        Instructions::ExecuteCached(this);
+        return;
+    }
+    else if (vm->GetRunMode() == DispatchMode::VERIFIED && !profiler)
+    {
+        Instructions::ExecuteVerified(this);
+        return;
+    }
+    else if (vm->GetRunMode() == DispatchMode::TIERED && !profiler)
+    {
+        vm->GetTiering()->Run(this);
+        return;
+    }
+
+#ifdef EVM_JIT
+    bool tracing = false;
+#ifdef BUILD_DEBUG
+    tracing = PRINT_INSTR_BEFORE_EXECUTION || PRINT_STACK_AFTER_INSTR_EXECUTION;
+#endif
+
+    //Compiled code returns once its fuel runs out or it reaches an instruction it has no code for. It is entered again
+    //at the next instruction that has code, since threads that are never preempted keep running after they refuel.
+    if (JIT* jit = vm->GetJIT(); jit && !profiler && !tracing)
+    {
+        while (IsRunning())
+        {
+            if (jit->GetNative(instrPtr))
+                jit->Run(this);
+            else
+                instrPtr = Instructions::Execute(instrPtr, this);
+        }
 
+        return;
+    }
+#endif
+
+    //Instructions only synchronize when they touch state that threads share, so threads run in parallel
+    while (IsRunning())
+    {
 #ifdef BUILD_DEBUG
         if (PRINT_INSTR_BEFORE_EXECUTION)
             std::cout << Instructions::ToString(instrPtr) << "\t(Thread ID: " << id << ")" << std::endl;
 #endif
 
-        Instructions::Execute(instrPtr, this);
-        instrPtr += Instructions::GetSize((Instructions::OpCode)opcode);
+        if (profiler)
+            profiler->Record(id, instrPtr);
+
+        instrPtr = Instructions::Execute(instrPtr, this);
 
 #ifdef BUILD_DEBUG
         if (PRINT_STACK_AFTER_INSTR_EXECUTION)
@@ -66,10 +165,191 @@ void Thread::Run()
     }
 }
 
-void Thread::Join()
+void Thread::Yield()
 {
+    yielding = true;
+}
+
+void Thread::Exit(vm_i64 _value)
+{
+    exitValue = _value;
     isAlive = false;
-    thread.join();
+}
+
+std::optional<vm_i64> Thread::Join(ThreadID _id)
+{
+    std::scoped_lock<std::mutex> lock(vm->mutex);
+
+    auto value = vm->exitValues.find(_id);
+    if (value != vm->exitValues.end())
+    {
+        vm_i64 result = value->second;
+        vm->exitValues.erase(value);
+        return result;
+    }
+
+    //Threads that were already joined are gone as well, or finished and only wait for the vm to destroy them.
+    //Helpers of a parallel loop never finish with an exit value.
+    auto thread = vm->threads.find(_id);
+    if (thread == vm->threads.end() || _id == id || thread->second.chunks
+        || std::find(vm->finishedThreads.begin(), vm->finishedThreads.end(), _id) != vm->finishedThreads.end())
+        throw VMError::INVALID_THREAD_ID(_id);
+
+    thread->second.joiners.push_back(this);
+    Block();
+    return std::nullopt;
+}
+
+std::optional<WaitResult> Thread::Wait(vm_byte* _address, vm_ui64 _expected, vm_i64 _timeout)
+{
+    std::scoped_lock<std::mutex> lock(vm->mutex);
+
+    if (waitResult)
+    {
+        WaitResult result = *waitResult;
+        waitResult.reset();
+        return result;
+    }
+
+    //Notifiers take the lock after they change the word, so none of them can be missed after this check
+    if (std::atomic_ref<vm_ui64>(*(vm_ui64*)_address).load(std::memory_order_acquire) != _expected)
+        return WaitResult::MISMATCH;
+
+    if (_timeout == 0)
+        return WaitResult::TIMED_OUT;
+
+    auto& queue = vm->waiters[_address];
+    waitAddress = _address;
+    waitEntry = queue.insert(queue.end(), this);
+
+    if (_timeout > 0)
+    {
+        //Timeouts that cannot pass while the program runs are clamped so that the deadline does not overflow
+        auto timeout = std::chrono::nanoseconds(std::min(_timeout, std::chrono::nanoseconds::max().count() / 2));
+        waitDeadline = vm->deadlines.emplace(std::chrono::steady_clock::now() + timeout, this);
+
+        //The vm sleeps until the earliest deadline
+        if (*waitDeadline == vm->deadlines.begin())
+            vm->threadsChanged.notify_all();
+    }
+
+    Block();
+    return std::nullopt;
+}
+
+void Thread::EndWait(WaitResult _result)
+{
+    if (waitDeadline)
+    {
+        vm->deadlines.erase(*waitDeadline);
+        waitDeadline.reset();
+    }
+
+    waitResult = _result;
+    Wake();
+}
+
+bool Thread::ParallelFor(const Instructions::Decoded* _body, vm_i64 _begin, vm_i64 _end, vm_ui64 _grain)
+{
+    std::scoped_lock<std::mutex> lock(vm->mutex);
+
+    //Runs again once the last helper finished
+    if (loop)
+    {
+        if (loop->running > 0)
+        {
+            Block();
+            return false;
+        }
+
+        loop.reset();
+        return true;
+    }
+
+    if (_end <= _begin)
+        return true;
+
+    vm_ui64 length = (vm_ui64)_end - (vm_ui64)_begin, workers = vm->scheduler->GetWorkerCount();
+    vm_ui64 grain = _grain ? _grain : std::max<vm_ui64>(length / (workers * 4), 1);
+
+    loop = std::make_unique<ParallelLoop>();
+    loop->body = _body;
+    loop->begin = _begin;
+    loop->end = _end;
+    loop->grain = grain;
+    loop->chunkCount = length / grain + (length % grain != 0);
+    loop->nextChunk = 0;
+    loop->running = 0;
+    loop->caller = this;
+
+    //The helpers take the chunks themselves so that the ones that finish early take over from the rest
+    vm_ui64 helperCount = std::min(loop->chunkCount, workers);
+    for (vm_ui64 i = 0; i < helperCount; i++)
+    {
+        auto id = vm->nextThreadID++;
+        Thread& helper = vm->threads.try_emplace(id, vm, id, stack.size(), code, _body).first->second;
+        helper.isAlive = true;
+        helper.chunks = loop.get();
+
+        //The helpers that already run may have taken every chunk
+        if (!helper.NextChunk())
+        {
+            vm->threads.erase(id);
+            break;
+        }
+
+        loop->running++;
+        vm->scheduler->Submit(&helper);
+    }
+
+    Block();
+    return false;
+}
+
+const Instructions::Decoded* Thread::NextChunk()
+{
+    if (!chunks)
+        return nullptr;
+
+    vm_ui64 chunk = chunks->nextChunk.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= chunks->chunkCount)
+        return nullptr;
+
+    vm_i64 begin = (vm_i64)((vm_ui64)chunks->begin + chunk * chunks->grain);
+    vm_i64 end = chunk + 1 == chunks->chunkCount ? chunks->end : (vm_i64)((vm_ui64)begin + chunks->grain);
+
+    //Every chunk starts in a fresh frame as if the body was called with the begin and the end
+    stackPtr = 0;
+    framePtr = 0;
+    Start({ begin, end }, true);
+    return instrPtr = chunks->body;
+}
+
+void Thread::Refuel()
+{
+    vm_i64 amount = vm->GetRefuelAmount(), burnt = amount - fuel;
+    if (vm->fuelBudget != 0 && vm->fuelLeft.fetch_sub(burnt, std::memory_order_relaxed) <= burnt)
+        throw VMError::OUT_OF_FUEL(vm->fuelBudget);
+
+    fuel = amount;
+    if (vm->quantum != 0)
+        Yield();
+}
+
+void Thread::Block()
+{
+    blocked = true;
+    yielding = true;
+}
+
+void Thread::Wake()
+{
+    blocked = false;
+    if (parked)
+    {
+        parked = false;
+        vm->scheduler->Submit(this);
+    }
 }
 
 void Thread::PrintStack()
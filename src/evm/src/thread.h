@@ -1,31 +1,115 @@
 #pragma once
 #include "evm.h"
-#include <thread>
+#include <atomic>
 #include <vector>
 #include <optional>
+#include <list>
+#include <map>
+#include <memory>
 #include "vm.h"
+#include "instructions.h"
+
+//How a wait on a heap word ended
+enum class WaitResult : vm_i64
+{
+    NOTIFIED,  // Another thread notified the word
+    MISMATCH,  // The word was not the expected value so the thread did not wait
+    TIMED_OUT, // The timeout passed first
+};
+
+//The chunks of a PARALLEL_FOR, which its helper threads take one after another until there are none left
+struct ParallelLoop
+{
+    const Instructions::Decoded* body;
+    vm_i64 begin, end;
+    vm_ui64 grain, chunkCount;
+    std::atomic<vm_ui64> nextChunk;
+    vm_ui64 running; //Guarded by the vm's mutex. The helpers that have not finished yet.
+    Thread* caller;
+};
 
 class Thread
 {
+    template <bool CHECKED> friend struct Instructions::StackCache;
+    friend class JIT;
+    friend class VM;
+    friend class Channel;
+
 private:
     VM* vm;
 
     Memory stack;
     vm_ui64 stackPtr, framePtr;
+    const Instructions::Decoded* code; //The start of the decoded instructions that branch targets index into
+    vm_ui64 codeSize;                  //The number of decoded instructions, which return addresses are checked against
+    ThreadCache heapCache;
 
-    std::thread thread;
     ThreadID id;
-    bool isAlive;
+    std::atomic<bool> isAlive;
+    std::atomic<bool> yielding; //Set to give up the worker after the current instruction
+    vm_i64 fuel;                //What is left of the thread's quantum. Refueling yields the worker.
+
+    //Guarded by the vm's mutex
+    vm_i64 exitValue;
+    bool blocked;                 //Waiting for another thread and only queued again once it wakes this one
+    bool parked;                  //Blocked and off the worker, so waking it has to queue it again
+    std::vector<Thread*> joiners; //The threads blocked on joining this one
+    std::optional<WaitResult> waitResult; //Set once a wait ends until the thread executes the wait again to take it
+    vm_byte* waitAddress;
+    std::list<Thread*>::iterator waitEntry;
+    std::optional<std::multimap<Deadline, Thread*>::iterator> waitDeadline;
+    std::unique_ptr<ParallelLoop> loop; //The parallel loop the thread is blocked on
+    ParallelLoop* chunks;               //The parallel loop the thread helps with
+
+    void Refuel();
+    void Block();
+    void Wake();
+    void EndWait(WaitResult _result);
 
 public:
-    const vm_byte* instrPtr;
+    const Instructions::Decoded* instrPtr;
 
-    Thread(VM* _vm, ThreadID _id, vm_ui64 _stackSize, const vm_byte* _startIP);
+    Thread(VM* _vm, ThreadID _id, vm_ui64 _stackSize, const Instructions::Decoded* _code, const Instructions::Decoded* _startIP);
 
-    void Start(const std::vector<Word>& _args);
-    void Join();
+    //Pushes the args onto the stack of a new thread before it is queued to run. A thread that is called starts in
+    //a frame with no return address and finishes once it returns from it.
+    void Start(const std::vector<Word>& _args, bool _call = false);
+
+    //Runs the thread on the calling worker until it finishes or yields. Returns whether it yielded.
+    bool Resume();
     void Run();
 
+    //Makes the thread give up its worker once the instruction it is executing finishes
+    void Yield();
+
+    //Takes fuel from the thread's quantum and yields once it runs out. Throws OUT_OF_FUEL once the vm's budget does.
+    void BurnFuel(vm_i64 _amount)
+    {
+        if ((fuel -= _amount) <= 0)
+            Refuel();
+    }
+
+    //Finishes the thread once the instruction it is executing finishes
+    void Exit(vm_i64 _value);
+
+    //Returns the exit value of a finished thread, which only one thread can take. Returns nothing when it is still
+    //running, in which case the calling thread is blocked until it finishes and has to join it again.
+    std::optional<vm_i64> Join(ThreadID _id);
+
+    //Blocks the thread until the aligned heap word is notified if it holds the expected value, or until the timeout
+    //in nanoseconds passes unless it is negative. Returns nothing once it blocks, in which case the thread has to
+    //wait again to get how the wait ended.
+    std::optional<WaitResult> Wait(vm_byte* _address, vm_ui64 _expected, vm_i64 _timeout);
+
+    //Calls the body for every chunk of [_begin, _end) that is _grain long on helper threads and blocks the thread
+    //until every call returned. A grain of zero splits the range into a few chunks for every worker. Returns false
+    //once it blocks, in which case the thread has to run the loop again once it wakes.
+    bool ParallelFor(const Instructions::Decoded* _body, vm_i64 _begin, vm_i64 _end, vm_ui64 _grain);
+
+    //Calls the body of the parallel loop the thread helps with for the next chunk and returns the instruction to
+    //continue at. Returns null once there are no chunks left or the thread does not help with one.
+    const Instructions::Decoded* NextChunk();
+
     void PushFrame();
     void PopFrame();
 
@@ -35,9 +119,13 @@ public:
     VM* GetVM() { return vm; }
     ThreadID GetID() { return id; }
     bool IsAlive() { return isAlive; }
+    bool IsRunning() { return vm->IsRunning() && isAlive && !yielding; } //Whether the thread should execute its next instruction
     vm_ui64 GetSP() { return stackPtr; }
     vm_ui64 GetFP() { return framePtr; }
+    const Instructions::Decoded* GetCode() { return code; }
+    vm_ui64 GetCodeSize() { return codeSize; }
     const Memory& GetStack() { return stack; }
+    ThreadCache& GetHeapCache() { return heapCache; }
 
     template <typename T>
     T ReadStack(vm_i64 _pos)
@@ -61,6 +149,15 @@ public:
         *(T*)&stack[_pos] = _value;
     }
 
+    //Returns the word on the top of the stack so that it can be modified in place
+    Word& PeekStack()
+    {
+        if (stackPtr < WORD_SIZE)
+            throw VMError::STACK_UNDERFLOW();
+
+        return *(Word*)&stack[stackPtr - WORD_SIZE];
+    }
+
     void PushStack(Word _value);
     Word PopStack();
 };
@@ -0,0 +1,182 @@
+#include "tiering.h"
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include "thread.h"
+#include "vm.h"
+#include "jit.h"
+#include "../build.h"
+
+using namespace Instructions;
+
+Tiering::Tiering(const std::vector<Decoded>& _decoded, vm_ui32 _fuseThreshold, vm_ui32 _compileThreshold)
+    : code(_decoded), counts(_decoded.size()), tiers(_decoded.size()), compiled(_decoded.size(), false),
+    jits(), latest(nullptr), fuseThreshold(_fuseThreshold), compileThreshold(_compileThreshold)
+{
+    //Every instruction starts out on the cheapest tier
+    for (auto& tier : tiers)
+        tier = Tier::INTERPRETED;
+
+    for (auto& instr : code)
+    {
+        OpCode opcode = GetSequence(instr.opcode)[0];
+        if (opcode != instr.opcode)
+        {
+            instr.opcode = opcode;
+#ifdef EVM_THREADED_DISPATCH
+            instr.handler = GetThreadedHandler(opcode);
+#endif
+        }
+    }
+}
+
+Tiering::~Tiering()
+{
+}
+
+//Returns the sorted indices of the instructions that are reachable from the instruction without following calls or returns
+std::vector<vm_ui64> Tiering::GetRegion(vm_ui64 _idx) const
+{
+    std::vector<bool> visited(code.size(), false);
+    std::vector<vm_ui64> pending = { _idx }, region;
+
+    while (!pending.empty())
+    {
+        vm_ui64 idx = pending.back();
+        pending.pop_back();
+
+        if (idx >= code.size() || visited[idx])
+            continue;
+
+        visited[idx] = true;
+        region.push_back(idx);
+
+        const Decoded& instr = code[idx];
+        switch (GetSequence(instr.opcode)[0])
+        {
+        case OpCode::JUMP: pending.push_back(instr.target); break;
+        case OpCode::JUMPZ:
+        case OpCode::JUMPNZ: pending.push_back(instr.target); pending.push_back(idx + 1); break;
+        case OpCode::RET:
+        case OpCode::RETV:
+        case OpCode::INVALID: break;
+        default: pending.push_back(idx + 1); break; //Calls continue after the call
+        }
+    }
+
+    std::sort(region.begin(), region.end());
+    return region;
+}
+
+//Other threads may be running the region meanwhile. Heads are published atomically so that they see each one
+//either before or after it is fused, which both execute the same way since fusing keeps the instructions of a
+//sequence in place.
+void Tiering::Fuse(const std::vector<vm_ui64>& _region)
+{
+    for (size_t i = 0; i < _region.size();)
+    {
+        //Sequences can only be fused from instructions that are all in the region
+        size_t run = 1;
+        while (i + run < _region.size() && _region[i + run] == _region[i] + run)
+            run++;
+
+        Decoded& instr = code[_region[i]];
+        OpCode fused = Instructions::Fuse(&instr, run);
+
+        if (fused != instr.opcode)
+        {
+#ifdef EVM_THREADED_DISPATCH
+            std::atomic_ref(instr.handler).store(GetThreadedHandler(fused), std::memory_order_relaxed);
+#endif
+            std::atomic_ref(instr.opcode).store(fused, std::memory_order_relaxed);
+        }
+
+        i += std::min(GetSequence(fused).size(), run);
+    }
+
+    for (auto idx : _region)
+        tiers[idx] = std::max(tiers[idx].load(), Tier::FUSED);
+}
+
+void Tiering::Compile(const std::vector<vm_ui64>& _region)
+{
+    for (auto idx : _region)
+    {
+        compiled[idx] = true;
+        tiers[idx] = Tier::NATIVE;
+    }
+
+#ifdef EVM_JIT
+    //Every compilation includes the code of the ones before it so that compiled regions can branch to each other
+    jits.push_back(std::make_unique<JIT>(code, compiled));
+    latest = jits.back().get();
+#endif
+}
+
+void Tiering::Count(const Decoded* _instr)
+{
+    auto idx = vm_ui64(_instr - code.data());
+    if (idx >= code.size())
+        return;
+
+    //Only the executions that cross a threshold wait for the other threads
+    vm_ui32 count = counts[idx].fetch_add(1, std::memory_order_relaxed) + 1;
+    if (count != fuseThreshold && count != compileThreshold)
+        return;
+
+    std::scoped_lock<std::mutex> lock(mutex);
+    if (tiers[idx] == Tier::NATIVE)
+        return;
+
+    if (count >= fuseThreshold && tiers[idx] < Tier::FUSED)
+        Fuse(GetRegion(idx));
+
+    if (count >= compileThreshold)
+        Compile(GetRegion(idx));
+}
+
+void Tiering::Run(Thread* _thread)
+{
+    const Decoded*& ip = _thread->instrPtr;
+    bool tracing = false;
+
+#ifdef BUILD_DEBUG
+    tracing = PRINT_INSTR_BEFORE_EXECUTION || PRINT_STACK_AFTER_INSTR_EXECUTION;
+#endif
+
+    while (_thread->IsRunning())
+    {
+#ifdef EVM_JIT
+        //Entering native code at a loop header replaces the loop while it is running
+        JIT* jit = latest;
+        if (jit && !tracing && jit->GetNative(ip))
+        {
+            jit->Run(_thread);
+
+            //Compiled code only returns early when it reaches code that is not compiled yet
+            if (_thread->IsRunning())
+                Count(ip);
+
+            continue;
+        }
+#endif
+
+#ifdef BUILD_DEBUG
+        if (PRINT_INSTR_BEFORE_EXECUTION)
+            std::cout << Instructions::ToString(ip) << "\t(Thread ID: " << _thread->GetID() << ")" << std::endl;
+#endif
+
+        const Decoded* instr = ip;
+        ip = Execute(instr, _thread);
+
+        //Count functions at their calls and loops at their backward branches
+        OpCode last = GetSequence(LoadOpCode(instr)).back();
+        if (last == OpCode::CALL || (ip <= instr && (last == OpCode::JUMP || last == OpCode::JUMPZ || last == OpCode::JUMPNZ)))
+            Count(ip);
+
+#ifdef BUILD_DEBUG
+        if (PRINT_STACK_AFTER_INSTR_EXECUTION)
+            _thread->PrintStack();
+#endif
+    }
+}
\ No newline at end of file
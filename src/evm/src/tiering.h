@@ -0,0 +1,58 @@
+#pragma once
+#include "evm.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "instructions.h"
+
+class Thread;
+class JIT;
+
+//Runs a copy of a program's decoded instructions that starts out unfused and promotes the code that gets hot
+//to faster tiers. Every call target and backward branch target counts its executions. Once the count of one
+//crosses a threshold, the code reachable from it without following calls or returns is fused into
+//superinstructions, and once it crosses a higher one that code is compiled to native code. Both tiers share
+//the interpreter's stack layout, so a running loop switches to them the next time it reaches its header.
+class Tiering
+{
+public:
+    enum class Tier : vm_byte
+    {
+        INTERPRETED, // Decoded instructions without superinstructions
+        FUSED,       // Decoded instructions with superinstructions
+        NATIVE,      // Native code compiled by the JIT; the same as FUSED where EVM_JIT is not defined
+    };
+
+    static constexpr vm_ui32 DEFAULT_FUSE_THRESHOLD = 64;
+    static constexpr vm_ui32 DEFAULT_COMPILE_THRESHOLD = 4096;
+
+private:
+    std::vector<Instructions::Decoded> code;
+    std::vector<std::atomic<vm_ui32>> counts; //The executions of every call target and backward branch target
+    std::vector<std::atomic<Tier>> tiers;     //The tier of every instruction, which tests read while threads promote it
+    std::vector<bool> compiled;
+    std::vector<std::unique_ptr<JIT>> jits;   //Only the last one is entered but threads may still be running the others
+    std::atomic<JIT*> latest;                 //The last of the jits, which threads read without locking
+    vm_ui32 fuseThreshold, compileThreshold;
+    std::mutex mutex;                         //Guards promotions, which threads may cross thresholds for at the same time
+
+    std::vector<vm_ui64> GetRegion(vm_ui64 _idx) const;
+    void Fuse(const std::vector<vm_ui64>& _region);
+    void Compile(const std::vector<vm_ui64>& _region);
+
+public:
+    Tiering(const std::vector<Instructions::Decoded>& _decoded, vm_ui32 _fuseThreshold, vm_ui32 _compileThreshold);
+    ~Tiering();
+
+    //Runs the thread until it dies or the vm stops
+    void Run(Thread* _thread);
+
+    //Counts an execution of the instruction and promotes the code reachable from it once it is hot
+    void Count(const Instructions::Decoded* _instr);
+
+    const Instructions::Decoded* GetCode() const { return code.data(); }
+    size_t GetCodeSize() const { return code.size(); }
+    Tier GetTier(const Instructions::Decoded* _instr) const { return tiers[_instr - code.data()].load(); }
+    size_t GetCompilationCount() const { return jits.size(); }
+};
\ No newline at end of file
@@ -1,11 +1,22 @@
 #include "vm.h"
 #include "thread.h"
 #include "instructions.h"
+#include "jit.h"
+#include "tiering.h"
+#include "scheduler.h"
 #include "../build.h"
 #include <iostream>
 
+#ifdef EVM_THREADED_DISPATCH
+DispatchMode VM::defaultDispatchMode = DispatchMode::THREADED;
+#else
+DispatchMode VM::defaultDispatchMode = DispatchMode::SWITCH;
+#endif
+
 VM::VM()
-    : heap(this), threads(), running(false), nextThreadID(0), exitCode(0), stdInput(std::cin.rdbuf()), stdOutput(std::cout.rdbuf()) {}
+    : heap(this), threads(), finishedThreads(), exitValues(), waiters(), deadlines(), channels(), arenas(&heap), running(false), nextThreadID(0), exitCode(0), stdInput(std::cin.rdbuf()), stdOutput(std::cout.rdbuf()), program(nullptr), code(nullptr), profiler(nullptr),
+    jit(), tiering(), fuseThreshold(Tiering::DEFAULT_FUSE_THRESHOLD), compileThreshold(Tiering::DEFAULT_COMPILE_THRESHOLD), threadCount(1), scheduler(), workerCount(0), quantum(DEFAULT_QUANTUM), fuelBudget(0), fuelLeft(0),
+    collector(this), collectionThreshold(0), allocated(0), nextCollection(0), collectionRequested(false), collecting(false), onWorkers(0), stopped(), dispatchMode(defaultDispatchMode), runMode(defaultDispatchMode) {}
 
 VM::~VM()
 {
@@ -13,7 +24,43 @@ VM::~VM()
 
 vm_i64 VM::Run(vm_ui64 _stackSize, Program& _prog, const std::vector<std::string> &_cmdLineArgs)
 {
+    //Programs built up by hand have not been decoded yet
+    if (!_prog.IsDecoded())
+    {
+        _prog.Decode();
+        _prog.Fuse();
+    }
+
+    program = &_prog;
+    code = _prog.GetDecoded().data();
+
+    //A verified program never leaves the stack that verification sized for it, so its bounds need no checks as long as
+    //the stack it gets is at least that big. Programs that could not be verified run with the checks of CACHED.
+    runMode = dispatchMode;
+    if (dispatchMode == DispatchMode::VERIFIED)
+    {
+        if (!_prog.GetVerification().verified)
+            runMode = DispatchMode::CACHED;
+        else if (_prog.GetVerification().maxStackSize > _stackSize)
+            throw VMError::STACK_OVERFLOW();
+    }
+
+#ifdef EVM_JIT
+    //Compiled code points into the decoded instructions so it is compiled again for every run
+    jit = dispatchMode == DispatchMode::JIT ? std::make_unique<JIT>(_prog.GetDecoded()) : nullptr;
+#endif
+
+    //Tiers promote code by changing it, so they run a copy of the decoded instructions
+    tiering = dispatchMode == DispatchMode::TIERED ? std::make_unique<Tiering>(_prog.GetDecoded(), fuseThreshold, compileThreshold) : nullptr;
+    if (tiering)
+        code = tiering->GetCode();
+
+    auto entry = code + (_prog.GetEntry() - _prog.GetDecoded().data());
+
     running = true;
+    fuelLeft = (vm_i64)std::min<vm_ui64>(fuelBudget, INT64_MAX);
+    allocated = 0;
+    nextCollection = collectionThreshold;
 
     // Store command line arguments
     auto argsArraySize = (vm_ui64)_cmdLineArgs.size();
@@ -33,39 +80,58 @@ vm_i64 VM::Run(vm_ui64 _stackSize, Program& _prog, const std::vector<std::string
         std::copy(arg.begin(), arg.end(), argPtr + WORD_SIZE);                   //store string chars
     }
 
-    //Start main thread
-    SpawnThread(_stackSize, _prog.GetEntryPtr(), {argsArrayPtr});
+    //Start main threads
+    scheduler = std::make_unique<Scheduler>(this, workerCount ? workerCount : Scheduler::GetDefaultWorkerCount());
+
+    for (vm_ui64 i = 0; i < threadCount; i++)
+        SpawnThread(_stackSize, entry, {argsArrayPtr});
 
-    //Manage threads
-    while (threads.size() != 0)
+    scheduler->Start();
+
+    //Sleep until a thread finishes or the vm quits
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!threads.empty())
     {
+        //Waits that time out are woken from here, so the vm also wakes up for the earliest deadline
+        if (deadlines.empty())
+            threadsChanged.wait(lock, [this] { return !running || !finishedThreads.empty() || !deadlines.empty() || collectionRequested; });
+        else
+        {
+            Deadline until = deadlines.begin()->first;
+            threadsChanged.wait_until(lock, until, [&] { return !running || !finishedThreads.empty() || deadlines.begin()->first < until || collectionRequested; });
+        }
+
         if (!running)
         {
-            for (auto &[_, thread] : threads)
-                thread.Join();
+            //Threads may need the lock to notice that the vm quit
+            lock.unlock();
+            scheduler->Stop();
+            lock.lock();
 
             threads.clear();
             break;
         }
 
-        mutex.lock();
+        if (collectionRequested)
+            Collect(lock);
 
-        std::vector<ThreadID> deadThreads;
-        for (auto &[id, thread] : threads)
-        {
-            if (!thread.IsAlive())
-            {
-                thread.Join(); //Even though the thread is dead, we have to call this so that the cpp thread object is destroyed
-                deadThreads.push_back(id);
-            }
-        }
+        ExpireWaits();
 
-        for (auto id : deadThreads)
+        for (auto id : finishedThreads)
             threads.erase(id);
 
-        mutex.unlock();
+        finishedThreads.clear();
     }
 
+    finishedThreads.clear();
+    exitValues.clear();
+    waiters.clear();
+    deadlines.clear();
+    lock.unlock();
+    channels.Clear();
+    arenas.Clear();
+    scheduler.reset();
+
     running = false;
 
 #ifdef BUILD_DEBUG
@@ -82,21 +148,25 @@ vm_i64 VM::Run(vm_ui64 _stackSize, Program& _prog, const std::vector<std::string
 
 void VM::Quit(VMExitCode _code)
 {
+    std::scoped_lock<std::mutex> lock(mutex);
     if (!running)
         return;
 
     exitCode = _code;
     running = false;
+    threadsChanged.notify_all();
 }
 
-ThreadID VM::SpawnThread(vm_ui64 _stackSize, const vm_byte *_startIP, const std::vector<Word> &_args)
+ThreadID VM::SpawnThread(vm_ui64 _stackSize, const Instructions::Decoded *_startIP, const std::vector<Word> &_args, bool _call)
 {
+    std::scoped_lock<std::mutex> lock(mutex);
     if (!running)
         throw VMError::CANNOT_SPAWN_THREAD();
 
     auto id = nextThreadID++;
-    threads.emplace(id, Thread(this, id, _stackSize, _startIP));
-    threads.at(id).Start(_args);
+    Thread& thread = threads.try_emplace(id, this, id, _stackSize, code, _startIP).first->second;
+    thread.Start(_args, _call);
+    scheduler->Submit(&thread);
     return id;
 }
 
@@ -109,6 +179,118 @@ Thread &VM::GetThread(ThreadID _id)
     return idSearch->second;
 }
 
+vm_ui64 VM::Notify(vm_byte* _address, vm_ui64 _count)
+{
+    std::scoped_lock<std::mutex> lock(mutex);
+
+    auto search = waiters.find(_address);
+    if (search == waiters.end())
+        return 0;
+
+    vm_ui64 woken = 0;
+    auto& queue = search->second;
+
+    for (; woken < _count && !queue.empty(); woken++)
+    {
+        Thread* thread = queue.front();
+        queue.pop_front();
+        thread->EndWait(WaitResult::NOTIFIED);
+    }
+
+    if (queue.empty())
+        waiters.erase(search);
+
+    return woken;
+}
+
+bool VM::EnterWorker(Thread* _thread)
+{
+    //Either the thread sees that a collection started or the collection waits for the thread to leave its worker
+    onWorkers++;
+    if (!collecting)
+        return true;
+
+    std::scoped_lock<std::mutex> lock(mutex);
+    if (collecting)
+    {
+        onWorkers--;
+        stopped.push_back(_thread);
+        threadsChanged.notify_all();
+        return false;
+    }
+
+    return true;
+}
+
+void VM::RequestCollection()
+{
+    if (collectionRequested.exchange(true))
+        return;
+
+    std::scoped_lock<std::mutex> lock(mutex);
+    threadsChanged.notify_all();
+}
+
+void VM::Collect(std::unique_lock<std::mutex>& _lock)
+{
+    //Threads leave their workers after the instruction they are executing
+    collecting = true;
+    for (auto& [id, thread] : threads)
+        thread.yielding = true;
+
+    threadsChanged.wait(_lock, [this] { return !running || onWorkers == 0; });
+
+    if (running)
+    {
+        try { collector.Collect(); }
+        catch (const VMError& e)
+        {
+            exitCode = e;
+            running = false;
+        }
+
+        allocated = 0;
+        nextCollection = std::max<size_t>(collectionThreshold, collector.GetStats().liveBytes);
+    }
+
+    for (auto& [id, thread] : threads)
+        thread.yielding = false;
+
+    collecting = false;
+    collectionRequested = false;
+
+    for (Thread* thread : stopped)
+        scheduler->Submit(thread);
+
+    stopped.clear();
+}
+
+void VM::ExpireWaits()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    while (!deadlines.empty() && deadlines.begin()->first <= now)
+    {
+        Thread* thread = deadlines.begin()->second;
+
+        auto search = waiters.find(thread->waitAddress);
+        search->second.erase(thread->waitEntry);
+        if (search->second.empty())
+            waiters.erase(search);
+
+        thread->EndWait(WaitResult::TIMED_OUT);
+    }
+}
+
+const Instructions::Decoded* VM::GetInstruction(vm_ui64 _address)
+{
+    auto idx = program->GetIndex(_address);
+    if (!idx)
+        throw VMError::INVALID_CODE_ADDRESS(_address);
+
+    return code + *idx;
+}
+
 void VM::SetStdIO(std::streambuf *_in, std::streambuf *_out)
 {
     stdInput.rdbuf(_in ? _in : std::cin.rdbuf());
@@ -1,13 +1,28 @@
 #pragma once
 #include "evm.h"
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <list>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
 #include <variant>
 #include "program.h"
 #include "heap.h"
+#include "instructions.h"
+#include "channel.h"
+#include "arena.h"
+#include "gc.h"
 
 class Thread;
+class Profiler;
+class JIT;
+class Tiering;
+class Scheduler;
 typedef vm_ui64 ThreadID;
+typedef std::chrono::steady_clock::time_point Deadline;
 
 enum class VMErrorType
 {
@@ -22,6 +37,14 @@ enum class VMErrorType
     INVALID_THREAD_ID,           // A thread with that id either has never been created or has already died
     CANNOT_FREE_UNALLOCATED_PTR, // Cannot free an unallocated memory pointer
     INVALID_MEM_ACCESS,          // Invalid access to memory
+    INVALID_CODE_ADDRESS,        // A code address does not point at an instruction
+    UNALIGNED_MEM_ACCESS,        // An atomic access of memory that is not aligned to a word
+    INVALID_CHANNEL_ID,          // A channel with that id has never been created
+    INVALID_CHANNEL_CAPACITY,    // Channels have to hold at least one word and at most MAX_CHANNEL_CAPACITY
+    OUT_OF_FUEL,                 // The threads used up the fuel budget of the vm
+    HEAP_CORRUPTED,              // The tags or links of a heap chunk were overwritten
+    INVALID_ARENA_ID,            // An arena with that id either has never been created or has already been destroyed
+    OUT_OF_MEMORY,               // The heap cannot grow to fit an allocation
     _COUNT
 };
 
@@ -46,10 +69,28 @@ public:
     static VMError INVALID_THREAD_ID(ThreadID _id) { return VMError(VMErrorType::INVALID_THREAD_ID, "A thread with id [" + std::to_string(_id) + "] does not exist or has already died!"); }
     static VMError CANNOT_FREE_UNALLOCATED_PTR(vm_byte *_ptr) { return VMError(VMErrorType::CANNOT_FREE_UNALLOCATED_PTR, "Cannot free unallocated memory pointer: " + PtrToStr(_ptr)); }
     static VMError INVALID_MEM_ACCESS(vm_byte *_start, vm_byte* _end) { return VMError(VMErrorType::INVALID_MEM_ACCESS, "An address in the range " + PtrToStr(_start) + " : " + PtrToStr(_end) + " is not accessable!"); }
+    static VMError UNALIGNED_MEM_ACCESS(vm_byte* _addr) { return VMError(VMErrorType::UNALIGNED_MEM_ACCESS, "The address " + PtrToStr(_addr) + " is not aligned for an atomic access!"); }
+    static VMError INVALID_CHANNEL_ID(vm_ui64 _id) { return VMError(VMErrorType::INVALID_CHANNEL_ID, "A channel with id [" + std::to_string(_id) + "] does not exist!"); }
+    static VMError INVALID_CHANNEL_CAPACITY() { return VMError(VMErrorType::INVALID_CHANNEL_CAPACITY, "A channel needs a capacity of at least one word and at most " + std::to_string(MAX_CHANNEL_CAPACITY) + " words!"); }
+    static VMError OUT_OF_FUEL(vm_ui64 _budget) { return VMError(VMErrorType::OUT_OF_FUEL, "The program used up its fuel budget of [" + std::to_string(_budget) + "]!"); }
+    static VMError HEAP_CORRUPTED(vm_byte* _chunk) { return VMError(VMErrorType::HEAP_CORRUPTED, "The heap chunk at " + PtrToStr(_chunk) + " has been overwritten!"); }
+    static VMError INVALID_ARENA_ID(vm_ui64 _id) { return VMError(VMErrorType::INVALID_ARENA_ID, "An arena with id [" + std::to_string(_id) + "] does not exist or has already been destroyed!"); }
+    static VMError OUT_OF_MEMORY(vm_ui64 _amt) { return VMError(VMErrorType::OUT_OF_MEMORY, "The heap cannot fit an allocation of [" + std::to_string(_amt) + "] bytes!"); }
+    static VMError INVALID_CODE_ADDRESS(vm_ui64 _address) { return VMError(VMErrorType::INVALID_CODE_ADDRESS, "The code address [" + std::to_string(_address) + "] does not point at an instruction!"); }
 };
 
 typedef std::variant<VMError, vm_i64> VMExitCode;
 
+enum class DispatchMode
+{
+    SWITCH,   // Every instruction goes through a single switch on its op code
+    THREADED, // Every instruction handler jumps directly to the handler of the next instruction
+    CACHED,   // Like SWITCH but the stack pointer and the top of the stack are kept in registers
+    VERIFIED, // Like CACHED but without checking the bounds of the stack; only runs programs that passed verification
+    JIT,      // Runs x86-64 machine code compiled from the decoded instructions; the same as SWITCH where EVM_JIT is not defined
+    TIERED,   // Starts like SWITCH without superinstructions and promotes hot functions and loops to superinstructions and then to native code
+};
+
 struct DebuggerInfo
 {
     bool enabled;
@@ -60,20 +101,67 @@ struct DebuggerInfo
 
 class VM
 {
+    friend class JIT;
+    friend class Thread;
+    friend class Collector;
+
 private:
+    static DispatchMode defaultDispatchMode;
+
     Heap heap;
 
     std::map<ThreadID, Thread> threads;
+    std::vector<ThreadID> finishedThreads;  //Threads that have finished running but have not been reaped yet
+    std::unordered_map<ThreadID, vm_i64> exitValues; //The exit values of finished threads until they are joined
+    std::condition_variable threadsChanged; //Notified when a thread finishes, a wait gets an earlier deadline or the vm quits
+    std::unordered_map<vm_byte*, std::list<Thread*>> waiters; //The threads waiting on every heap word in the order they started to
+    std::multimap<Deadline, Thread*> deadlines;               //The waits that time out, which Run wakes
+    ChannelTable channels;
+    ArenaTable arenas;
     ThreadID nextThreadID;
     VMExitCode exitCode;
     std::istream stdInput;
     std::ostream stdOutput;
     vm_byte* globalsArrayPtr;
-
-    bool running;
+    const Program* program;
+    const Instructions::Decoded* code;
+    DispatchMode dispatchMode;
+    DispatchMode runMode; //The dispatch mode of the current run, which only differs for programs that VERIFIED cannot run
+    Profiler* profiler;
+    std::unique_ptr<JIT> jit;
+    std::unique_ptr<Tiering> tiering;
+    vm_ui32 fuseThreshold, compileThreshold;
+    vm_ui64 threadCount;
+    std::unique_ptr<Scheduler> scheduler;
+    size_t workerCount;
+    vm_ui64 quantum, fuelBudget;
+    std::atomic<vm_i64> fuelLeft;
+
+    Collector collector;
+    size_t collectionThreshold;
+    std::atomic<size_t> allocated;        //The bytes that were allocated since the last collection
+    std::atomic<size_t> nextCollection;   //The allocated bytes that request the next collection
+    std::atomic<bool> collectionRequested;
+    std::atomic<bool> collecting;         //Set while the threads stop and the heap is collected
+    std::atomic<vm_ui64> onWorkers;       //The number of threads that are running on a worker
+    std::vector<Thread*> stopped;         //The threads that were held back while the heap is collected
+
+    std::atomic<bool> running;
+
+    void ExpireWaits();
+
+    //Counts a thread as running on a worker unless the heap is being collected, in which case it is held back until
+    //the collection is done. Returns whether the thread can run.
+    bool EnterWorker(Thread* _thread);
+
+    //Stops every thread between two instructions, collects the heap and resumes them
+    void Collect(std::unique_lock<std::mutex>& _lock);
+    void RequestCollection();
 
 public:
-    std::mutex mutex;
+    static constexpr vm_i64 DEFAULT_QUANTUM = 100000;
+
+    std::mutex mutex; //Guards the threads, the exit code and stdout. Threads otherwise run without synchronizing.
 
     VM();
     ~VM();
@@ -81,12 +169,70 @@ public:
     vm_i64 Run(vm_ui64 _stackSize, Program& _prog, const std::vector<std::string> &_cmdLineArgs);
     void Quit(VMExitCode _code);
 
-    ThreadID SpawnThread(vm_ui64 _stackSize, const vm_byte *_startIP, const std::vector<Word> &_args);
+    //Starts a thread with the args on its stack. A thread that is called starts as if _startIP was called with the args
+    //and finishes once that function returns, while others run until the vm quits.
+    ThreadID SpawnThread(vm_ui64 _stackSize, const Instructions::Decoded *_startIP, const std::vector<Word> &_args, bool _call = false);
     Thread &GetThread(vm_ui64 _id);
+
+    //Wakes up to _count threads waiting on the heap word in the order they started to wait and returns how many it woke
+    vm_ui64 Notify(vm_byte* _address, vm_ui64 _count);
+
+    //Returns the decoded instruction at a code address of the running program
+    const Instructions::Decoded* GetInstruction(vm_ui64 _address);
     void SetStdIO(std::streambuf *_in = nullptr, std::streambuf *_out = nullptr);
+    void SetDispatchMode(DispatchMode _mode) { dispatchMode = _mode; }
+    void SetProfiler(Profiler* _profiler) { profiler = _profiler; }
+
+    //Sets how often a function or loop has to execute before TIERED promotes it to superinstructions and to native code
+    void SetTierThresholds(vm_ui32 _fuse, vm_ui32 _compile) { fuseThreshold = _fuse; compileThreshold = _compile; }
+
+    //Sets how many copies of the main thread Run starts at the entry point, which all get the command line args. Only tests
+    //and benchmarks use it, to load the workers with identical threads. Programs start their own threads with SPAWN.
+    void SetThreadCount(vm_ui64 _count) { threadCount = _count; }
+
+    //Sets how many worker threads run the vm's threads. Zero uses one for every hardware thread.
+    void SetWorkerCount(size_t _count) { workerCount = _count; }
+
+    //Sets how much fuel a thread burns before it yields its worker, where backward branches burn the length of
+    //the loop they close and calls burn one. Zero never preempts threads.
+    void SetQuantum(vm_ui64 _quantum) { quantum = _quantum; }
+
+    //Sets how much fuel the threads of a run can burn together before it stops with OUT_OF_FUEL. Zero is unlimited.
+    //The budget is only checked whenever a thread refuels, so a run can overshoot it by up to a quantum.
+    void SetFuelBudget(vm_ui64 _budget) { fuelBudget = _budget; }
+
+    //Collects the heap once _threshold bytes were allocated and again whenever as many bytes as the last collection
+    //kept alive, but at least _threshold, were allocated since. Zero never collects.
+    void SetCollectionThreshold(size_t _threshold) { collectionThreshold = _threshold; }
+
+    //Counts an allocation and requests a collection once enough bytes were allocated since the last one. Returns
+    //whether it did, in which case the allocating thread should yield so that it does not keep allocating until it stops.
+    bool CountAllocation(vm_ui64 _amt)
+    {
+        if (collectionThreshold == 0 || allocated.fetch_add(_amt, std::memory_order_relaxed) + _amt < nextCollection.load(std::memory_order_relaxed))
+            return false;
+
+        RequestCollection();
+        return true;
+    }
+
+    //Returns how much fuel a thread gets every time it refuels
+    vm_i64 GetRefuelAmount() { return quantum != 0 ? (vm_i64)std::min<vm_ui64>(quantum, INT64_MAX) : DEFAULT_QUANTUM; }
+
+    //Sets the dispatch mode of vms that are created afterwards
+    static void SetDefaultDispatchMode(DispatchMode _mode) { defaultDispatchMode = _mode; }
 
     bool IsRunning() { return running; }
+    DispatchMode GetDispatchMode() { return dispatchMode; }
+    DispatchMode GetRunMode() { return runMode; }
+    Profiler* GetProfiler() { return profiler; }
+    JIT* GetJIT() { return jit.get(); }
+    Tiering* GetTiering() { return tiering.get(); }
+    Scheduler* GetScheduler() { return scheduler.get(); }
     std::istream &GetStdIn() { return stdInput; }
     std::ostream &GetStdOut() { return stdOutput; }
     Heap &GetHeap() { return heap; }
+    ChannelTable &GetChannels() { return channels; }
+    ArenaTable &GetArenas() { return arenas; }
+    Collector &GetCollector() { return collector; }
 };
\ No newline at end of file